@@ -0,0 +1,672 @@
+#include "Bench.h"
+#include "Msg.h"
+#include "Params.h"
+#include "Server.h"
+#include "Scales.h"
+#include "Damage.h"
+#include "Encoder.h"
+#include "Synthetic.h"
+#include "Guard.h"
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+namespace {
+
+const size_t warmupFrames = 5; // not in stats, e.g. encoder opening
+const GstClockTime drainTimeout = 5 * GST_SECOND;
+const double lumaTolerance = 45.0;      // PSNR in dB, as stated in Convert.h
+const double chromaTolerance = 40.0;
+const size_t scalesReadSize = 1024;     // as COM port reads go
+const size_t scalesCheckReadSize = 16;  // as expected weights are recorded
+const size_t scalesParserPasses = 50;   // over scales data, for timing
+const size_t maxMismatchMsgs = 10;
+
+// Hands over a frame obtained beforehand, so chained stages are timed apart
+
+class FrameHolder final: public FrameSource
+{
+public:
+    void setFrame(const Frame & frame) {
+        mFrame = frame;
+    }
+
+    virtual Frame getFrame() override {
+        return mFrame;
+    }
+
+private:
+    Frame mFrame;
+};
+
+// Capturing, info panel overlay and damage tracking, chained as in Server
+
+class SourceStages final
+{
+public:
+    SourceStages(std::unique_ptr<PooledFrameSource> pCapturer):
+        mpCapturer(std::move(pCapturer)),
+        mScalesFilter(&mOverlayInput, &mScales),
+        mDamageTracker(&mDamageInput), mFrameNum(0),
+        mCaptureStat("capture"), mOverlayStat("overlay"),
+        mDamageStat("damage") {}
+
+    // deleted
+    SourceStages(const SourceStages &) = delete;
+    SourceStages & operator = (const SourceStages &) = delete;
+
+    Frame getFrame(bool record) {
+        // Weight changes every 10th frame, like slowly loaded scales do
+        Scales::Weight weight;
+        weight.state = Scales::WeightState::stable;
+        weight.value = 1000.0 + (mFrameNum++ / 10) * 0.125;
+        mScales.simulateWeight(weight);
+
+        TimePoint captureStart;
+        Frame frame = mpCapturer->getFrame();
+        if(record)
+            mCaptureStat.add(TimeInterval(captureStart).seconds());
+        if(!frame.valid())
+            return frame;
+
+        TimePoint overlayStart;
+        mOverlayInput.setFrame(frame);
+        frame = mScalesFilter.getFrame();
+        if(record)
+            mOverlayStat.add(TimeInterval(overlayStart).seconds());
+
+        if(Params()->damageTracking) {
+            TimePoint damageStart;
+            mDamageInput.setFrame(frame);
+            frame = mDamageTracker.getFrame();
+            if(record)
+                mDamageStat.add(TimeInterval(damageStart).seconds());
+        }
+        return frame;
+    }
+
+    void appendStats(std::vector<StageStat> & stats) const {
+        stats.push_back(mCaptureStat);
+        stats.push_back(mOverlayStat);
+        if(Params()->damageTracking)
+            stats.push_back(mDamageStat);
+    }
+
+private:
+    std::unique_ptr<PooledFrameSource> mpCapturer;
+    Scales mScales;
+    FrameHolder mOverlayInput;
+    ScalesFilter mScalesFilter;
+    FrameHolder mDamageInput;
+    DamageTracker mDamageTracker;
+    size_t mFrameNum;
+    StageStat mCaptureStat;
+    StageStat mOverlayStat;
+    StageStat mDamageStat;
+};
+
+void onBufferRelease(gpointer pBuffer)
+{
+    PooledBufferRef::attach(static_cast<PooledBuffer *>(pBuffer));
+}
+
+double toMs(double seconds)
+{
+    return seconds * 1000.0;
+}
+
+// In dB, capped at 99 for identical planes
+double psnr(const uint8_t * pPlane1, int stride1,
+            const uint8_t * pPlane2, int stride2, size_t width, size_t height)
+{
+    uint64_t sum = 0;
+    for(size_t y = 0; y < height; ++y) {
+        const uint8_t * pLine1 = pPlane1 + stride1 * y;
+        const uint8_t * pLine2 = pPlane2 + stride2 * y;
+        for(size_t x = 0; x < width; ++x) {
+            int diff = int(pLine1[x]) - int(pLine2[x]);
+            sum += diff * diff;
+        }
+    }
+    if(!sum)
+        return 99.0;
+    double mse = double(sum) / (width * height);
+    return std::min(10.0 * std::log10(255.0 * 255.0 / mse), 99.0);
+}
+
+} // namespace
+
+    //-- class StageStat --//
+
+double StageStat::mean() const
+{
+    if(mSamples.empty())
+        return 0.0;
+    double sum = 0.0;
+    for(double sample: mSamples)
+        sum += sample;
+    return sum / mSamples.size();
+}
+
+double StageStat::percentile(double ratio) const
+{
+    if(mSamples.empty())
+        return 0.0;
+    // Nearest rank
+    std::vector<double> samples = mSamples;
+    size_t rank = size_t(std::ceil(ratio * samples.size()));
+    size_t idx = std::min(std::max(rank, size_t(1)), samples.size()) - 1;
+    std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+    return samples[idx];
+}
+
+double StageStat::max() const
+{
+    if(mSamples.empty())
+        return 0.0;
+    return *std::max_element(mSamples.begin(), mSamples.end());
+}
+
+    //-- class Bench --//
+
+Bench::Bench():
+    mEncodedBytes(0)
+{
+}
+
+void Bench::run()
+{
+    std::vector<FrameSize> frameSizes = {Capturer::screenSize()};
+    if(!Params()->benchSizes.empty()) {
+        if(Params()->capturerType == CapturerType::synthetic)
+            frameSizes = Params()->benchSizes;
+        else
+            Msg(FILELINE) << "Frame size is defined by capturer, "
+                             "benchmark sizes are ignored";
+    }
+
+    std::vector<const char *> presets = Params()->benchPresets;
+    if(presets.empty())
+        presets.push_back(Params()->preset);
+
+    bool gst = (Params()->encoderType == EncoderType::gst);
+    if(gst)
+        Server::initGStreamer();
+
+    for(const FrameSize & frameSize: frameSizes) {
+        checkConverter(frameSize);
+        for(const char * pPreset: presets) {
+            Msg(FILELINE) << "Benchmarking " << (gst ? "gst" : "x264")
+                          << " encoding of " << frameSize.width << "x"
+                          << frameSize.height << " frames with "
+                          << pPreset << " preset";
+            Result result = (gst ? runGst(frameSize, pPreset) :
+                                   runX264(frameSize, pPreset));
+            showResult(result);
+            mResults.push_back(std::move(result));
+        }
+    }
+
+    if(!Params()->benchScales.empty())
+        runScalesParser(Params()->benchScales);
+
+    if(!Params()->benchReport.empty())
+        writeReport(Params()->benchReport);
+}
+
+std::unique_ptr<PooledFrameSource> Bench::createCapturer(const FrameSize & frameSize)
+{
+    if(Params()->capturerType == CapturerType::synthetic) {
+        return std::make_unique<SyntheticCapturer>(
+                    Params()->workload, frameSize, Params()->workloadChanges);
+    }
+    return Capturer::create();
+}
+
+Bench::Result Bench::runX264(const FrameSize & frameSize, const char * pPreset)
+{
+    Result result{"x264", frameSize, pPreset, 0, 0.0, 0, {}};
+
+    SourceStages sourceStages(createCapturer(frameSize));
+    H264Encoder encoder(this, &Bench::onEncodedData);
+    encoder.setPreset(pPreset);
+
+    StageStat convertStat("convert");
+    std::vector<StageStat> bandStats;
+    StageStat encodeStat("encode");
+    StageStat firstDataStat("first-data"); // sub-frame with slice delivery
+    StageStat totalStat("total");
+
+    TimePoint startTime;
+    for(size_t i = 0; i < warmupFrames + Params()->benchFrames; ++i) {
+        bool record = (i >= warmupFrames);
+        if(i == warmupFrames) {
+            mEncodedBytes = 0;
+            startTime.reset();
+        }
+
+        TimePoint frameStart;
+        Frame frame = sourceStages.getFrame(record);
+        if(!frame.valid()) {
+            Msg(FILELINE) << "No frame captured, benchmark run is cut short";
+            break;
+        }
+        encoder.encode(frame);
+        if(!record)
+            continue;
+
+        convertStat.add(encoder.convertSeconds());
+        const std::vector<double> & bandSeconds = encoder.bandSeconds();
+        for(size_t band = bandStats.size(); band < bandSeconds.size(); ++band)
+            bandStats.emplace_back("band" + std::to_string(band));
+        for(size_t band = 0; band < bandSeconds.size(); ++band)
+            bandStats[band].add(bandSeconds[band]);
+        encodeStat.add(encoder.encodeSeconds());
+        if(encoder.firstDataSeconds() > 0.0)
+            firstDataStat.add(encoder.firstDataSeconds());
+        totalStat.add(TimeInterval(frameStart).seconds());
+        result.frameSize = frame.size;
+        ++result.frames;
+    }
+    encoder.flush();
+
+    result.seconds = TimeInterval(startTime).seconds();
+    result.encodedBytes = mEncodedBytes;
+    sourceStages.appendStats(result.stages);
+    result.stages.push_back(convertStat);
+    result.stages.insert(result.stages.end(), bandStats.begin(), bandStats.end());
+    result.stages.push_back(encodeStat);
+    result.stages.push_back(firstDataStat);
+    result.stages.push_back(totalStat);
+    return result;
+}
+
+Bench::Result Bench::runGst(const FrameSize & frameSize, const char * pPreset)
+{
+    Result result{"gst", frameSize, pPreset, 0, 0.0, 0, {}};
+
+    std::ostringstream ss;
+    ss << "appsrc name=benchsrc ! " << Server::encodeDescr(frameSize, pPreset)
+       << " ! appsink name=benchsink sync=false";
+    Msg(FILELINE, 2) << "Pipeline description: \"" << ss.str() << "\"";
+
+    Msg(FILELINE, 2) << "Creating GStreamer pipeline";
+    GError * pError = nullptr;
+    GstElement_Handle hPipeline = gst_parse_launch(ss.str().data(), &pError);
+    if(pError) {
+        Msg(FILELINE) << "Could not create GStreamer pipeline: "
+                      << pError->message;
+        g_error_free(pError);
+        return result;
+    }
+    GstElement_Handle hAppSrc = gst_bin_get_by_name(
+                GST_BIN((GstElement *)hPipeline), "benchsrc");
+    GstElement_Handle hAppSink = gst_bin_get_by_name(
+                GST_BIN((GstElement *)hPipeline), "benchsink");
+    if(!hAppSrc || !hAppSink) {
+        Msg(FILELINE) << "Could not obtain GStreamer appsrc or appsink element";
+        return result;
+    }
+
+    Fps fps = Params()->fps;
+    gst_util_set_object_arg(G_OBJECT((GstElement *)hAppSrc), "format", "time");
+    g_object_set(G_OBJECT((GstElement *)hAppSrc), "caps",
+                 gst_caps_new_simple(
+                     "video/x-raw",
+                     "format", G_TYPE_STRING, "BGRx",
+                     "width", G_TYPE_INT, frameSize.width,
+                     "height", G_TYPE_INT, frameSize.height,
+                     "framerate", GST_TYPE_FRACTION, fps.num, fps.den,
+                     NULL), NULL);
+
+    Msg(FILELINE, 2) << "Starting GStreamer pipeline";
+    if(gst_element_set_state(hPipeline, GST_STATE_PLAYING) ==
+            GST_STATE_CHANGE_FAILURE) {
+        Msg(FILELINE) << "Could not start GStreamer pipeline";
+        return result;
+    }
+    ScopeGuard stateGuard([&hPipeline](){
+        gst_element_set_state(hPipeline, GST_STATE_NULL);
+    });
+
+    SourceStages sourceStages(createCapturer(frameSize));
+    StageStat pushStat("push");
+    StageStat pipelineStat("pipeline");
+    StageStat totalStat("total");
+    mPushedFrames.clear();
+
+    TimePoint startTime;
+    GstClockTime timestamp = 0;
+    for(size_t i = 0; i < warmupFrames + Params()->benchFrames; ++i) {
+        bool record = (i >= warmupFrames);
+        if(i == warmupFrames) {
+            mEncodedBytes = 0;
+            startTime.reset();
+        }
+
+        PushedFrame pushed;
+        pushed.record = record;
+        Frame frame = sourceStages.getFrame(record);
+        if(!frame.valid() || frame.size != frameSize) {
+            Msg(FILELINE) << "No frame captured, benchmark run is cut short";
+            break;
+        }
+
+        GstBuffer_Handle hBuffer;
+        pushed.pushTime.reset();
+        if(frame.buffer) {
+            hBuffer = gst_buffer_new_wrapped_full(
+                        GST_MEMORY_FLAG_READONLY, frame.pPixels,
+                        frame.dataSize(), 0, frame.dataSize(),
+                        PooledBufferRef(frame.buffer).detach(), &onBufferRelease);
+        } else {
+            hBuffer = gst_buffer_new_allocate(NULL, frame.dataSize(), NULL);
+            if(hBuffer)
+                gst_buffer_fill(hBuffer, 0, frame.pPixels, frame.dataSize());
+        }
+        if(!hBuffer) {
+            Msg(FILELINE) << "Could not create GStreamer frame buffer";
+            break;
+        }
+
+        GST_BUFFER_PTS((GstBuffer *)hBuffer) = timestamp;
+        GST_BUFFER_DURATION((GstBuffer *)hBuffer) =
+                gst_util_uint64_scale_int(fps.den, GST_SECOND, fps.num);
+        timestamp += GST_BUFFER_DURATION((GstBuffer *)hBuffer);
+        mPushedFrames[GST_BUFFER_PTS((GstBuffer *)hBuffer)] = pushed;
+
+        GstFlowReturn ret = gst_app_src_push_buffer(
+                    GST_APP_SRC((GstElement *)hAppSrc), hBuffer);
+        hBuffer.reset(); // taken over by appsrc regardless of result
+        if(ret != GST_FLOW_OK) {
+            Msg(FILELINE) << "Could not push GStreamer buffer, error " << ret;
+            break;
+        }
+        if(record) {
+            pushStat.add(TimeInterval(pushed.pushTime).seconds());
+            ++result.frames;
+        }
+
+        pullSamples(hAppSink, 0, pipelineStat, totalStat);
+    }
+
+    Msg(FILELINE, 2) << "Draining GStreamer pipeline";
+    gst_app_src_end_of_stream(GST_APP_SRC((GstElement *)hAppSrc));
+    while(!mPushedFrames.empty()) {
+        if(!pullSamples(hAppSink, drainTimeout, pipelineStat, totalStat)) {
+            if(!gst_app_sink_is_eos(GST_APP_SINK((GstElement *)hAppSink)))
+                Msg(FILELINE) << "Timed out while draining GStreamer pipeline";
+            break;
+        }
+    }
+
+    result.seconds = TimeInterval(startTime).seconds();
+    result.encodedBytes = mEncodedBytes;
+    sourceStages.appendStats(result.stages);
+    result.stages.push_back(pushStat);
+    result.stages.push_back(pipelineStat);
+    result.stages.push_back(totalStat);
+    return result;
+}
+
+size_t Bench::pullSamples(GstElement * pAppSink, GstClockTime timeout,
+                          StageStat & pipelineStat, StageStat & totalStat)
+{
+    size_t pulled = 0;
+    for(;;) {
+        GstSample_Handle hSample = gst_app_sink_try_pull_sample(
+                    GST_APP_SINK(pAppSink), timeout);
+        if(!hSample)
+            return pulled;
+        ++pulled;
+
+        GstBuffer * pBuffer = gst_sample_get_buffer(hSample);
+        if(!pBuffer)
+            continue;
+        auto it = mPushedFrames.find(GST_BUFFER_PTS(pBuffer));
+        if(it == mPushedFrames.end())
+            continue;
+        if(it->second.record) {
+            pipelineStat.add(TimeInterval(it->second.pushTime).seconds());
+            totalStat.add(TimeInterval(it->second.captureTime).seconds());
+            mEncodedBytes += gst_buffer_get_size(pBuffer);
+        }
+        mPushedFrames.erase(it);
+    }
+}
+
+void Bench::checkConverter(const FrameSize & frameSize)
+{
+    Frame frame = createCapturer(frameSize)->getFrame();
+    if(!frame.valid()) {
+        Msg(FILELINE) << "No frame captured, image converter isn't checked";
+        return;
+    }
+
+    const FrameSize targetSizes[] = {
+        frame.size, {frame.size.width / 2, frame.size.height / 2}
+    };
+    for(const FrameSize & targetSize: targetSizes) {
+        if(!I420Converter::supports(frame.size, targetSize))
+            continue;
+
+        AvImage image, swsImage;
+        SwsContext_Handle hSwsCtx = sws_getContext(
+                    frame.size.width, frame.size.height, AV_PIX_FMT_BGRA,
+                    targetSize.width, targetSize.height, AV_PIX_FMT_YUV420P,
+                    SWS_FAST_BILINEAR, NULL, NULL, NULL);
+        if(!hSwsCtx ||
+                image.alloc(targetSize.width, targetSize.height, AV_PIX_FMT_YUV420P) <= 0 ||
+                swsImage.alloc(targetSize.width, targetSize.height, AV_PIX_FMT_YUV420P) <= 0) {
+            Msg(FILELINE) << "Could not prepare image converter check";
+            return;
+        }
+
+        I420Converter(frame.size, targetSize).convert(
+                    frame, image.pPlanes(), image.strides());
+        const uint8_t * pRgbPlanes[4] = {
+            (const uint8_t *)frame.pPixels, nullptr, nullptr, nullptr};
+        int rgbStrides[4] = {
+            int(frame.pitch), 0, 0, 0};
+        sws_scale(hSwsCtx, pRgbPlanes, rgbStrides, 0, frame.size.height,
+                  swsImage.pPlanes(), swsImage.strides());
+
+        double planePsnr[3];
+        for(int plane = 0; plane < 3; ++plane) {
+            size_t shift = (plane ? 1 : 0);
+            planePsnr[plane] = psnr(image.pPlanes(plane), image.strides(plane),
+                                    swsImage.pPlanes(plane), swsImage.strides(plane),
+                                    targetSize.width >> shift, targetSize.height >> shift);
+        }
+        bool ok = (planePsnr[0] >= lumaTolerance &&
+                   planePsnr[1] >= chromaTolerance && planePsnr[2] >= chromaTolerance);
+
+        Msg(FILELINE) << "convert " << frame.size.width << "x" << frame.size.height
+                      << " to " << targetSize.width << "x" << targetSize.height
+                      << " against swscale: PSNR Y " << std::fixed
+                      << std::setprecision(1) << planePsnr[0] << " dB, U "
+                      << planePsnr[1] << " dB, V " << planePsnr[2] << " dB"
+                      << (ok ? "" : ", out of tolerance");
+    }
+}
+
+void Bench::runScalesParser(const std::string & fileName)
+{
+    Msg(FILELINE) << "Benchmarking scales parser on \"" << fileName << "\"";
+
+    std::ifstream dataFile(fileName, std::ios::binary);
+    if(!dataFile) {
+        Msg(FILELINE) << "Could not open scales data file";
+        return;
+    }
+    std::string data((std::istreambuf_iterator<char>(dataFile)),
+                     std::istreambuf_iterator<char>());
+    size_t lineCount = 0;
+    for(size_t pos = 0; pos < data.size(); ++pos) {
+        if(data[pos] == '\n' ||
+           (data[pos] == '\r' && (pos + 1 == data.size() || data[pos + 1] != '\n')))
+            ++lineCount;
+    }
+    if(!lineCount) {
+        Msg(FILELINE) << "No lines in scales data file";
+        return;
+    }
+
+    // Weight after each read, as recorded by the parser taken for reference,
+    // value compared bit-exact
+    std::ifstream expectedFile(fileName + ".expected");
+    if(!expectedFile) {
+        Msg(FILELINE) << "Could not open expected scales weights file, "
+                         "parser is timed only";
+    } else {
+        Scales scales;
+        size_t mismatchCount = 0;
+        std::string line;
+        for(size_t pos = 0; pos < data.size(); pos += scalesCheckReadSize) {
+            ByteBufferRef dataRef = {(uint8_t *)&data[pos],
+                                     std::min(scalesCheckReadSize, data.size() - pos)};
+            const Scales::Weight & weight = scales.simulateData(dataRef);
+            if(!std::getline(expectedFile, line)) {
+                Msg(FILELINE) << "Expected scales weights end at byte " << pos;
+                ++mismatchCount;
+                break;
+            }
+            // Hex bits, as decimal point of the locale may be other than '.'
+            char * pEnd;
+            long state = std::strtol(line.data(), &pEnd, 10);
+            uint64_t bits = std::strtoull(pEnd, nullptr, 16);
+            uint64_t valueBits;
+            std::memcpy(&valueBits, &weight.value, sizeof(valueBits));
+            if(state == long(weight.state) && bits == valueBits)
+                continue;
+            if(++mismatchCount <= maxMismatchMsgs) {
+                double expectedValue;
+                std::memcpy(&expectedValue, &bits, sizeof(expectedValue));
+                Msg(FILELINE) << "Scales weight mismatch after byte " << pos
+                              << ": state " << int(weight.state) << ", value "
+                              << std::setprecision(17) << weight.value
+                              << ", expected state " << state << ", value "
+                              << expectedValue;
+            }
+        }
+        Msg(FILELINE) << "scales parser check: " << lineCount << " lines, "
+                      << mismatchCount << " mismatches";
+    }
+
+    Result result{"scales", {0, 0}, "", lineCount * scalesParserPasses, 0.0,
+                  data.size() * scalesParserPasses, {}};
+    StageStat parseStat("parse");
+    Scales scales;
+    for(size_t pass = 0; pass < scalesParserPasses; ++pass) {
+        TimePoint passStart;
+        for(size_t pos = 0; pos < data.size(); pos += scalesReadSize) {
+            ByteBufferRef dataRef = {(uint8_t *)&data[pos],
+                                     std::min(scalesReadSize, data.size() - pos)};
+            scales.simulateData(dataRef);
+        }
+        double seconds = TimeInterval(passStart).seconds();
+        parseStat.add(seconds);
+        result.seconds += seconds;
+    }
+    result.stages.push_back(parseStat);
+
+    Msg(FILELINE) << "scales parser: " << result.frames << " lines, "
+                  << std::fixed << std::setprecision(0)
+                  << (result.seconds > 0.0 ? result.frames / result.seconds : 0.0)
+                  << " lines/s";
+    mResults.push_back(std::move(result));
+}
+
+void Bench::showResult(const Result & result)
+{
+    Msg(FILELINE) << result.variant << " " << result.frameSize.width << "x"
+                  << result.frameSize.height << " " << result.preset << ": "
+                  << result.frames << " frames, " << std::fixed
+                  << std::setprecision(1)
+                  << (result.seconds > 0.0 ? result.frames / result.seconds : 0.0)
+                  << " fps, " << (result.encodedBytes + 512) / 1024
+                  << " KiB encoded";
+
+    for(const StageStat & stage: result.stages) {
+        Msg() << "    " << std::left << std::setw(10) << stage.name()
+              << std::right << std::fixed << std::setprecision(3)
+              << " mean " << std::setw(8) << toMs(stage.mean())
+              << " ms, p50 " << std::setw(8) << toMs(stage.percentile(0.5))
+              << " ms, p99 " << std::setw(8) << toMs(stage.percentile(0.99))
+              << " ms, max " << std::setw(8) << toMs(stage.max()) << " ms";
+    }
+}
+
+void Bench::writeReport(const std::string & fileName)
+{
+    std::string ext = fileName.substr(std::min(fileName.rfind('.'), fileName.size()));
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    bool json = (ext == ".json");
+
+    Msg(FILELINE) << "Writing benchmark report to \"" << fileName << "\"";
+    std::ofstream file(fileName);
+    if(!file) {
+        Msg(FILELINE) << "Could not open benchmark report file";
+        return;
+    }
+    file << std::fixed;
+
+    if(json) {
+        file << "[\n";
+        for(size_t i = 0; i < mResults.size(); ++i) {
+            const Result & result = mResults[i];
+            file << "  {\"variant\": \"" << result.variant
+                 << "\", \"width\": " << result.frameSize.width
+                 << ", \"height\": " << result.frameSize.height
+                 << ", \"preset\": \"" << result.preset
+                 << "\", \"frames\": " << result.frames
+                 << ", \"fps\": " << std::setprecision(3)
+                 << (result.seconds > 0.0 ? result.frames / result.seconds : 0.0)
+                 << ", \"bytes\": " << result.encodedBytes
+                 << ",\n   \"stages\": {";
+            for(size_t j = 0; j < result.stages.size(); ++j) {
+                const StageStat & stage = result.stages[j];
+                file << (j ? ",\n              " : "")
+                     << "\"" << stage.name() << "\": {"
+                     << "\"mean_ms\": " << toMs(stage.mean())
+                     << ", \"p50_ms\": " << toMs(stage.percentile(0.5))
+                     << ", \"p99_ms\": " << toMs(stage.percentile(0.99))
+                     << ", \"max_ms\": " << toMs(stage.max()) << "}";
+            }
+            file << "}}" << (i + 1 < mResults.size() ? "," : "") << "\n";
+        }
+        file << "]\n";
+    } else {
+        file << "variant,width,height,preset,frames,fps,bytes,"
+                "stage,mean_ms,p50_ms,p99_ms,max_ms\n";
+        for(const Result & result: mResults) {
+            for(const StageStat & stage: result.stages) {
+                file << result.variant << "," << result.frameSize.width
+                     << "," << result.frameSize.height << "," << result.preset
+                     << "," << result.frames << "," << std::setprecision(3)
+                     << (result.seconds > 0.0 ? result.frames / result.seconds : 0.0)
+                     << "," << result.encodedBytes << "," << stage.name()
+                     << "," << toMs(stage.mean())
+                     << "," << toMs(stage.percentile(0.5))
+                     << "," << toMs(stage.percentile(0.99))
+                     << "," << toMs(stage.max()) << "\n";
+            }
+        }
+    }
+
+    if(!file)
+        Msg(FILELINE) << "Could not write benchmark report file";
+}
+
+void Bench::onEncodedData(uint8_t *, size_t size)
+{
+    mEncodedBytes += size;
+}
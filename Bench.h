@@ -0,0 +1,100 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "Frame.h"
+#include "Capturer.h"
+#include "Timing.h"
+#include "GStreamer.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+    //-- class StageStat --//
+
+// Per-frame durations of a single processing stage
+
+class StageStat final
+{
+public:
+    explicit StageStat(const std::string & name):
+        mName(name) {}
+
+    void add(double seconds) {
+        mSamples.push_back(seconds);
+    }
+
+    const std::string & name() const {
+        return mName;
+    }
+    size_t count() const {
+        return mSamples.size();
+    }
+
+    double mean() const;
+    double percentile(double ratio) const; // ratio is in [0, 1]
+    double max() const;
+
+private:
+    std::string mName;
+    std::vector<double> mSamples;
+};
+
+    //-- class Bench --//
+
+// Drives frames from the configured capturer through the same stages Server
+// does, i.e. info panel overlay, damage tracking, conversion and encoding,
+// for every frame size and preset requested. Encoded data is only counted.
+// Reports per-stage mean, median, 99th percentile and max durations along
+// with throughput, so results of different builds can be diffed. Image
+// converter is checked against swscale by PSNR once per frame size. Scales
+// protocol parser is checked and timed on request, on given data file, against
+// weights expected after each read, kept in <data file>.expected
+
+class Bench final
+{
+public:
+    Bench();
+
+    // deleted
+    Bench(const Bench &) = delete;
+    Bench & operator = (const Bench &) = delete;
+
+    void run();
+
+private:
+    struct Result
+    {
+        std::string variant;
+        FrameSize frameSize;
+        std::string preset;
+        size_t frames;      // lines, for scales parser
+        double seconds;     // wall time, warm-up excluded
+        size_t encodedBytes; // parsed ones, for scales parser
+        std::vector<StageStat> stages;
+    };
+    struct PushedFrame
+    {
+        TimePoint captureTime;
+        TimePoint pushTime;
+        bool record;
+    };
+
+    std::unique_ptr<PooledFrameSource> createCapturer(const FrameSize & frameSize);
+    void checkConverter(const FrameSize & frameSize);
+    Result runX264(const FrameSize & frameSize, const char * pPreset);
+    Result runGst(const FrameSize & frameSize, const char * pPreset);
+    size_t pullSamples(GstElement * pAppSink, GstClockTime timeout,
+                       StageStat & pipelineStat, StageStat & totalStat);
+    void runScalesParser(const std::string & fileName);
+    void showResult(const Result & result);
+    void writeReport(const std::string & fileName);
+
+    void onEncodedData(uint8_t * pData, size_t size);
+
+    std::vector<Result> mResults;
+    size_t mEncodedBytes;
+    std::map<GstClockTime, PushedFrame> mPushedFrames; // by timestamp
+};
+
+#endif // BENCH_H
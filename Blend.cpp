@@ -0,0 +1,171 @@
+#include "Blend.h"
+#include "Cpu.h"
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Every channel is blended as
+//     t = S * M + D * (255 - sA) + 1
+//     result = (t + (t >> 8)) >> 8
+// where M is sA for colors and 255 for alpha: exact division by 255
+// with rounding, done in 16 bits. Same as formerly used MMX code.
+// For premultiplied source M is 255 for every channel
+
+using BlendLineFunc = void (*)(Pixel * pTarget, const Pixel * pSource, int width);
+
+inline uint8_t blendChannel(unsigned source, unsigned sourceMul,
+                            unsigned target, unsigned targetMul)
+{
+    unsigned t = source * sourceMul + target * targetMul + 1;
+    return uint8_t((t + (t >> 8)) >> 8);
+}
+
+template <bool premultiplied>
+void blendLineScalar(Pixel * pTarget, const Pixel * pSource, int width)
+{
+    for(int x = 0; x < width; ++x, ++pTarget, ++pSource) {
+        unsigned alpha = (premultiplied ? 255 : pSource->A);
+        unsigned alphaInv = 255 - pSource->A;
+        pTarget->B = blendChannel(pSource->B, alpha, pTarget->B, alphaInv);
+        pTarget->G = blendChannel(pSource->G, alpha, pTarget->G, alphaInv);
+        pTarget->R = blendChannel(pSource->R, alpha, pTarget->R, alphaInv);
+        pTarget->A = blendChannel(pSource->A, 255, pTarget->A, alphaInv);
+    }
+}
+
+#ifdef CPU_X86
+
+// Blends 2 pixels unpacked to 16 bits per channel
+template <bool premultiplied>
+__attribute__((target("sse2")))
+inline __m128i blendWordsSse2(__m128i source, __m128i target)
+{
+    const __m128i alphaMask = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+    const __m128i ff = _mm_set1_epi16(0xff);
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(source, 0xff), 0xff);
+    __m128i sourceMul = (premultiplied ? ff :
+                         _mm_or_si128(_mm_andnot_si128(alphaMask, alpha),
+                                      _mm_and_si128(alphaMask, ff)));
+    __m128i targetMul = _mm_xor_si128(alpha, ff);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(source, sourceMul),
+                              _mm_mullo_epi16(target, targetMul));
+    t = _mm_add_epi16(t, _mm_set1_epi16(1));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+template <bool premultiplied>
+__attribute__((target("sse2")))
+void blendLineSse2(Pixel * pTarget, const Pixel * pSource, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for(; x + 4 <= width; x += 4) {
+        __m128i source = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSource + x));
+        __m128i target = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pTarget + x));
+        __m128i lo = blendWordsSse2<premultiplied>(
+                    _mm_unpacklo_epi8(source, zero), _mm_unpacklo_epi8(target, zero));
+        __m128i hi = blendWordsSse2<premultiplied>(
+                    _mm_unpackhi_epi8(source, zero), _mm_unpackhi_epi8(target, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pTarget + x),
+                         _mm_packus_epi16(lo, hi));
+    }
+    if(x < width)
+        blendLineScalar<premultiplied>(pTarget + x, pSource + x, width - x);
+}
+
+// Same as blendWordsSse2, 4 pixels
+template <bool premultiplied>
+__attribute__((target("avx2")))
+inline __m256i blendWordsAvx2(__m256i source, __m256i target)
+{
+    const __m256i alphaMask = _mm256_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1,
+                                                0, 0, 0, -1, 0, 0, 0, -1);
+    const __m256i ff = _mm256_set1_epi16(0xff);
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(source, 0xff), 0xff);
+    __m256i sourceMul = (premultiplied ? ff :
+                         _mm256_or_si256(_mm256_andnot_si256(alphaMask, alpha),
+                                         _mm256_and_si256(alphaMask, ff)));
+    __m256i targetMul = _mm256_xor_si256(alpha, ff);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(source, sourceMul),
+                                 _mm256_mullo_epi16(target, targetMul));
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(1));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+template <bool premultiplied>
+__attribute__((target("avx2")))
+void blendLineAvx2(Pixel * pTarget, const Pixel * pSource, int width)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int x = 0;
+    for(; x + 8 <= width; x += 8) {
+        __m256i source = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pSource + x));
+        __m256i target = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pTarget + x));
+        __m256i lo = blendWordsAvx2<premultiplied>(
+                    _mm256_unpacklo_epi8(source, zero), _mm256_unpacklo_epi8(target, zero));
+        __m256i hi = blendWordsAvx2<premultiplied>(
+                    _mm256_unpackhi_epi8(source, zero), _mm256_unpackhi_epi8(target, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pTarget + x),
+                            _mm256_packus_epi16(lo, hi));
+    }
+    if(x < width)
+        blendLineSse2<premultiplied>(pTarget + x, pSource + x, width - x);
+}
+
+#endif // CPU_X86
+
+template <bool premultiplied>
+BlendLineFunc blendLineFunc()
+{
+#ifdef CPU_X86
+    if(Cpu::avx2())
+        return blendLineAvx2<premultiplied>;
+    if(Cpu::sse2())
+        return blendLineSse2<premultiplied>;
+#endif
+    return blendLineScalar<premultiplied>;
+}
+
+void blendLines(BlendLineFunc blendLine,
+                Pixel * pTargetPixels, int targetPitch, int width, int height,
+                const Pixel * pSourcePixels, int sourcePitch)
+{
+    for(int y = 0; y < height; ++y) {
+        blendLine(pTargetPixels, pSourcePixels, width);
+        pTargetPixels = addPitch(pTargetPixels, targetPitch);
+        pSourcePixels = addPitch(pSourcePixels, sourcePitch);
+    }
+}
+
+} // namespace
+
+void blendImage(Pixel * pTargetPixels, int targetPitch, int width, int height,
+                const Pixel * pSourcePixels, int sourcePitch)
+{
+    static const BlendLineFunc blendLine = blendLineFunc<false>();
+    blendLines(blendLine, pTargetPixels, targetPitch, width, height,
+               pSourcePixels, sourcePitch);
+}
+
+void blendPremultipliedImage(Pixel * pTargetPixels, int targetPitch, int width, int height,
+                             const Pixel * pSourcePixels, int sourcePitch)
+{
+    static const BlendLineFunc blendLine = blendLineFunc<true>();
+    blendLines(blendLine, pTargetPixels, targetPitch, width, height,
+               pSourcePixels, sourcePitch);
+}
+
+void premultiplyImage(Pixel * pPixels, int pitch, int width, int height)
+{
+    for(int y = 0; y < height; ++y, pPixels = addPitch(pPixels, pitch)) {
+        Pixel * p = pPixels;
+        for(int x = 0; x < width; ++x, ++p) {
+            p->B = blendChannel(p->B, p->A, 0, 0);
+            p->G = blendChannel(p->G, p->A, 0, 0);
+            p->R = blendChannel(p->R, p->A, 0, 0);
+        }
+    }
+}
@@ -3,11 +3,17 @@
 
 #include "Frame.h"
 
-extern "C" {
+// Blends source image with its alpha over the target one, in place.
+// SSE2 or AVX2 code is chosen at runtime, results are the same for all
 
 void blendImage(Pixel * pTargetPixels, int targetPitch, int width, int height,
-                Pixel * pSourcePixels, int sourcePitch);
+                const Pixel * pSourcePixels, int sourcePitch);
 
-}
+// Same for source with color channels premultiplied by its alpha
+void blendPremultipliedImage(Pixel * pTargetPixels, int targetPitch, int width, int height,
+                             const Pixel * pSourcePixels, int sourcePitch);
+
+// Premultiplies color channels by alpha, in place
+void premultiplyImage(Pixel * pPixels, int pitch, int width, int height);
 
 #endif // BLEND_H
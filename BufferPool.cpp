@@ -0,0 +1,86 @@
+#include "BufferPool.h"
+#include "Msg.h"
+
+    //-- class PooledBuffer --//
+
+void PooledBuffer::release()
+{
+    if(mRefCount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    std::shared_ptr<Recycler> pRecycler = mpRecycler;
+    {
+        std::lock_guard<std::mutex> lock(pRecycler->mutex);
+        if(!pRecycler->detached) {
+            pRecycler->freeBuffers.push_back(this);
+            return;
+        }
+    }
+    // Pool has gone, buffer isn't needed anymore
+    --pRecycler->count;
+    delete this;
+}
+
+    //-- class BufferPool --//
+
+BufferPool::BufferPool():
+    mpRecycler(std::make_shared<PooledBuffer::Recycler>())
+{
+    mpRecycler->freeBuffers.reserve(16);
+}
+
+BufferPool::~BufferPool()
+{
+    std::vector<PooledBuffer *> freeBuffers;
+    {
+        std::lock_guard<std::mutex> lock(mpRecycler->mutex);
+        mpRecycler->detached = true;
+        freeBuffers.swap(mpRecycler->freeBuffers);
+    }
+    for(PooledBuffer * pBuffer: freeBuffers) {
+        --mpRecycler->count;
+        delete pBuffer;
+    }
+}
+
+PooledBufferRef BufferPool::acquire(size_t size)
+{
+    PooledBuffer * pBuffer = nullptr;
+    std::vector<PooledBuffer *> staleBuffers;
+    {
+        std::lock_guard<std::mutex> lock(mpRecycler->mutex);
+        std::vector<PooledBuffer *> & freeBuffers = mpRecycler->freeBuffers;
+        while(!freeBuffers.empty() && !pBuffer) {
+            PooledBuffer * pFreeBuffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            if(pFreeBuffer->size() == size)
+                pBuffer = pFreeBuffer;
+            else
+                staleBuffers.push_back(pFreeBuffer);
+        }
+    }
+
+    if(!staleBuffers.empty()) {
+        Msg(FILELINE, 2) << "Freeing " << staleBuffers.size()
+                         << " pooled buffer(s) of stale size";
+        for(PooledBuffer * pStaleBuffer: staleBuffers) {
+            --mpRecycler->count;
+            delete pStaleBuffer;
+        }
+    }
+
+    if(!pBuffer) {
+        pBuffer = new PooledBuffer(size, mpRecycler);
+        ++mpRecycler->count;
+        Msg(FILELINE, 2) << "Allocated pooled buffer of " << size
+                         << " bytes, " << count() << " in pool";
+    }
+
+    pBuffer->addRef();
+    return PooledBufferRef(pBuffer);
+}
+
+size_t BufferPool::count() const
+{
+    return mpRecycler->count;
+}
@@ -0,0 +1,158 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include "Buffer.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/* Qt 5.6.3's GCC 4.9.2 doesn't need it:
+#ifdef __MINGW32__
+#include <mingw.mutex.h>
+#endif
+/**/
+
+class BufferPool;
+class PooledBufferRef;
+
+    //-- class PooledBuffer --//
+
+// Memory block owned by a BufferPool. Reference counted through
+// PooledBufferRef, returns back into the pool when the last reference
+// is dropped (or gets freed if the pool has gone already)
+
+class PooledBuffer final
+{
+public:
+    // deleted
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer & operator = (const PooledBuffer &) = delete;
+
+    uint8_t * pData() {
+        return mData.pData();
+    }
+    size_t size() const {
+        return mData.size();
+    }
+
+private:
+    struct Recycler;
+
+    PooledBuffer(size_t size, const std::shared_ptr<Recycler> & pRecycler):
+        mData(size), mRefCount(0), mpRecycler(pRecycler) {}
+
+    void addRef() {
+        mRefCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    void release();
+
+    ByteBuffer mData;
+    std::atomic<int> mRefCount;
+    std::shared_ptr<Recycler> mpRecycler;
+
+    friend class BufferPool;
+    friend class PooledBufferRef;
+};
+
+    //-- class PooledBufferRef --//
+
+class PooledBufferRef final
+{
+public:
+    PooledBufferRef():
+        mpBuffer(nullptr) {}
+
+    PooledBufferRef(const PooledBufferRef & other):
+        mpBuffer(other.mpBuffer) {
+        if(mpBuffer)
+            mpBuffer->addRef();
+    }
+    PooledBufferRef(PooledBufferRef && other):
+        mpBuffer(other.mpBuffer) {
+        other.mpBuffer = nullptr;
+    }
+    ~PooledBufferRef() {
+        release();
+    }
+    PooledBufferRef & operator = (PooledBufferRef other) {
+        std::swap(mpBuffer, other.mpBuffer);
+        return *this;
+    }
+
+    operator bool() const {
+        return mpBuffer;
+    }
+    uint8_t * pData() {
+        return (mpBuffer ? mpBuffer->pData() : nullptr);
+    }
+    const uint8_t * pData() const {
+        return (mpBuffer ? mpBuffer->pData() : nullptr);
+    }
+    size_t size() const {
+        return (mpBuffer ? mpBuffer->size() : 0);
+    }
+    void release() {
+        if(mpBuffer)
+            mpBuffer->release();
+        mpBuffer = nullptr;
+    }
+
+    // Hand one reference over to C code (e.g. as a destroy notify's
+    // user data) and take it back from there
+    PooledBuffer * detach() {
+        PooledBuffer * pBuffer = mpBuffer;
+        mpBuffer = nullptr;
+        return pBuffer;
+    }
+    static PooledBufferRef attach(PooledBuffer * pBuffer) {
+        return PooledBufferRef(pBuffer);
+    }
+
+private:
+    explicit PooledBufferRef(PooledBuffer * pBuffer):
+        mpBuffer(pBuffer) {}
+
+    PooledBuffer * mpBuffer;
+
+    friend class BufferPool;
+};
+
+    //-- class BufferPool --//
+
+// Hands out reusable buffers of the requested size, so steady-state
+// consumers do no per-request allocation. Thread safe: buffers may be
+// released from any thread
+
+class BufferPool final
+{
+public:
+    BufferPool();
+    ~BufferPool();
+
+    // deleted
+    BufferPool(const BufferPool &) = delete;
+    BufferPool & operator = (const BufferPool &) = delete;
+
+    PooledBufferRef acquire(size_t size);
+
+    size_t count() const; // buffers allocated by pool and not yet freed
+
+private:
+    std::shared_ptr<PooledBuffer::Recycler> mpRecycler;
+};
+
+    //-- struct PooledBuffer::Recycler --//
+
+struct PooledBuffer::Recycler final
+{
+    Recycler():
+        detached(false), count(0) {}
+
+    std::mutex mutex;
+    std::vector<PooledBuffer *> freeBuffers;
+    bool detached;
+    std::atomic<size_t> count;
+};
+
+#endif // BUFFERPOOL_H
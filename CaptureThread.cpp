@@ -0,0 +1,194 @@
+#include "CaptureThread.h"
+#include "Msg.h"
+#include "Trace.h"
+#include <algorithm>
+
+namespace {
+
+const double idleSeconds = 3.0;     // capture pauses if no frames picked
+const double resumeSeconds = 1.0;   // at most, waiting for fresh frame
+
+// Adds damage of a frame never handed out to the next one. If they don't
+// match, e.g. one wasn't tracked, the whole frame is taken as changed
+void mergeDamage(FrameDamage & damage, const FrameDamage & dropped)
+{
+    if(!damage.valid())
+        return;
+    uint8_t * pTiles = damage.tiles.pData();
+    size_t tileCount = damage.grid.area();
+    if(!dropped.valid() || dropped.tileSize != damage.tileSize ||
+            dropped.grid != damage.grid) {
+        std::fill(pTiles, pTiles + tileCount, 1);
+        damage.changed = 100.0;
+        return;
+    }
+    const uint8_t * pDropped = dropped.tiles.pData();
+    for(size_t i = 0; i < tileCount; ++i)
+        pTiles[i] |= pDropped[i];
+    damage.changed = std::min(damage.changed + dropped.changed, 100.0);
+}
+
+} // namespace
+
+    //-- class CaptureThread --//
+
+CaptureThread::CaptureThread(CaptureFunc capture, Fps fps):
+    mCapture(std::move(capture)), mFps(fps), mBackSlot(0), mFrontSlot(1),
+    mMiddleSlot(2), mSerials{0, 0, 0}, mCaptureSerial(0), mFrontSerial(0),
+    mPicked(true), mDroppedFrames(0), mReusedFrames(0),
+    mPaused(false), mStop(false), mStatTimeout(10000),
+    mStatDropped(0), mStatReused(0), mStatFrames(0),
+    mThread(&CaptureThread::captureMain, this)
+{
+}
+
+CaptureThread::~CaptureThread()
+{
+    Msg(FILELINE, 2) << "Stopping capture thread";
+    {
+        std::lock_guard<std::mutex> pauseMutexGuard(mPauseMutex);
+        mStop = true;
+    }
+    mPauseCondition.notify_all();
+    mThread.join();
+    MSG_TRACE(3) << "Capture thread stopped";
+}
+
+Frame CaptureThread::getFrame()
+{
+    mPicked = true;
+
+    bool resumed = false;
+    {
+        std::lock_guard<std::mutex> pauseMutexGuard(mPauseMutex);
+        if(mPaused) {
+            Msg(FILELINE, 2) << "Resuming capture thread";
+            mPaused = false;
+            resumed = true;
+        }
+    }
+    if(resumed)
+        mPauseCondition.notify_all();
+
+    bool picked = pick();
+    if(!mSlots[mFrontSlot].valid()) {
+        // Nothing to hand out yet, however long capturer setup takes, as
+        // consumer has to push something for every frame request
+        MSG_TRACE(3) << "Waiting for the first captured frame";
+        while(!mSlots[mFrontSlot].valid()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            picked = pick() || picked;
+        }
+    } else if(!picked && resumed) {
+        // Held frame is stale, it's worth waiting a bit for a fresh one
+        MSG_TRACE(3) << "Waiting for captured frame";
+        TimePoint waitStart;
+        while(!(picked = pick()) &&
+              TimeInterval(waitStart).seconds() < resumeSeconds)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if(!picked && mSlots[mFrontSlot].valid())
+        ++mReusedFrames;
+    mFrontSerial = mSerials[mFrontSlot];
+
+    ++mStatFrames;
+    updateStat();
+
+    return mSlots[mFrontSlot];
+}
+
+void CaptureThread::captureMain()
+{
+    Msg(FILELINE, 2) << "Starting capture thread at "
+                     << mFps.num << "/" << mFps.den << " fps";
+    FrameTrace::setThreadName("capture");
+    const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(double(mFps.den) / mFps.num));
+    const size_t idleTicks = size_t(idleSeconds * mFps.num / mFps.den);
+
+    size_t unpickedTicks = 0;
+    auto nextTick = std::chrono::steady_clock::now();
+    for(;;) {
+        if(mPicked.exchange(false)) {
+            unpickedTicks = 0;
+        } else if(++unpickedTicks > idleTicks) {
+            std::unique_lock<std::mutex> pauseLock(mPauseMutex);
+            if(!mStop) {
+                Msg(FILELINE, 2) << "No frames picked for a while, pausing capture thread";
+                mPaused = true;
+                mPauseCondition.wait(pauseLock, [this]() {
+                    return (mStop || !mPaused);
+                });
+            }
+            unpickedTicks = 0;
+            nextTick = std::chrono::steady_clock::now();
+        }
+        {
+            std::lock_guard<std::mutex> pauseMutexGuard(mPauseMutex);
+            if(mStop)
+                break;
+        }
+
+        MSG_TRACE(3) << "Capturing frame";
+        FrameTrace::setCapture(++mCaptureSerial);
+        TraceSpan sourceSpan("source");
+        Frame frame = mCapture();
+        sourceSpan.end();
+        publish(std::move(frame));
+
+        nextTick += period;
+        auto now = std::chrono::steady_clock::now();
+        if(nextTick < now) {
+            MSG_TRACE(3) << "Capture is behind the schedule";
+            nextTick = now;
+        }
+        std::this_thread::sleep_until(nextTick);
+    }
+    MSG_TRACE(3) << "Leaving capture thread";
+}
+
+void CaptureThread::publish(Frame && frame)
+{
+    // Consumers compare against the frame they got before, e.g. to skip
+    // repeated ones, so changes of a frame about to be dropped go on with
+    // this one. Middle slot is only made fresh by this thread, and if the
+    // reader picks it meanwhile, damage is overstated, which is harmless
+    unsigned middle = mMiddleSlot.load(std::memory_order_relaxed);
+    if(middle & freshFlag)
+        mergeDamage(frame.damage, mSlots[middle & slotMask].damage);
+
+    mSlots[mBackSlot] = std::move(frame);
+    mSerials[mBackSlot] = mCaptureSerial;
+    unsigned prior = mMiddleSlot.exchange(mBackSlot | freshFlag,
+                                          std::memory_order_acq_rel);
+    if(prior & freshFlag)
+        ++mDroppedFrames;
+    mBackSlot = prior & slotMask;
+    // Buffers of the frame to be overwritten go back into the pool now
+    mSlots[mBackSlot] = Frame();
+}
+
+bool CaptureThread::pick()
+{
+    if(!(mMiddleSlot.load(std::memory_order_relaxed) & freshFlag))
+        return false;
+    unsigned prior = mMiddleSlot.exchange(mFrontSlot, std::memory_order_acq_rel);
+    mFrontSlot = prior & slotMask;
+    return true;
+}
+
+void CaptureThread::updateStat()
+{
+    if(!mStatTimeout)
+        return;
+    size_t dropped = mDroppedFrames;
+    if(mStatFrames > 1) {
+        Msg(FILELINE, 2) << "Capture ring: " << dropped - mStatDropped
+                         << " frames dropped, " << mReusedFrames - mStatReused
+                         << " of " << mStatFrames << " handed out frames reused";
+    }
+    mStatDropped = dropped;
+    mStatReused = mReusedFrames;
+    mStatFrames = 0;
+    mStatTimeout.start();
+}
@@ -0,0 +1,91 @@
+#ifndef CAPTURETHREAD_H
+#define CAPTURETHREAD_H
+
+#include "Frame.h"
+#include "Timing.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/* Qt 5.6.3's GCC 4.9.2 doesn't need it:
+#ifdef __MINGW32__
+#include <mingw.thread.h>
+#include <mingw.mutex.h>
+#include <mingw.condition_variable.h>
+#endif
+/**/
+
+    //-- class CaptureThread --//
+
+// Runs frame capture on its own thread at given fps and hands out the latest
+// completed frame. Frames pass through a lock-free triple buffer: capture
+// thread fills the back slot and swaps it with the middle one, reader swaps
+// middle slot with its front one if a fresher frame is there. So getFrame
+// never waits for capture, except for the very first frame, which it always
+// waits for, so the returned frame is valid, and briefly after resuming:
+// capture pauses when no frames are picked for a while. Damage of
+// dropped frames is merged into the next one, so damage of a handed out
+// frame covers all changes since the previously handed out one.
+// Frames must not be modified by consumers, as the same frame may be
+// handed out more than once
+
+class CaptureThread final: public FrameSource
+{
+public:
+    using CaptureFunc = std::function<Frame()>;
+
+    CaptureThread(CaptureFunc capture, Fps fps);
+    ~CaptureThread();
+
+    // deleted
+    CaptureThread(const CaptureThread &) = delete;
+    CaptureThread & operator = (const CaptureThread &) = delete;
+
+    virtual Frame getFrame() override;
+
+    size_t droppedFrames() const {  // captured, but never handed out
+        return mDroppedFrames;
+    }
+    size_t reusedFrames() const {   // handed out again as no fresh one
+        return mReusedFrames;
+    }
+    uint64_t frameSerial() const {  // capture serial of the last handed out
+        return mFrontSerial;
+    }
+
+private:
+    enum: unsigned {
+        slotMask = 3, freshFlag = 4
+    };
+
+    void captureMain();
+    void publish(Frame && frame);
+    bool pick();
+    void updateStat();
+
+    CaptureFunc mCapture;
+    Fps mFps;
+    Frame mSlots[3];
+    unsigned mBackSlot;                 // owned by capture thread
+    unsigned mFrontSlot;                // owned by reader
+    std::atomic<unsigned> mMiddleSlot;  // with freshFlag if not picked yet
+    uint64_t mSerials[3];               // of slot frames, for frame trace
+    uint64_t mCaptureSerial;            // owned by capture thread
+    uint64_t mFrontSerial;
+    std::atomic<bool> mPicked;
+    std::atomic<size_t> mDroppedFrames;
+    size_t mReusedFrames;
+    std::mutex mPauseMutex;
+    std::condition_variable mPauseCondition;
+    bool mPaused;
+    bool mStop;
+    Timeout mStatTimeout;
+    size_t mStatDropped;
+    size_t mStatReused;
+    size_t mStatFrames;
+    std::thread mThread;
+};
+
+#endif // CAPTURETHREAD_H
@@ -1,13 +1,16 @@
 #include "Capturer.h"
+#include "Synthetic.h"
+#include "Replay.h"
 #include "Msg.h"
 #include "Params.h"
 #include "Guard.h"
 #include "SysHandler.h"
+#include "Trace.h"
 #include <iostream>
 
     //-- class Capturer --//
 
-std::unique_ptr<Capturer> Capturer::create()
+std::unique_ptr<PooledFrameSource> Capturer::create()
 {
     switch(Params()->capturerType) {
         case CapturerType::gdi:
@@ -19,32 +22,41 @@ std::unique_ptr<Capturer> Capturer::create()
         case CapturerType::null:
             Msg(FILELINE) << "Using null screen capturer";
             return std::make_unique<NullCapturer>();
+        case CapturerType::synthetic:
+            Msg(FILELINE) << "Using synthetic workload capturer";
+            return std::make_unique<SyntheticCapturer>(
+                        Params()->workload, Params()->workloadSize,
+                        Params()->workloadChanges);
+        case CapturerType::replay:
+            Msg(FILELINE) << "Using replay capturer";
+            return std::make_unique<ReplayCapturer>(
+                        Params()->replayFile, Params()->replayRate,
+                        Params()->replayFps);
     }
     throw Err(FILELINE) << "No appropriate capturer";
 }
 
-Frame Capturer::getNullFrame(const FrameSize & frameSize)
+FrameSize Capturer::screenSize()
 {
-    Msg(FILELINE, 3) << "Obtaining null frame";
-
-    if(frameSize.area() != mFrameBuf.count()) {
-        Msg(FILELINE, 2) << "(Re)creating null frame buffer";
-        mFrameBuf = Buffer<Pixel>(frameSize.area());
-    }
-
-    /*
-    Pixel * p = mFrameBuf;
-    for(int i = frameSize.area(); i > 0; --i, ++p)
-        *p = {64, 0, 0, 255};
-    /**/
-    memset(mFrameBuf, 64, mFrameBuf.size());
+    if(Params()->capturerType == CapturerType::synthetic)
+        return Params()->workloadSize;
+    if(Params()->capturerType == CapturerType::replay)
+        return ReplayCapturer::fileFrameSize(Params()->replayFile);
+    return {size_t(GetSystemMetrics(SM_CXSCREEN)),
+            size_t(GetSystemMetrics(SM_CYSCREEN))};
+}
 
-    return Frame(frameSize, mFrameBuf);
+FrameSize Capturer::frameSize() const
+{
+    return {size_t(GetSystemMetrics(SM_CXSCREEN)),
+            size_t(GetSystemMetrics(SM_CYSCREEN))};
 }
 
 void Capturer::drawCursor(HDC hDC)
 {
-    Msg(FILELINE, 3) << "Obtaining cursor image";
+    TraceSpan cursorSpan("cursor");
+
+    MSG_TRACE(3) << "Obtaining cursor image";
 
     CURSORINFO curInfo;
     curInfo.cbSize = sizeof(CURSORINFO);
@@ -76,10 +88,7 @@ void Capturer::drawCursor(HDC hDC)
 
 Frame NullCapturer::getFrame()
 {
-    FrameSize frameSize{size_t(GetSystemMetrics(SM_CXSCREEN)),
-                        size_t(GetSystemMetrics(SM_CYSCREEN))};
-
-    return getNullFrame(frameSize);
+    return getNullFrame(frameSize());
 }
 
     //-- class GdiCapturer --//
@@ -91,8 +100,7 @@ GdiCapturer::GdiCapturer():
 
 Frame GdiCapturer::getFrame()
 {
-    FrameSize frameSize{size_t(GetSystemMetrics(SM_CXSCREEN)),
-                        size_t(GetSystemMetrics(SM_CYSCREEN))};
+    FrameSize frameSize = this->frameSize();
 
     if(!mRecoveryTimeout)
         return getNullFrame(frameSize);
@@ -149,13 +157,14 @@ Frame GdiCapturer::getFrame()
         }
     }
 
-    Msg(FILELINE, 3) << "Capturing screen image via GDI";
+    MSG_TRACE(3) << "Capturing screen image via GDI";
     HGDIOBJ_Guard hOldBitmap = SelectObjectGuarded(mhBitmapDC, mhBitmap);
     if(!hOldBitmap) {
         Msg(FILELINE) << "Could not select screen bitmap into DC";
         mRecoveryTimeout.start();
         return getNullFrame(frameSize);
     }
+    TraceSpan captureSpan("capture");
     if(!BitBlt(mhBitmapDC, 0, 0, frameSize.width, frameSize.height,
                mhScreenDC->hDC, 0, 0, SRCCOPY | CAPTUREBLT)) {
         if(GetLastError() == 6) {
@@ -165,16 +174,25 @@ Frame GdiCapturer::getFrame()
             mhScreenDC.release();
             return getFrame();
         } else {
-            Msg(FILELINE, 3) << "Could not capture screen image via GDI, error "
+            MSG_TRACE(3) << "Could not capture screen image via GDI, error "
                              << GetLastError();
             // normal under some circumstances
             return getNullFrame(frameSize);
         }
     }
 
+    captureSpan.end();
+
     drawCursor(mhBitmapDC);
+    GdiFlush();
 
-    return mFrame;
+    // DIB section is reused by the next capture, while the frame handed out
+    // may still be referenced downstream (e.g. wrapped into GStreamer buffer)
+    MSG_TRACE(3) << "Copying bits from bitmap into frame buffer";
+    Frame frame = acquireFrame(frameSize, mFrame.pitch);
+    memcpy(frame.pPixels, mFrame.pPixels, mFrame.dataSize());
+
+    return frame;
 }
 
     //-- class DxCapturer --//
@@ -197,8 +215,7 @@ DxCapturer::~DxCapturer()
 
 Frame DxCapturer::getFrame()
 {
-    FrameSize frameSize{size_t(GetSystemMetrics(SM_CXSCREEN)),
-                        size_t(GetSystemMetrics(SM_CYSCREEN))};
+    FrameSize frameSize = this->frameSize();
 
     if(!mRecoveryTimeout)
         return getNullFrame(frameSize);
@@ -259,15 +276,17 @@ Frame DxCapturer::getFrame()
         }
     }
 
-    Msg(FILELINE, 3) << "Capturing screen image via GDI";
+    MSG_TRACE(3) << "Capturing screen image via GDI";
+    TraceSpan captureSpan("capture");
     hRes = mhDevice->GetFrontBufferData(0, mhSurface);
+    captureSpan.end();
     if(FAILED(hRes)) {
-        Msg(FILELINE, 3) << "Could not capture screen image via DX, error " << hRes;
+        MSG_TRACE(3) << "Could not capture screen image via DX, error " << hRes;
         // normal under some circumstances
         return getNullFrame(frameSize);
     }
 
-    Msg(FILELINE, 3) << "Obtaining offscreen plain surface's DC";
+    MSG_TRACE(3) << "Obtaining offscreen plain surface's DC";
     HDC hSurfaceDC;
     if(FAILED(mhSurface->GetDC(&hSurfaceDC))) {
         Msg(FILELINE) << "Could not obtain offscreen plain surface's DC";
@@ -278,7 +297,7 @@ Frame DxCapturer::getFrame()
         drawCursor(hSurfaceDC);
     }
 
-    Msg(FILELINE, 3) << "Locking offscreen plain surface";
+    MSG_TRACE(3) << "Locking offscreen plain surface";
     D3DLOCKED_RECT lockRect;
     if(FAILED(mhSurface->LockRect(&lockRect, NULL, 0))) {
         Msg(FILELINE) << "Could not lock offscreen plain surface";
@@ -289,14 +308,9 @@ Frame DxCapturer::getFrame()
         mhSurface->UnlockRect();
     });
 
-    mFrame.pitch = lockRect.Pitch;
-    if(mFrameBuf.size() != mFrame.dataSize()) {
-        Msg(FILELINE, 2) << "(Re)creating frame buffer";
-        mFrameBuf = ByteBuffer(mFrame.dataSize());
-        mFrame.pPixels = reinterpret_cast<Pixel *>(mFrameBuf.pData());
-    }
-    Msg(FILELINE, 3) << "Copying bits from surface into frame buffer";
-    memcpy(mFrame.pPixels, lockRect.pBits, mFrame.dataSize());
+    Frame frame = acquireFrame(mFrame.size, lockRect.Pitch);
+    MSG_TRACE(3) << "Copying bits from surface into frame buffer";
+    memcpy(frame.pPixels, lockRect.pBits, frame.dataSize());
 
-    return mFrame;
+    return frame;
 }
@@ -5,28 +5,30 @@
 #include "Frame.h"
 #include "Gdi.h"
 #include "DirectX.h"
-#include "Buffer.h"
+#include "BufferPool.h"
 #include <memory>
 
 enum struct CapturerType {
-    gdi, dx, null
+    gdi, dx, null, synthetic, replay
 };
 
     //-- class Capturer --//
 
-class Capturer: public FrameSource
+// Base of screen capturers. Creates the one of params, which may as well be
+// a source not capturing the screen, e.g. synthetic or replay one
+
+class Capturer: public PooledFrameSource
 {
 public:
-    static std::unique_ptr<Capturer> create();
+    static std::unique_ptr<PooledFrameSource> create();
+    static FrameSize screenSize(); // size of frames to be captured
+
+    virtual FrameSize frameSize() const override;
 
 protected:
     Capturer() = default;
 
-    Frame getNullFrame(const FrameSize & frameSize);
     void drawCursor(HDC hDC);
-
-private:
-    Buffer<Pixel> mFrameBuf;
 };
 
     //-- class NullCapturer --//
@@ -87,7 +89,6 @@ private:
     IDirect3DDevice9_Handle mhDevice;
     IDirect3DSurface9_Handle mhSurface;
     Frame mFrame;
-    ByteBuffer mFrameBuf;
 };
 
 #endif // CAPTURER_H
@@ -0,0 +1,382 @@
+#include "Convert.h"
+#include "Cpu.h"
+#include <algorithm>
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using RowsFunc = void (*)(const Pixel * pLine0, const Pixel * pLine1, size_t width,
+                          uint8_t * pY0, uint8_t * pY1, uint8_t * pU, uint8_t * pV);
+using HalveFunc = void (*)(const Pixel * pLine0, const Pixel * pLine1, size_t width,
+                           Pixel * pTarget);
+
+    //-- scalar kernels --//
+
+inline uint8_t lumaOf(int b, int g, int r)
+{
+    return uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+inline uint8_t chromaUOf(int b, int g, int r)
+{
+    return uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+inline uint8_t chromaVOf(int b, int g, int r)
+{
+    return uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+// Converts a pair of lines into two luma lines and one line of each chroma
+void rowsScalar(const Pixel * pLine0, const Pixel * pLine1, size_t width,
+                uint8_t * pY0, uint8_t * pY1, uint8_t * pU, uint8_t * pV)
+{
+    for(size_t x = 0; x < width; x += 2, pLine0 += 2, pLine1 += 2) {
+        *pY0++ = lumaOf(pLine0[0].B, pLine0[0].G, pLine0[0].R);
+        *pY0++ = lumaOf(pLine0[1].B, pLine0[1].G, pLine0[1].R);
+        *pY1++ = lumaOf(pLine1[0].B, pLine1[0].G, pLine1[0].R);
+        *pY1++ = lumaOf(pLine1[1].B, pLine1[1].G, pLine1[1].R);
+        int b = (pLine0[0].B + pLine0[1].B + pLine1[0].B + pLine1[1].B + 2) >> 2;
+        int g = (pLine0[0].G + pLine0[1].G + pLine1[0].G + pLine1[1].G + 2) >> 2;
+        int r = (pLine0[0].R + pLine0[1].R + pLine1[0].R + pLine1[1].R + 2) >> 2;
+        *pU++ = chromaUOf(b, g, r);
+        *pV++ = chromaVOf(b, g, r);
+    }
+}
+
+// Averages 2x2 pixel blocks of a pair of lines into one line of given width
+void halveScalar(const Pixel * pLine0, const Pixel * pLine1, size_t width,
+                 Pixel * pTarget)
+{
+    for(size_t x = 0; x < width; ++x, pLine0 += 2, pLine1 += 2, ++pTarget) {
+        pTarget->B = (pLine0[0].B + pLine0[1].B + pLine1[0].B + pLine1[1].B + 2) >> 2;
+        pTarget->G = (pLine0[0].G + pLine0[1].G + pLine1[0].G + pLine1[1].G + 2) >> 2;
+        pTarget->R = (pLine0[0].R + pLine0[1].R + pLine1[0].R + pLine1[1].R + 2) >> 2;
+        pTarget->A = (pLine0[0].A + pLine0[1].A + pLine1[0].A + pLine1[1].A + 2) >> 2;
+    }
+}
+
+#ifdef CPU_X86
+
+    //-- SSE2 kernels --//
+
+#define SSE2 __attribute__((target("sse2")))
+
+SSE2 inline __m128i load128(const void * p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+// [a0 b0 a1 b1], [a2 b2 a3 b3] -> [a0+b0 a1+b1 a2+b2 a3+b3]
+SSE2 inline __m128i pairSumsSse2(__m128i m0, __m128i m1)
+{
+    __m128 f0 = _mm_castsi128_ps(m0);
+    __m128 f1 = _mm_castsi128_ps(m1);
+    return _mm_add_epi32(
+                _mm_castps_si128(_mm_shuffle_ps(f0, f1, _MM_SHUFFLE(2, 0, 2, 0))),
+                _mm_castps_si128(_mm_shuffle_ps(f0, f1, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+// Sums 2x2 blocks of 4 pixels from each line: result is 2 pixels in 16 bits
+SSE2 inline __m128i blockSumsSse2(__m128i line0, __m128i line1)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(line0, zero),
+                               _mm_unpacklo_epi8(line1, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(line0, zero),
+                               _mm_unpackhi_epi8(line1, zero));
+    return _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+}
+
+SSE2 inline __m128i blockAvgsSse2(__m128i line0, __m128i line1)
+{
+    return _mm_srli_epi16(_mm_add_epi16(blockSumsSse2(line0, line1),
+                                        _mm_set1_epi16(2)), 2);
+}
+
+SSE2 inline __m128i luma4(__m128i pixels, __m128i coefs)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i sums = pairSumsSse2(
+                _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coefs),
+                _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coefs));
+    return _mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(128)), 8);
+}
+
+SSE2 inline __m128i chroma4(__m128i avgs01, __m128i avgs23, __m128i coefs)
+{
+    __m128i sums = pairSumsSse2(_mm_madd_epi16(avgs01, coefs),
+                                _mm_madd_epi16(avgs23, coefs));
+    return _mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(128)), 8);
+}
+
+SSE2 inline void lumaLine16(const Pixel * pLine, uint8_t * pY, __m128i coefs)
+{
+    __m128i offset = _mm_set1_epi16(16);
+    __m128i y0 = _mm_packs_epi32(luma4(load128(pLine), coefs),
+                                 luma4(load128(pLine + 4), coefs));
+    __m128i y1 = _mm_packs_epi32(luma4(load128(pLine + 8), coefs),
+                                 luma4(load128(pLine + 12), coefs));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(pY),
+                     _mm_packus_epi16(_mm_add_epi16(y0, offset),
+                                      _mm_add_epi16(y1, offset)));
+}
+
+SSE2 void rowsSse2(const Pixel * pLine0, const Pixel * pLine1, size_t width,
+                   uint8_t * pY0, uint8_t * pY1, uint8_t * pU, uint8_t * pV)
+{
+    const __m128i coefsY = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+    const __m128i coefsU = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+    const __m128i coefsV = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+    const __m128i offset = _mm_set1_epi16(128);
+
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16) {
+        lumaLine16(pLine0 + x, pY0 + x, coefsY);
+        lumaLine16(pLine1 + x, pY1 + x, coefsY);
+
+        __m128i avgs01 = blockAvgsSse2(load128(pLine0 + x), load128(pLine1 + x));
+        __m128i avgs23 = blockAvgsSse2(load128(pLine0 + x + 4), load128(pLine1 + x + 4));
+        __m128i avgs45 = blockAvgsSse2(load128(pLine0 + x + 8), load128(pLine1 + x + 8));
+        __m128i avgs67 = blockAvgsSse2(load128(pLine0 + x + 12), load128(pLine1 + x + 12));
+
+        __m128i u = _mm_packs_epi32(chroma4(avgs01, avgs23, coefsU),
+                                    chroma4(avgs45, avgs67, coefsU));
+        __m128i v = _mm_packs_epi32(chroma4(avgs01, avgs23, coefsV),
+                                    chroma4(avgs45, avgs67, coefsV));
+        u = _mm_add_epi16(u, offset);
+        v = _mm_add_epi16(v, offset);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(pU + x / 2), _mm_packus_epi16(u, u));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(pV + x / 2), _mm_packus_epi16(v, v));
+    }
+    if(x < width)
+        rowsScalar(pLine0 + x, pLine1 + x, width - x,
+                   pY0 + x, pY1 + x, pU + x / 2, pV + x / 2);
+}
+
+SSE2 void halveSse2(const Pixel * pLine0, const Pixel * pLine1, size_t width,
+                    Pixel * pTarget)
+{
+    size_t x = 0;
+    for(; x + 4 <= width; x += 4) {
+        __m128i avgs01 = blockAvgsSse2(load128(pLine0 + x * 2), load128(pLine1 + x * 2));
+        __m128i avgs23 = blockAvgsSse2(load128(pLine0 + x * 2 + 4), load128(pLine1 + x * 2 + 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pTarget + x),
+                         _mm_packus_epi16(avgs01, avgs23));
+    }
+    if(x < width)
+        halveScalar(pLine0 + x * 2, pLine1 + x * 2, width - x, pTarget + x);
+}
+
+#undef SSE2
+
+    //-- AVX2 kernels --//
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256i load256(const void * p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+// Same as blockAvgsSse2 per 128-bit lane: pixels 0,1 in low lane, 2,3 in high
+AVX2 inline __m256i blockAvgsAvx2(__m256i line0, __m256i line1)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(line0, zero),
+                                  _mm256_unpacklo_epi8(line1, zero));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(line0, zero),
+                                  _mm256_unpackhi_epi8(line1, zero));
+    __m256i sums = _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi),
+                                    _mm256_unpackhi_epi64(lo, hi));
+    return _mm256_srli_epi16(_mm256_add_epi16(sums, _mm256_set1_epi16(2)), 2);
+}
+
+// 8 pixels into 8 lumas (32 bits each, no offset), in natural order
+AVX2 inline __m256i luma8(__m256i pixels, __m256i coefs)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sums = _mm256_hadd_epi32(
+                _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), coefs),
+                _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), coefs));
+    return _mm256_srai_epi32(_mm256_add_epi32(sums, _mm256_set1_epi32(128)), 8);
+}
+
+// 2 x 4 averaged pixels into 8 chromas (32 bits each, no offset)
+AVX2 inline __m256i chroma8(__m256i avgs0, __m256i avgs1, __m256i coefs)
+{
+    __m256i sums = _mm256_hadd_epi32(_mm256_madd_epi16(avgs0, coefs),
+                                     _mm256_madd_epi16(avgs1, coefs));
+    sums = _mm256_permutevar8x32_epi32(sums, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+    return _mm256_srai_epi32(_mm256_add_epi32(sums, _mm256_set1_epi32(128)), 8);
+}
+
+AVX2 inline void lumaLine32(const Pixel * pLine, uint8_t * pY, __m256i coefs)
+{
+    __m256i offset = _mm256_set1_epi16(16);
+    __m256i y0 = _mm256_packs_epi32(luma8(load256(pLine), coefs),
+                                    luma8(load256(pLine + 8), coefs));
+    __m256i y1 = _mm256_packs_epi32(luma8(load256(pLine + 16), coefs),
+                                    luma8(load256(pLine + 24), coefs));
+    __m256i y = _mm256_packus_epi16(_mm256_add_epi16(y0, offset),
+                                    _mm256_add_epi16(y1, offset));
+    y = _mm256_permutevar8x32_epi32(y, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(pY), y);
+}
+
+AVX2 inline __m128i chromaLine16(__m256i avgs0, __m256i avgs1,
+                                 __m256i avgs2, __m256i avgs3, __m256i coefs)
+{
+    __m256i c = _mm256_packs_epi32(chroma8(avgs0, avgs1, coefs),
+                                   chroma8(avgs2, avgs3, coefs));
+    c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(3, 1, 2, 0));
+    c = _mm256_add_epi16(c, _mm256_set1_epi16(128));
+    c = _mm256_packus_epi16(c, c);
+    c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_castsi256_si128(c);
+}
+
+AVX2 void rowsAvx2(const Pixel * pLine0, const Pixel * pLine1, size_t width,
+                   uint8_t * pY0, uint8_t * pY1, uint8_t * pU, uint8_t * pV)
+{
+    const __m256i coefsY = _mm256_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0,
+                                             25, 129, 66, 0, 25, 129, 66, 0);
+    const __m256i coefsU = _mm256_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0,
+                                             112, -74, -38, 0, 112, -74, -38, 0);
+    const __m256i coefsV = _mm256_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0,
+                                             -18, -94, 112, 0, -18, -94, 112, 0);
+
+    size_t x = 0;
+    for(; x + 32 <= width; x += 32) {
+        lumaLine32(pLine0 + x, pY0 + x, coefsY);
+        lumaLine32(pLine1 + x, pY1 + x, coefsY);
+
+        __m256i avgs0 = blockAvgsAvx2(load256(pLine0 + x), load256(pLine1 + x));
+        __m256i avgs1 = blockAvgsAvx2(load256(pLine0 + x + 8), load256(pLine1 + x + 8));
+        __m256i avgs2 = blockAvgsAvx2(load256(pLine0 + x + 16), load256(pLine1 + x + 16));
+        __m256i avgs3 = blockAvgsAvx2(load256(pLine0 + x + 24), load256(pLine1 + x + 24));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pU + x / 2),
+                         chromaLine16(avgs0, avgs1, avgs2, avgs3, coefsU));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pV + x / 2),
+                         chromaLine16(avgs0, avgs1, avgs2, avgs3, coefsV));
+    }
+    if(x < width)
+        rowsScalar(pLine0 + x, pLine1 + x, width - x,
+                   pY0 + x, pY1 + x, pU + x / 2, pV + x / 2);
+}
+
+AVX2 void halveAvx2(const Pixel * pLine0, const Pixel * pLine1, size_t width,
+                    Pixel * pTarget)
+{
+    size_t x = 0;
+    for(; x + 8 <= width; x += 8) {
+        __m256i avgs0 = blockAvgsAvx2(load256(pLine0 + x * 2), load256(pLine1 + x * 2));
+        __m256i avgs1 = blockAvgsAvx2(load256(pLine0 + x * 2 + 8), load256(pLine1 + x * 2 + 8));
+        __m256i avgs = _mm256_permute4x64_epi64(
+                    _mm256_packus_epi16(avgs0, avgs1), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pTarget + x), avgs);
+    }
+    if(x < width)
+        halveScalar(pLine0 + x * 2, pLine1 + x * 2, width - x, pTarget + x);
+}
+
+#undef AVX2
+
+#endif // CPU_X86
+
+    //-- kernel dispatch --//
+
+struct Kernels
+{
+    const char * name;
+    RowsFunc rows;
+    HalveFunc halve;
+};
+
+Kernels selectKernels()
+{
+#ifdef CPU_X86
+    if(Cpu::avx2())
+        return {"AVX2", rowsAvx2, halveAvx2};
+    if(Cpu::sse2())
+        return {"SSE2", rowsSse2, halveSse2};
+#endif
+    return {"scalar", rowsScalar, halveScalar};
+}
+
+const Kernels & kernels()
+{
+    static const Kernels kernels = selectKernels();
+    return kernels;
+}
+
+} // namespace
+
+    //-- class I420Converter --//
+
+I420Converter::I420Converter(const FrameSize & sourceSize, const FrameSize & targetSize):
+    mSourceSize(sourceSize), mTargetSize(targetSize),
+    mFactor(sourceSize == targetSize ? 1 : 2)
+{
+}
+
+bool I420Converter::supports(const FrameSize & sourceSize, const FrameSize & targetSize)
+{
+    if(targetSize.width % 2 || targetSize.height % 2 ||
+            !targetSize.width || !targetSize.height)
+        return false;
+    return (sourceSize == targetSize ||
+            (sourceSize.width == targetSize.width * 2 &&
+             sourceSize.height == targetSize.height * 2));
+}
+
+const char * I420Converter::kernelName()
+{
+    return kernels().name;
+}
+
+void I420Converter::convert(const Frame & frame,
+                            uint8_t * const pPlanes[], const int strides[]) const
+{
+    convert(frame, pPlanes, strides, 0, mTargetSize.height);
+}
+
+void I420Converter::convert(const Frame & frame,
+                            uint8_t * const pPlanes[], const int strides[],
+                            size_t firstRow, size_t rowCount) const
+{
+    const Kernels & k = kernels();
+
+    size_t lastRow = std::min(firstRow + rowCount, mTargetSize.height);
+    for(size_t y = firstRow; y < lastRow; y += 2) {
+        uint8_t * pY0 = pPlanes[0] + strides[0] * y;
+        uint8_t * pY1 = pY0 + strides[0];
+        uint8_t * pU = pPlanes[1] + strides[1] * (y / 2);
+        uint8_t * pV = pPlanes[2] + strides[2] * (y / 2);
+
+        if(mFactor == 1) {
+            k.rows(frame.pLine(y), frame.pLine(y + 1), mTargetSize.width,
+                   pY0, pY1, pU, pV);
+            continue;
+        }
+
+        // Halved lines go through a small scratch in chunks,
+        // so the whole pass stays in cache
+        const size_t chunkWidth = 256;
+        Pixel halved0[chunkWidth], halved1[chunkWidth];
+        const Pixel * pLines[4] = {
+            frame.pLine(y * 2), frame.pLine(y * 2 + 1),
+            frame.pLine(y * 2 + 2), frame.pLine(y * 2 + 3)};
+        for(size_t x = 0; x < mTargetSize.width; x += chunkWidth) {
+            size_t width = std::min(chunkWidth, mTargetSize.width - x);
+            k.halve(pLines[0] + x * 2, pLines[1] + x * 2, width, halved0);
+            k.halve(pLines[2] + x * 2, pLines[3] + x * 2, width, halved1);
+            k.rows(halved0, halved1, width,
+                   pY0 + x, pY1 + x, pU + x / 2, pV + x / 2);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include "Frame.h"
+
+    //-- class I420Converter --//
+
+// BGRA to I420 conversion with BT.601 limited range coefficients, the same
+// integer formula swscale uses for its C path:
+//     Y = ((66 R + 129 G +  25 B + 128) >> 8) + 16
+//     U = ((-38 R - 74 G + 112 B + 128) >> 8) + 128
+//     V = ((112 R - 94 G -  18 B + 128) >> 8) + 128
+// Chroma is taken from the 2x2 box average of its pixels. For 2:1 downscale
+// every target pixel is the 2x2 box average of source pixels, done in the
+// same pass. SSE2 and AVX2 kernels are chosen at runtime and are bit exact
+// with the scalar one.
+//
+// Tolerance against sws_scale(SWS_FAST_BILINEAR): luma differs by at most
+// one code value at 1:1 (coefficient rounding), chroma and 2:1 luma differ
+// by filter footprint only; expected PSNR is above 45 dB for luma and
+// above 40 dB for chroma on desktop content, as measured by bench for every
+// frame size. Other ratios aren't supported, caller should fall back to
+// sws_scale then
+
+class I420Converter final
+{
+public:
+    I420Converter(const FrameSize & sourceSize, const FrameSize & targetSize);
+
+    static bool supports(const FrameSize & sourceSize, const FrameSize & targetSize);
+    static const char * kernelName();
+
+    void convert(const Frame & frame,
+                 uint8_t * const pPlanes[], const int strides[]) const;
+    // Converts a band of target rows only, first row and row count are even.
+    // Bands don't share any data, so they may be converted in parallel
+    void convert(const Frame & frame,
+                 uint8_t * const pPlanes[], const int strides[],
+                 size_t firstRow, size_t rowCount) const;
+
+private:
+    FrameSize mSourceSize;
+    FrameSize mTargetSize;
+    unsigned mFactor;
+};
+
+#endif // CONVERT_H
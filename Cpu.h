@@ -0,0 +1,35 @@
+#ifndef CPU_H
+#define CPU_H
+
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_X86
+#endif
+
+    //-- class Cpu --//
+
+// Runtime CPU feature detection for choosing SIMD code paths. SIMD
+// functions are compiled with __attribute__((target(...))), so the rest
+// of the program keeps the baseline instruction set
+
+class Cpu final
+{
+public:
+    static bool sse2() {
+#ifdef CPU_X86
+        static const bool supported = __builtin_cpu_supports("sse2");
+        return supported;
+#else
+        return false;
+#endif
+    }
+    static bool avx2() {
+#ifdef CPU_X86
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+#else
+        return false;
+#endif
+    }
+};
+
+#endif // CPU_H
@@ -50,11 +50,11 @@ void Daemon::install(int argc, char * argv[])
         Msg(FILELINE) << "Could not query registry value, error " << res;
         return;
     }
-    Msg(FILELINE, 3) << "Registry value: " << CharText(regValue);
+    MSG_TRACE(3) << "Registry value: " << CharText(regValue);
 
     Msg(FILELINE, 2) << "Building command line";
     Text<TCHAR> cmdLine = getCmdLine(argc, argv);
-    Msg(FILELINE, 3) << "Command line: " << cmdLine;
+    MSG_TRACE(3) << "Command line: " << cmdLine;
     if(regValue == cmdLine) {
         Msg(FILELINE) << "Autorun was installed earlier";
         return;
@@ -102,7 +102,7 @@ void Daemon::start(int argc, char * argv[])
     Text<TCHAR> cmdLine = getCmdLine(argc, argv);
     Buffer<TCHAR> cmdLineBuf(cmdLine.length() + 1);
     memcpy(cmdLineBuf, cmdLine, cmdLine.size());
-    Msg(FILELINE, 3) << "Command line: " << Text<TCHAR>(cmdLineBuf.pData());
+    MSG_TRACE(3) << "Command line: " << Text<TCHAR>(cmdLineBuf.pData());
 
     /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
     SECURITY_ATTRIBUTES secAttr = {};
@@ -157,11 +157,11 @@ void Daemon::kill()
     Msg(FILELINE, 2) << "Obtaining EXE file name";
     Text<TCHAR> exeFullName = getExeFullName();
     Text<TCHAR> exeFileName = PathFindFileName(exeFullName);
-    Msg(FILELINE, 3) << "EXE file name: " << exeFileName;
+    MSG_TRACE(3) << "EXE file name: " << exeFileName;
 
     Msg(FILELINE, 2) << "Obtaining current process PID";
     DWORD currentPid = GetCurrentProcessId();
-    Msg(FILELINE, 3) << "Current process PID: " << currentPid;
+    MSG_TRACE(3) << "Current process PID: " << currentPid;
 
     Msg(FILELINE, 2) << "Obtaining process list snapshot";
     HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPALL, 0);
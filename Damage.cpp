@@ -0,0 +1,167 @@
+#include "Damage.h"
+#include "Msg.h"
+#include "Cpu.h"
+#include <cstring>
+#include <iomanip>
+
+#ifdef CPU_X86
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+using TileHash = DamageTracker::TileHash;
+
+// Fletcher-like checksum in four 32-bit lanes, pixel i of each 4-pixel
+// chunk goes into lane i. Position sensitive and cheap enough to run
+// at memory bandwidth; any single changed pixel always changes it
+
+void hashSpanScalar(const uint8_t * p, size_t count, TileHash & hash)
+{
+    for(; count > 0; p += 16, count = (count > 4 ? count - 4 : 0)) {
+        for(size_t i = 0; i < 4; ++i) {
+            uint32_t value = 0;
+            if(i < count)
+                memcpy(&value, p + i * 4, 4);
+            hash.s1[i] += value;
+            hash.s2[i] += hash.s1[i];
+        }
+    }
+}
+
+#ifdef CPU_X86
+__attribute__((target("sse2")))
+void hashSpanSse2(const uint8_t * p, size_t count, TileHash & hash)
+{
+    __m128i s1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hash.s1));
+    __m128i s2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hash.s2));
+    for(; count >= 4; count -= 4, p += 16) {
+        s1 = _mm_add_epi32(s1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+        s2 = _mm_add_epi32(s2, s1);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(hash.s1), s1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(hash.s2), s2);
+    if(count)
+        hashSpanScalar(p, count, hash);
+}
+#endif
+
+using HashSpanFunc = void (*)(const uint8_t *, size_t, TileHash &);
+
+HashSpanFunc hashSpanFunc()
+{
+#ifdef CPU_X86
+    if(Cpu::sse2())
+        return hashSpanSse2;
+#endif
+    return hashSpanScalar;
+}
+
+uint64_t foldHash(const TileHash & hash)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < 4; ++i) {
+        value = (value ^ hash.s1[i]) * 0x100000001B3ull;
+        value = (value ^ hash.s2[i]) * 0x100000001B3ull;
+    }
+    return value;
+}
+
+} // namespace
+
+    //-- class DamageTracker --//
+
+DamageTracker::DamageTracker(FrameSource * pSource, unsigned tileSize):
+    mpSource(pSource), mTileSize(tileSize), mFrameSize{0, 0}, mGrid{0, 0},
+    mHashesValid(false), mStatTimeout(10000), mStatFrames(0),
+    mStatStaticFrames(0), mStatChanged(0.0)
+{
+}
+
+Frame DamageTracker::getFrame()
+{
+    static const HashSpanFunc hashSpan = hashSpanFunc();
+
+    Frame frame = mpSource->getFrame();
+    if(!frame.valid())
+        return frame;
+
+    if(frame.size != mFrameSize)
+        reset(frame.size);
+
+    MSG_TRACE(3) << "Hashing frame tiles";
+    FrameDamage & damage = frame.damage;
+    damage.tileSize = mTileSize;
+    damage.grid = mGrid;
+    damage.tiles = mTilesPool.acquire(mGrid.area());
+    uint8_t * pTiles = damage.tiles.pData();
+
+    size_t changedArea = 0;
+    for(size_t tileY = 0; tileY < mGrid.height; ++tileY) {
+        size_t top = tileY * mTileSize;
+        size_t height = std::min<size_t>(mTileSize, mFrameSize.height - top);
+
+        memset(mRowHashes.pData(), 0, mRowHashes.size());
+        for(size_t y = top; y < top + height; ++y) {
+            const uint8_t * pLine = reinterpret_cast<const uint8_t *>(frame.pLine(y));
+            for(size_t tileX = 0; tileX < mGrid.width; ++tileX) {
+                size_t left = tileX * mTileSize;
+                size_t width = std::min<size_t>(mTileSize, mFrameSize.width - left);
+                hashSpan(pLine + left * sizeof(Pixel), width, mRowHashes[tileX]);
+            }
+        }
+
+        for(size_t tileX = 0; tileX < mGrid.width; ++tileX) {
+            size_t index = tileY * mGrid.width + tileX;
+            uint64_t hash = foldHash(mRowHashes[tileX]);
+            bool dirty = (!mHashesValid || hash != mHashes[index]);
+            mHashes[index] = hash;
+            pTiles[index] = dirty;
+            if(dirty) {
+                size_t left = tileX * mTileSize;
+                changedArea += height *
+                        std::min<size_t>(mTileSize, mFrameSize.width - left);
+            }
+        }
+    }
+    mHashesValid = true;
+
+    damage.changed = 100.0 * changedArea / mFrameSize.area();
+    MSG_TRACE(3) << "Frame changed by " << std::fixed
+                     << std::setprecision(1) << damage.changed << "%";
+    updateStat(damage.changed);
+
+    return frame;
+}
+
+void DamageTracker::reset(const FrameSize & frameSize)
+{
+    Msg(FILELINE, 2) << "New frame size, damage tracker tables will be recreated";
+    mFrameSize = frameSize;
+    mGrid = {(frameSize.width + mTileSize - 1) / mTileSize,
+             (frameSize.height + mTileSize - 1) / mTileSize};
+    mHashes = Buffer<uint64_t>(mGrid.area());
+    mRowHashes = Buffer<TileHash>(mGrid.width);
+    mHashesValid = false;
+}
+
+void DamageTracker::updateStat(double changed)
+{
+    ++mStatFrames;
+    if(changed <= 0.0)
+        ++mStatStaticFrames;
+    mStatChanged += changed;
+
+    if(!mStatTimeout)
+        return;
+    if(mStatFrames > 1) {
+        Msg(FILELINE, 2) << "Frame damage: " << std::fixed << std::setprecision(1)
+                         << mStatChanged / mStatFrames << "% changed on average, "
+                         << mStatStaticFrames << " of " << mStatFrames
+                         << " frames static";
+    }
+    mStatFrames = 0;
+    mStatStaticFrames = 0;
+    mStatChanged = 0.0;
+    mStatTimeout.start();
+}
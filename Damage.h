@@ -0,0 +1,47 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include "Frame.h"
+#include "Buffer.h"
+#include "BufferPool.h"
+#include "Timing.h"
+
+    //-- class DamageTracker --//
+
+// Hashes frames of the source in fixed size tiles and compares them against
+// tile hashes of the previous frame, attaching FrameDamage to every frame
+
+class DamageTracker final: public FrameSource
+{
+public:
+    DamageTracker(FrameSource * pSource, unsigned tileSize = 64);
+
+    // deleted
+    DamageTracker(const DamageTracker &) = delete;
+    DamageTracker & operator = (const DamageTracker &) = delete;
+
+    virtual Frame getFrame() override;
+
+    struct TileHash {
+        uint32_t s1[4], s2[4];
+    };
+
+private:
+    void reset(const FrameSize & frameSize);
+    void updateStat(double changed);
+
+    FrameSource * mpSource;
+    unsigned mTileSize;
+    FrameSize mFrameSize;
+    FrameSize mGrid;
+    Buffer<uint64_t> mHashes;       // tile hashes of the previous frame
+    Buffer<TileHash> mRowHashes;    // hashes of the current tile row
+    bool mHashesValid;
+    BufferPool mTilesPool;
+    Timeout mStatTimeout;
+    size_t mStatFrames;
+    size_t mStatStaticFrames;
+    double mStatChanged;
+};
+
+#endif // DAMAGE_H
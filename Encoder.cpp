@@ -1,6 +1,67 @@
 #include "Encoder.h"
 #include "Msg.h"
 #include "Params.h"
+#include "Common.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+// Makes x264 emit unchanged macroblocks as skips, which cost nearly nothing
+const float staticQuantOffset = 10.0f;
+
+} // namespace
+
+    //-- struct RateControl --//
+
+void RateControl::merge(const RateControl & other)
+{
+    if(other.bitrate >= 0)
+        bitrate = other.bitrate;
+    if(other.crf >= 0)
+        crf = other.crf;
+    if(other.crfMax >= 0)
+        crfMax = other.crfMax;
+}
+
+void RateControl::request(const RateControl & rateControl)
+{
+    Msg(FILELINE, 2) << "Writing rate control file";
+    std::FILE * pFile = std::fopen(controlFileName().data(), "w");
+    if(!pFile) {
+        Msg(FILELINE) << "Could not write rate control file";
+        return;
+    }
+    std::fprintf(pFile, "%d %d %d\n", rateControl.bitrate,
+                 rateControl.crf, rateControl.crfMax);
+    std::fclose(pFile);
+
+    Msg(FILELINE) << "Rate control change requested";
+}
+
+RateControl RateControl::take()
+{
+    RateControl rateControl;
+    std::FILE * pFile = std::fopen(controlFileName().data(), "r");
+    if(!pFile)
+        return rateControl;
+
+    Msg(FILELINE, 2) << "Reading rate control file";
+    if(std::fscanf(pFile, "%d %d %d", &rateControl.bitrate,
+                   &rateControl.crf, &rateControl.crfMax) != 3) {
+        Msg(FILELINE) << "Invalid rate control file";
+        rateControl = RateControl();
+    }
+    std::fclose(pFile);
+    std::remove(controlFileName().data());
+    return rateControl;
+}
+
+std::string RateControl::controlFileName()
+{
+    return CharText(getTempPath() + "wdvc.rc").str();
+}
 
     //-- class H264Encoder --//
 
@@ -11,30 +72,52 @@ H264Encoder::~H264Encoder()
 
 void H264Encoder::encode(const Frame & frame)
 {
+    mEncodeSeconds = 0.0;
+
+    if(convert(frame))
+        encodeImage(frame, mRepeat, mYuvImage);
+}
+
+void H264Encoder::encode(const Frame & frame, const H264Encoder & source)
+{
+    mConvertSeconds = 0.0;
+    mEncodeSeconds = 0.0;
+
     if(!mRecoveryTimeout)
         return;
 
-    FrameSize encodeSize = frame.size.scaled(Params()->scale)
+    FrameSize encodeSize = frame.size.scaled(mpScale ? *mpScale : Params()->scale)
             .aligned(4).bounded({320, 200}, {1920, 1080});
 
-    if(encodeSize != mEncodeSize) {
-        Msg(FILELINE, 2) << "New frame size, encoder resources will be recreated";
-        flush();
-        mhEncoder.release();
+    if(!mhEncoder && encodeSize != mEncodeSize) {
+        Msg(FILELINE, 2) << "New encode size, encoder resources will be recreated";
         mYuvImage.release();
-        mhConvertCtx.release();
+        mhScaleCtx.release();
         mFrameCount = 0;
+        mSinceKeyframe = 0;
+        mYuvFilled = false;
         mEncodeSize = encodeSize;
     }
 
-    if(!mhConvertCtx) {
-        Msg(FILELINE, 2) << "Obtaining image converter context";
-        mhConvertCtx = sws_getContext(
-                    frame.size.width, frame.size.height, AV_PIX_FMT_BGRA,
+    if(source.mEncodeSize == mEncodeSize) {
+        encodeImage(frame, source.mRepeat, source.mYuvImage);
+        return;
+    }
+
+    if(source.mEncodeSize != mSourceSize) {
+        mhScaleCtx.release();
+        mYuvFilled = false;
+        mSourceSize = source.mEncodeSize;
+    }
+
+    if(!mhScaleCtx) {
+        Msg(FILELINE, 2) << "Obtaining image scaler context";
+        mhScaleCtx = sws_getContext(
+                    mSourceSize.width, mSourceSize.height, AV_PIX_FMT_YUV420P,
                     mEncodeSize.width, mEncodeSize.height, AV_PIX_FMT_YUV420P,
                     SWS_FAST_BILINEAR, NULL, NULL, NULL);
-        if(!mhConvertCtx) {
-            Msg(FILELINE) << "Could not obtain image converter context";
+        if(!mhScaleCtx) {
+            Msg(FILELINE) << "Could not obtain image scaler context";
             mRecoveryTimeout.start();
             return;
         }
@@ -51,75 +134,207 @@ void H264Encoder::encode(const Frame & frame)
         }
     }
 
-    if(!mhEncoder) {
-        /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
-        x264_param_t params = {};
-        /**/
-        x264_param_t params;
-        memset(&params, 0, sizeof(params));
-        /**/
-
-        Msg(FILELINE, 2) << "Obtaining x264 preset";
-        if(x264_param_default_preset(
-                    &params, Params()->preset,
-                    "animation+zerolatency") < 0) {
-            Msg(FILELINE) << "Could not obtain x264 preset";
+    if(source.mRepeat && mYuvFilled) {
+        Msg(FILELINE, 2) << "Repeated image, skipping scaling";
+        ++mRepeatFrames;
+        ++mStatRepeats;
+    } else {
+        // Colour conversion is done by the source already
+        Msg(FILELINE, 2) << "Scaling YUV image";
+        TraceSpan convertSpan("scale");
+        TimePoint convertStart;
+        sws_scale(mhScaleCtx, source.mYuvImage.pPlanes(), source.mYuvImage.strides(),
+                  0, mSourceSize.height, mYuvImage.pPlanes(), mYuvImage.strides());
+        mConvertSeconds = TimeInterval(convertStart).seconds();
+        mYuvFilled = true;
+    }
+    ++mStatFrames;
+
+    encodeImage(frame, source.mRepeat, mYuvImage);
+}
+
+bool H264Encoder::convert(const Frame & frame)
+{
+    mConvertSeconds = 0.0;
+
+    if(!mRecoveryTimeout)
+        return false;
+
+    // Once the encoder is open, its output size stays, so the stream and
+    // its clients go on, while frames of other sizes are scaled to it
+    FrameSize encodeSize = frame.size.scaled(mpScale ? *mpScale : Params()->scale)
+            .aligned(4).bounded({320, 200}, {1920, 1080});
+
+    if(!mhEncoder && encodeSize != mEncodeSize) {
+        Msg(FILELINE, 2) << "New encode size, encoder resources will be recreated";
+        mYuvImage.release();
+        mpConverter.reset();
+        mhConvertCtx.release();
+        mFrameCount = 0;
+        mSinceKeyframe = 0;
+        mYuvFilled = false;
+        mEncodeSize = encodeSize;
+    }
+
+    if(frame.size != mFrameSize) {
+        if(mFrameSize.area())
+            Msg(FILELINE, 2) << "New frame size, image converter will be recreated";
+        mpConverter.reset();
+        mhConvertCtx.release();
+        mYuvFilled = false;
+        mFrameSize = frame.size;
+    }
+
+    mRepeat = detectRepeat(frame);
+
+    if(!mpConverter && !mhConvertCtx &&
+            I420Converter::supports(frame.size, mEncodeSize)) {
+        Msg(FILELINE, 2) << "Using " << I420Converter::kernelName()
+                         << " image converter";
+        mpConverter = std::make_unique<I420Converter>(frame.size, mEncodeSize);
+    }
+
+    if(!mpConverter && !mhConvertCtx) {
+        Msg(FILELINE, 2) << "Obtaining image converter context";
+        mhConvertCtx = sws_getContext(
+                    frame.size.width, frame.size.height, AV_PIX_FMT_BGRA,
+                    mEncodeSize.width, mEncodeSize.height, AV_PIX_FMT_YUV420P,
+                    SWS_FAST_BILINEAR, NULL, NULL, NULL);
+        if(!mhConvertCtx) {
+            Msg(FILELINE) << "Could not obtain image converter context";
             mRecoveryTimeout.start();
-            return;
+            return false;
         }
+    }
 
-        Msg(FILELINE, 2) << "Filling x264 param structure";
-        // Input format:
-        params.i_csp = X264_CSP_I420; // colorspace
-        params.i_width = mEncodeSize.width;
-        params.i_height = mEncodeSize.height;
-        params.b_vfr_input = 0; // constant frame rate
-        params.i_fps_num = Params()->fps.num;
-        params.i_fps_den = Params()->fps.den;
-        // Output control:
-        params.rc.i_rc_method = X264_RC_CRF;
-        params.rc.f_rf_constant =     Params()->crf;
-        params.rc.f_rf_constant_max = Params()->crfMax;
-        if(Params()->bitrate > 0) {
-            params.rc.i_vbv_max_bitrate = Params()->bitrate;
-            params.rc.i_vbv_buffer_size = Params()->bitrate * 2;
-            params.rc.f_vbv_buffer_init = 1.0;
-        }
-        // Frame control:
-        if(Params()->keyint > 0)
-            params.i_keyint_max = Params()->keyint;
-        params.b_intra_refresh =
-                (Params()->intraRefresh ? 1 : 0);
-        // For streaming:
-        params.b_repeat_headers = 1;
-        params.b_annexb = 1;
-        // Processing control:
-        params.i_log_level = X264_LOG_ERROR;
-        params.i_threads = 1;
-
-        Msg(FILELINE, 2) << "Applying x264 profile";
-        if(x264_param_apply_profile(&params, "main") < 0) {
-            Msg(FILELINE) << "Could not apply x264 profile";
+    if(!mYuvImage) {
+        Msg(FILELINE, 2) << "Allocating YUV image";
+        size_t dataSize = mYuvImage.alloc(
+                    mEncodeSize.width, mEncodeSize.height, AV_PIX_FMT_YUV420P);
+        if(dataSize <= 0) {
+            Msg(FILELINE) << "Could not allocate YUV image";
             mRecoveryTimeout.start();
-            return;
+            return false;
         }
+    }
 
-        Msg(FILELINE, 2) << "Opening x264 encoder";
-        mhEncoder = x264_encoder_open(&params);
-        if(!mhEncoder) {
-            Msg(FILELINE) << "Could not open x264 encoder";
-            mRecoveryTimeout.start();
-            return;
+    if(mRepeat && mYuvFilled) {
+        // YUV image still holds the very same picture, and x264 turns it
+        // into skipped macroblocks at almost no cost
+        Msg(FILELINE, 2) << "Repeated image, skipping conversion";
+        mBandSeconds.assign(mBandSeconds.size(), 0.0);
+        ++mRepeatFrames;
+        ++mStatRepeats;
+    } else {
+        Msg(FILELINE, 2) << "Converting and scaling image";
+        TraceSpan convertSpan("convert");
+        TimePoint convertStart;
+        if(mpConverter) {
+            convertBands(frame);
+        } else {
+            // Vertical filter of swscale spans band edges, so it's a single band
+            const uint8_t * pRgbPlanes[4] = {
+                (const uint8_t *)frame.pPixels, nullptr, nullptr, nullptr};
+            int rgbStrides[4] = {
+                int(frame.pitch), 0, 0, 0};
+            sws_scale(mhConvertCtx, pRgbPlanes, rgbStrides, 0, frame.size.height,
+                      mYuvImage.pPlanes(), mYuvImage.strides());
+            mBandSeconds.assign(1, TimeInterval(convertStart).seconds());
         }
+        mConvertSeconds = TimeInterval(convertStart).seconds();
+        mYuvFilled = true;
     }
+    ++mStatFrames;
 
-    Msg(FILELINE, 2) << "Converting and scaling image";
-    const uint8_t * pRgbPlanes[4] = {
-        (const uint8_t *)frame.pPixels, nullptr, nullptr, nullptr};
-    int rgbStrides[4] = {
-        int(frame.pitch), 0, 0, 0};
-    sws_scale(mhConvertCtx, pRgbPlanes, rgbStrides, 0, frame.size.height,
-              mYuvImage.pPlanes(), mYuvImage.strides());
+    return true;
+}
+
+bool H264Encoder::open()
+{
+    if(mhEncoder)
+        return true;
+
+    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
+    x264_param_t params = {};
+    /**/
+    x264_param_t params;
+    memset(&params, 0, sizeof(params));
+    /**/
+
+    Msg(FILELINE, 2) << "Obtaining x264 preset";
+    if(x264_param_default_preset(
+                &params, (mpPreset ? mpPreset : Params()->preset),
+                "animation+zerolatency") < 0) {
+        Msg(FILELINE) << "Could not obtain x264 preset";
+        mRecoveryTimeout.start();
+        return false;
+    }
+
+    Msg(FILELINE, 2) << "Filling x264 param structure";
+    // Input format:
+    params.i_csp = X264_CSP_I420; // colorspace
+    params.i_width = mEncodeSize.width;
+    params.i_height = mEncodeSize.height;
+    params.b_vfr_input = 0; // constant frame rate
+    params.i_fps_num = Params()->fps.num;
+    params.i_fps_den = Params()->fps.den;
+    // Output control:
+    params.rc.i_rc_method = X264_RC_CRF;
+    params.rc.f_vbv_buffer_init = 1.0;
+    applyRateControl(&params);
+    // Frame control:
+    if(Params()->keyint > 0)
+        params.i_keyint_max = Params()->keyint;
+    params.b_intra_refresh =
+            (Params()->intraRefresh ? 1 : 0);
+    // For streaming:
+    params.b_repeat_headers = 1;
+    params.b_annexb = 1;
+    // Processing control:
+    params.i_log_level = X264_LOG_ERROR;
+    params.i_threads = Params()->encoderThreads; // 0 is auto
+    params.b_sliced_threads =
+            (Params()->encoderThreading == EncoderThreading::sliced ? 1 : 0);
+    if(Params()->slices > 0)
+        params.i_slice_count = Params()->slices;
+    // For low latency NALs are delivered as soon as each slice is done
+    mSliceDelivery = Params()->sliceDelivery;
+    if(mSliceDelivery) {
+        params.nalu_process = &onNal0;
+        params.b_sliced_threads = 1;
+        if(Params()->slices == 0)
+            params.i_slice_count = 4;
+    }
+
+    Msg(FILELINE, 2) << "Applying x264 profile";
+    if(x264_param_apply_profile(&params, "main") < 0) {
+        Msg(FILELINE) << "Could not apply x264 profile";
+        mRecoveryTimeout.start();
+        return false;
+    }
+
+    Msg(FILELINE, 2) << "Opening x264 encoder";
+    mhEncoder = x264_encoder_open(&params);
+    if(!mhEncoder) {
+        Msg(FILELINE) << "Could not open x264 encoder";
+        mRecoveryTimeout.start();
+        return false;
+    }
+
+    // x264 may turn adaptive quantization off while validating params
+    x264_encoder_parameters(mhEncoder, &params);
+    mAdaptiveQuant = (params.rc.i_aq_mode != X264_AQ_NONE);
+    if(Params()->quantOffsets && !Params()->intraRefresh && !mAdaptiveQuant)
+        Msg(FILELINE) << "Adaptive quantization is off with this preset, "
+                         "quant offsets are not applied";
+
+    return true;
+}
+
+void H264Encoder::encodeImage(const Frame & frame, bool repeat, const AvImage & yuvImage)
+{
+    if(!open())
+        return;
 
     Msg(FILELINE, 2) << "Filling x264 picture structure";
     /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
@@ -130,14 +345,206 @@ void H264Encoder::encode(const Frame & frame)
     /**/
     picture.i_type = X264_QP_AUTO;
     picture.i_pts = mFrameCount++;
+    picture.opaque = this; // for onNal0
+    if(mKeyframeRequested) {
+        Msg(FILELINE, 2) << "Forcing keyframe";
+        if(Params()->intraRefresh)
+            x264_encoder_intra_refresh(mhEncoder);
+        else
+            picture.i_type = X264_TYPE_IDR;
+        mKeyframeRequested = false;
+    }
+    if(Params()->quantOffsets && !Params()->intraRefresh && mAdaptiveQuant)
+        applyQuantOffsets(frame, repeat, &picture);
     picture.img.i_csp = X264_CSP_I420;
-    picture.img.i_plane = mYuvImage.planeCount();
+    picture.img.i_plane = yuvImage.planeCount();
     for(int i = 0; i < 4; ++i)
-        picture.img.plane[i] = const_cast<uint8_t *>(mYuvImage.pPlanes(i));
+        picture.img.plane[i] = const_cast<uint8_t *>(yuvImage.pPlanes(i));
     for(int i = 0; i < 4; ++i)
-        picture.img.i_stride[i] = mYuvImage.strides(i);
+        picture.img.i_stride[i] = yuvImage.strides(i);
 
+    TraceSpan encodeSpan("encode");
+    TimePoint encodeStart;
     encode(&picture);
+    mEncodeSeconds = TimeInterval(encodeStart).seconds();
+    encodeSpan.end();
+
+    updateStat();
+}
+
+void H264Encoder::reconfigure(const RateControl & rateControl)
+{
+    mRateControl.merge(rateControl);
+    if(!mhEncoder)
+        return; // applied on opening
+
+    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
+    x264_param_t params = {};
+    /**/
+    x264_param_t params;
+    memset(&params, 0, sizeof(params));
+    /**/
+
+    Msg(FILELINE, 2) << "Reconfiguring x264 encoder";
+    x264_encoder_parameters(mhEncoder, &params);
+    // x264 can't turn VBV on unless it was on since opening, and ignores it
+    applyRateControl(&params);
+    if(x264_encoder_reconfig(mhEncoder, &params) < 0) {
+        Msg(FILELINE) << "Could not reconfigure x264 encoder";
+        return;
+    }
+    // What x264 actually took
+    x264_encoder_parameters(mhEncoder, &params);
+    Msg(FILELINE) << "Encoder rate control: crf " << params.rc.f_rf_constant
+                  << "-" << params.rc.f_rf_constant_max << ", bitrate "
+                  << params.rc.i_vbv_max_bitrate << " kbps";
+}
+
+void H264Encoder::applyRateControl(x264_param_t * params) const
+{
+    int bitrate = (mRateControl.bitrate >= 0 ?
+                   mRateControl.bitrate : int(Params()->bitrate));
+    params->rc.f_rf_constant = (mRateControl.crf >= 0 ?
+                                mRateControl.crf : int(Params()->crf));
+    params->rc.f_rf_constant_max = (mRateControl.crfMax >= 0 ?
+                                    mRateControl.crfMax : int(Params()->crfMax));
+    params->rc.i_vbv_max_bitrate = bitrate;
+    params->rc.i_vbv_buffer_size = bitrate * 2;
+}
+
+void H264Encoder::convertBands(const Frame & frame)
+{
+    size_t bandCount = Params()->convertBands;
+    if(!bandCount)
+        bandCount = std::min(std::max(std::thread::hardware_concurrency(), 1u), 8u);
+
+    // Bands consist of row pairs, as a chroma row belongs to two luma rows
+    size_t rowPairs = mEncodeSize.height / 2;
+    bandCount = std::max<size_t>(std::min(bandCount, rowPairs), 1);
+
+    if(bandCount > 1 && (!mpWorkers || mpWorkers->threadCount() != bandCount - 1)) {
+        Msg(FILELINE, 2) << "Creating worker pool for " << bandCount
+                         << " conversion bands";
+        mpWorkers = std::make_unique<WorkerPool>(bandCount - 1);
+    }
+
+    mBandSeconds.assign(bandCount, 0.0);
+    auto convertBand = [this, &frame, rowPairs, bandCount](size_t band) {
+        TimePoint bandStart;
+        size_t firstRow = rowPairs * band / bandCount * 2;
+        size_t lastRow = rowPairs * (band + 1) / bandCount * 2;
+        mpConverter->convert(frame, mYuvImage.pPlanes(), mYuvImage.strides(),
+                             firstRow, lastRow - firstRow);
+        mBandSeconds[band] = TimeInterval(bandStart).seconds();
+    };
+
+    // Returns when all the bands are done, so the picture is complete
+    // before it goes to x264
+    if(bandCount > 1)
+        mpWorkers->run(bandCount, convertBand);
+    else
+        convertBand(0);
+}
+
+bool H264Encoder::detectRepeat(const Frame & frame)
+{
+    if(!Params()->repeatSkip)
+        return false;
+
+    // Damage tracker has compared the frames already, otherwise pixels are
+    // hashed, which is still a fraction of conversion cost
+    if(frame.damage.valid()) {
+        mHashValid = false;
+        return (frame.damage.changed <= 0.0);
+    }
+
+    uint64_t hash = frame.hash();
+    bool repeat = (mHashValid && hash == mLastHash);
+    mLastHash = hash;
+    mHashValid = true;
+    return repeat;
+}
+
+void H264Encoder::applyQuantOffsets(const Frame & frame, bool repeat,
+                                    x264_picture_t * picture)
+{
+    const FrameDamage & damage = frame.damage;
+    if(!damage.valid() && !repeat)
+        return;
+
+    // Static parts of a keyframe would keep their poor quality for the
+    // whole GOP, as they are skipped afterwards. The frame comes out after
+    // the ones x264 holds, and keyframes are counted at output, slice
+    // delivery included
+    unsigned delayedFrames = x264_encoder_delayed_frames(mhEncoder);
+    if(picture->i_pts == 0 || picture->i_type == X264_TYPE_IDR ||
+            (Params()->keyint > 0 &&
+             mSinceKeyframe + delayedFrames + 1 >= Params()->keyint))
+        return;
+
+    size_t mbWidth = (mEncodeSize.width + 15) / 16;
+    size_t mbHeight = (mEncodeSize.height + 15) / 16;
+    mQuantOffsets.resize(mbWidth * mbHeight);
+
+    size_t staticMbs = 0;
+    if(repeat) {
+        std::fill(mQuantOffsets.begin(), mQuantOffsets.end(), staticQuantOffset);
+        staticMbs = mQuantOffsets.size();
+    } else {
+        float * pOffset = mQuantOffsets.data();
+        for(size_t mbY = 0; mbY < mbHeight; ++mbY) {
+            // Frame rows covered by the macroblock row, frame may be scaled
+            size_t y0 = mbY * 16 * frame.size.height / mEncodeSize.height;
+            size_t y1 = std::min(((mbY + 1) * 16 * frame.size.height +
+                                  mEncodeSize.height - 1) / mEncodeSize.height,
+                                 frame.size.height);
+            size_t tileY0 = y0 / damage.tileSize;
+            size_t tileY1 = std::min((y1 + damage.tileSize - 1) / damage.tileSize,
+                                     damage.grid.height);
+            for(size_t mbX = 0; mbX < mbWidth; ++mbX) {
+                size_t x0 = mbX * 16 * frame.size.width / mEncodeSize.width;
+                size_t x1 = std::min(((mbX + 1) * 16 * frame.size.width +
+                                      mEncodeSize.width - 1) / mEncodeSize.width,
+                                     frame.size.width);
+                size_t tileX0 = x0 / damage.tileSize;
+                size_t tileX1 = std::min((x1 + damage.tileSize - 1) / damage.tileSize,
+                                         damage.grid.width);
+                bool dirty = false;
+                for(size_t tileY = tileY0; tileY < tileY1 && !dirty; ++tileY)
+                    for(size_t tileX = tileX0; tileX < tileX1 && !dirty; ++tileX)
+                        dirty = damage.dirty(tileX, tileY);
+                *pOffset++ = (dirty ? 0.0f : staticQuantOffset);
+                staticMbs += (dirty ? 0 : 1);
+            }
+        }
+    }
+
+    // x264 takes the offsets in while the picture is passed to it,
+    // so the buffer is reused for the next frame
+    picture->prop.quant_offsets = mQuantOffsets.data();
+
+    mStaticMbs += staticMbs;
+    mTotalMbs += mQuantOffsets.size();
+}
+
+void H264Encoder::updateStat()
+{
+    if(!mStatTimeout)
+        return;
+
+    if(mTotalMbs > 0) {
+        Msg(FILELINE, 2) << "Quant offsets: " << mStaticMbs * 100 / mTotalMbs
+                         << "% of macroblocks are static, so x264 skips them";
+    }
+    if(mStatFrames > 0) {
+        Msg(FILELINE, 2) << "Repeated frames: " << mStatRepeats << " of "
+                         << mStatFrames << ", their conversion is skipped";
+    }
+    mStaticMbs = 0;
+    mTotalMbs = 0;
+    mStatFrames = 0;
+    mStatRepeats = 0;
+    mStatTimeout.start();
 }
 
 void H264Encoder::flush()
@@ -153,6 +560,12 @@ void H264Encoder::flush()
 void H264Encoder::encode(x264_picture_t * picture)
 {
     Msg(FILELINE, 2) << "Encoding image data";
+    mEncodeStart.reset();
+    mFirstDataSeconds = 0.0;
+    mPendingNals.clear();
+    mNalBufferCount = 0;
+    mNextMb = 0;
+
     x264_picture_t pictureOut;
     x264_nal_t * nals;
     int nalCount;
@@ -163,29 +576,99 @@ void H264Encoder::encode(x264_picture_t * picture)
         mRecoveryTimeout.start();
         return;
     }
+    if(bulkSize > 0)
+        mSinceKeyframe = (pictureOut.b_keyframe ? 0 : mSinceKeyframe + 1);
+
+    if(mSliceDelivery) {
+        // NALs went to sink from onNal() already, unless some slice got
+        // lost, then whatever is left goes in picture order
+        std::lock_guard<std::mutex> lock(mNalMutex);
+        std::sort(mPendingNals.begin(), mPendingNals.end(),
+                  [](const PendingNal & a, const PendingNal & b) {
+                      return a.firstMb < b.firstMb;
+                  });
+        for(const PendingNal & nal: mPendingNals) {
+            mKeyframe = nal.key;
+            deliverNal(nal.pData, nal.size);
+        }
+        mPendingNals.clear();
+        return;
+    }
+
+    // Delayed by frame threads or lookahead. First frames give nothing then,
+    // so need-data goes on encoding fresh frames till data comes out
+    if(!bulkSize)
+        return;
+    mKeyframe = pictureOut.b_keyframe;
 
     if(mNalMode == NalMode::wholeBulk) {
+        mFirstDataSeconds = TimeInterval(mEncodeStart).seconds();
         deliver(nals[0].p_payload, bulkSize);
         return;
     }
 
-    for(int i = 0; i < nalCount; ++i) {
-        uint8_t * pData = nals[i].p_payload;
-        size_t size = nals[i].i_payload;
-        if(mNalMode == NalMode::withoutStartcodes) {
-            Msg(FILELINE, 2) << "Removing encoded data startcodes";
-            if(size >= 3 && pData[0] == 0x00 && pData[1] == 0x00) {
-                if(pData[2] == 0x01) {
-                    pData += 3;
-                    size -= 3;
-                } else
-                if(size >= 4 && pData[2] == 0x00 && pData[3] == 0x01) {
-                    pData += 4;
-                    size -= 4;
-                }
+    for(int i = 0; i < nalCount; ++i)
+        deliverNal(nals[i].p_payload, nals[i].i_payload);
+}
+
+void H264Encoder::onNal0(x264_t * pX264, x264_nal_t * pNal, void * pOpaque)
+{
+    static_cast<H264Encoder *>(pOpaque)->onNal(pX264, pNal);
+}
+
+void H264Encoder::onNal(x264_t * pX264, x264_nal_t * pNal)
+{
+    // Called by slice threads as soon as their NAL is done, maybe out of order
+    std::vector<uint8_t> * pBuffer;
+    {
+        std::lock_guard<std::mutex> lock(mNalMutex);
+        if(mNalBufferCount == mNalBuffers.size())
+            mNalBuffers.emplace_back();
+        pBuffer = &mNalBuffers[mNalBufferCount++];
+    }
+    pBuffer->resize(pNal->i_payload * 3 / 2 + 5 + 64);
+    x264_nal_encode(pX264, pBuffer->data(), pNal);
+
+    std::lock_guard<std::mutex> lock(mNalMutex);
+    bool slice = (pNal->i_type == NAL_SLICE || pNal->i_type == NAL_SLICE_IDR);
+    mPendingNals.push_back({slice ? pNal->i_first_mb : -1, pNal->i_last_mb,
+                            pNal->p_payload, size_t(pNal->i_payload),
+                            pNal->i_type != NAL_SLICE});
+
+    // Parameter sets and SEI come before slices, which go top to bottom
+    for(;;) {
+        auto it = std::find_if(
+                    mPendingNals.begin(), mPendingNals.end(),
+                    [this](const PendingNal & nal) {
+                        return (nal.firstMb < 0 || nal.firstMb == mNextMb);
+                    });
+        if(it == mPendingNals.end())
+            break;
+        if(it->firstMb >= 0)
+            mNextMb = it->lastMb + 1;
+        mKeyframe = it->key;
+        deliverNal(it->pData, it->size);
+        mPendingNals.erase(it);
+    }
+}
+
+void H264Encoder::deliverNal(uint8_t * pData, size_t size)
+{
+    if(mNalMode == NalMode::withoutStartcodes) {
+        Msg(FILELINE, 2) << "Removing encoded data startcodes";
+        if(size >= 3 && pData[0] == 0x00 && pData[1] == 0x00) {
+            if(pData[2] == 0x01) {
+                pData += 3;
+                size -= 3;
+            } else
+            if(size >= 4 && pData[2] == 0x00 && pData[3] == 0x01) {
+                pData += 4;
+                size -= 4;
             }
         }
-        Msg(FILELINE, 2) << "Delivering encoded data";
-        deliver(pData, size);
     }
+    if(mFirstDataSeconds <= 0.0)
+        mFirstDataSeconds = TimeInterval(mEncodeStart).seconds();
+    Msg(FILELINE, 2) << "Delivering encoded data";
+    deliver(pData, size);
 }
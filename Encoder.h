@@ -2,11 +2,58 @@
 #define ENCODER_H
 
 #include "Frame.h"
+#include "Convert.h"
 #include "Sink.h"
 #include "x264.h"
 #include "ffmpeg.h"
 #include "Timing.h"
+#include "WorkerPool.h"
 #include <memory>
+#include <mutex>
+#include <deque>
+#include <string>
+#include <vector>
+
+    //-- enum struct EncoderType --//
+
+enum struct EncoderType {
+    gst,    // x264enc element inside GStreamer pipeline
+    x264    // H264Encoder in process, pushing encoded data to appsrc
+};
+
+    //-- enum struct EncoderThreading --//
+
+enum struct EncoderThreading {
+    sliced, // frame is split into slices encoded in parallel, lowest latency
+    frame   // frames are encoded in parallel, highest throughput, adds delay
+};
+
+    //-- struct RateControl --//
+
+// Rate control settings which may be changed while streaming. They are
+// passed to running process via control file in temp folder, as only those
+// given, so the rest stay as they are
+
+struct RateControl final
+{
+    RateControl():
+        bitrate(-1), crf(-1), crfMax(-1) {}
+
+    bool empty() const {
+        return (bitrate < 0 && crf < 0 && crfMax < 0);
+    }
+    void merge(const RateControl & other);
+
+    static void request(const RateControl & rateControl);
+    static RateControl take(); // pending request, if any, is consumed
+
+    int bitrate;    // in kbps, 0 for no VBV, negative ones are not given
+    int crf;
+    int crfMax;
+
+private:
+    static std::string controlFileName();
+};
 
     //-- class Encoder --//
 
@@ -44,27 +91,144 @@ public:
     H264Encoder(SinkT * pSink, SinkFuncPtr<SinkT> pSinkFunc,
                 NalMode nalMode = NalMode::wholeBulk):
         Encoder(pSink, pSinkFunc), mRecoveryTimeout(3000),
-        mNalMode(nalMode), mFrameCount(0) {}
+        mNalMode(nalMode), mpPreset(nullptr), mpScale(nullptr), mFrameCount(0),
+        mKeyframe(false), mConvertSeconds(0.0), mEncodeSeconds(0.0),
+        mFirstDataSeconds(0.0), mSinceKeyframe(0), mAdaptiveQuant(false),
+        mStaticMbs(0), mTotalMbs(0), mYuvFilled(false), mRepeat(false), mHashValid(false),
+        mLastHash(0),
+        mRepeatFrames(0), mStatFrames(0), mStatRepeats(0),
+        mStatTimeout(10000), mKeyframeRequested(false), mSliceDelivery(false),
+        mNalBufferCount(0), mNextMb(0) {}
 
     ~H264Encoder();
 
     // deleted
-    H264Encoder(const & H264Encoder) = delete;
-    H264Encoder & operator = (const & H264Encoder) = delete;
+    H264Encoder(const H264Encoder &) = delete;
+    H264Encoder & operator = (const H264Encoder &) = delete;
 
     virtual void encode(const Frame & frame) override;
     virtual void flush() override;
 
+    // Encoding in two steps, so the image converted once is encoded by
+    // several encoders of different sizes. Converted image is kept till
+    // the next conversion, and another encoder takes it from here, scaled
+    // to its own size if needed, so colour conversion isn't repeated
+    bool convert(const Frame & frame);
+    void encode(const Frame & frame, const H264Encoder & source);
+
+    // Overrides x264 preset from params, takes effect on encoder reopening
+    void setPreset(const char * pPreset) {
+        mpPreset = pPreset;
+    }
+    // Overrides frame scale from params, takes effect on encoder reopening
+    void setScale(const FrameScale * pScale) {
+        mpScale = pScale;
+    }
+    // Overrides rate control params on the fly, with no new keyframe
+    void reconfigure(const RateControl & rateControl);
+    // Next frame goes as IDR, or starts intra refresh wave if IDRs are off
+    void requestKeyframe() {
+        mKeyframeRequested = true;
+    }
+
+    // Valid while encoded data is being delivered to sink. With slice delivery
+    // it's per NAL, and sink is called from x264 slice threads, one at a time
+    bool keyframe() const {
+        return mKeyframe;
+    }
+
+    // Stage durations of the last encoded frame
+    double convertSeconds() const {
+        return mConvertSeconds;
+    }
+    double encodeSeconds() const {
+        return mEncodeSeconds;
+    }
+    // From encoding start till the first data delivered to sink
+    double firstDataSeconds() const {
+        return mFirstDataSeconds;
+    }
+    // Share of static macroblocks, given quant offsets by frame damage,
+    // since the last stat message
+    double staticRatio() const {
+        return (mTotalMbs ? double(mStaticMbs) / mTotalMbs : 0.0);
+    }
+    // Frames found identical to the previous one, so their conversion was
+    // skipped and x264 got the previous picture again
+    size_t repeatFrames() const {
+        return mRepeatFrames;
+    }
+
+    // Conversion is done in horizontal bands in parallel
+    const std::vector<double> & bandSeconds() const {
+        return mBandSeconds;
+    }
+
 private:
+    bool open();
+    void applyRateControl(x264_param_t * params) const;
+    void encodeImage(const Frame & frame, bool repeat, const AvImage & yuvImage);
     void encode(x264_picture_t * picture);
+    static void onNal0(x264_t * pX264, x264_nal_t * pNal, void * pOpaque);
+    void onNal(x264_t * pX264, x264_nal_t * pNal);
+    void deliverNal(uint8_t * pData, size_t size);
+    void convertBands(const Frame & frame);
+    bool detectRepeat(const Frame & frame);
+    void applyQuantOffsets(const Frame & frame, bool repeat,
+                           x264_picture_t * picture);
+    void updateStat();
 
     Timeout mRecoveryTimeout;
     NalMode mNalMode;
-    FrameSize mEncodeSize;
+    const char * mpPreset;
+    const FrameScale * mpScale;
+    RateControl mRateControl;   // overrides of params
+    FrameSize mFrameSize;
+    FrameSize mEncodeSize;      // fixed since the encoder is open
+    std::unique_ptr<I420Converter> mpConverter; // if not, mhConvertCtx is used
+    std::unique_ptr<WorkerPool> mpWorkers;      // for converter bands
     SwsContext_Handle mhConvertCtx;
+    FrameSize mSourceSize;      // of the image converted by another encoder
+    SwsContext_Handle mhScaleCtx;
     AvImage mYuvImage;
     x264_Handle mhEncoder;
     int mFrameCount;
+    bool mKeyframe;
+    double mConvertSeconds;
+    double mEncodeSeconds;
+    std::vector<double> mBandSeconds;
+    TimePoint mEncodeStart;
+    double mFirstDataSeconds;
+    unsigned mSinceKeyframe;            // frames put out by x264
+    bool mAdaptiveQuant;                // quant offsets work with it only
+    std::vector<float> mQuantOffsets;   // per macroblock
+    size_t mStaticMbs;
+    size_t mTotalMbs;
+    bool mYuvFilled;                    // with the previous frame picture
+    bool mRepeat;                       // frame is the same as the previous
+    bool mHashValid;
+    uint64_t mLastHash;                 // of the previous frame pixels
+    size_t mRepeatFrames;
+    size_t mStatFrames;
+    size_t mStatRepeats;
+    Timeout mStatTimeout;
+    bool mKeyframeRequested;
+
+    // Slice delivery, see onNal()
+    struct PendingNal
+    {
+        int firstMb;        // -1 for non-slice NALs
+        int lastMb;
+        uint8_t * pData;
+        size_t size;
+        bool key;           // not a P or B slice
+    };
+    bool mSliceDelivery;
+    std::mutex mNalMutex;
+    std::deque<std::vector<uint8_t>> mNalBuffers; // stable on growth
+    size_t mNalBufferCount;
+    std::vector<PendingNal> mPendingNals;
+    int mNextMb;
 };
 
 #endif // ENCODER_H
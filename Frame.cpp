@@ -1,4 +1,6 @@
 #include "Frame.h"
+#include "Msg.h"
+#include <cstring>
 
     //-- struct FrameSize --//
 
@@ -32,3 +34,67 @@ FrameSize FrameSize::bounded(const FrameSize & minSize, const FrameSize & maxSiz
         return maxSize;
     return *this;
 }
+
+    //-- struct Frame --//
+
+uint64_t Frame::hash() const
+{
+    // Four independent lanes of 64-bit multiplicative hashing, so multiplies
+    // overlap and it runs close to memory bandwidth
+    const uint64_t prime = 0x100000001B3ull;
+    uint64_t lanes[4] = {
+        0xCBF29CE484222325ull, 0x84222325CBF29CE4ull,
+        0x9E3779B97F4A7C15ull, uint64_t(size.width) << 32 | size.height};
+
+    size_t rowSize = size.width * sizeof(Pixel);
+    for(size_t y = 0; y < size.height; ++y) {
+        const uint8_t * p = reinterpret_cast<const uint8_t *>(pLine(y));
+        size_t i = 0;
+        for(; i + 32 <= rowSize; i += 32) {
+            uint64_t words[4];
+            memcpy(words, p + i, sizeof(words));
+            for(int k = 0; k < 4; ++k)
+                lanes[k] = (lanes[k] ^ words[k]) * prime;
+        }
+        for(; i + 4 <= rowSize; i += 4) {
+            uint32_t word;
+            memcpy(&word, p + i, sizeof(word));
+            lanes[0] = (lanes[0] ^ word) * prime;
+        }
+    }
+
+    uint64_t hash = lanes[0];
+    for(int k = 1; k < 4; ++k)
+        hash = (hash ^ (lanes[k] >> 29) ^ lanes[k]) * prime;
+    return hash;
+}
+
+    //-- class PooledFrameSource --//
+
+Frame PooledFrameSource::acquireFrame(const FrameSize & frameSize, size_t pitch)
+{
+    if(!pitch)
+        pitch = frameSize.width * sizeof(Pixel);
+
+    MSG_TRACE(3) << "Acquiring pooled frame buffer";
+    return Frame(frameSize, pitch, mFramePool.acquire(pitch * frameSize.height));
+}
+
+Frame PooledFrameSource::getNullFrame(const FrameSize & frameSize)
+{
+    MSG_TRACE(3) << "Obtaining null frame";
+
+    if(mNullFrame.size != frameSize) {
+        MSG_TRACE(3) << "Filling null frame";
+        mNullFrame = acquireFrame(frameSize);
+        /*
+        Pixel * p = mNullFrame.pPixels;
+        for(int i = frameSize.area(); i > 0; --i, ++p)
+            *p = {64, 0, 0, 255};
+        /**/
+        memset(mNullFrame.pPixels, 64, mNullFrame.dataSize());
+        mNullFrame.shared = true;
+    }
+
+    return mNullFrame;
+}
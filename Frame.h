@@ -1,6 +1,7 @@
 #ifndef FRAME_H
 #define FRAME_H
 
+#include "BufferPool.h"
 #include <cstddef>
 #include <cstdint>
 
@@ -16,6 +17,11 @@ inline Pixel * addPitch(Pixel * pPixels, size_t pitch)
     return reinterpret_cast<Pixel *>(reinterpret_cast<uint8_t *>(pPixels) + pitch);
 }
 
+inline const Pixel * addPitch(const Pixel * pPixels, size_t pitch)
+{
+    return reinterpret_cast<const Pixel *>(reinterpret_cast<const uint8_t *>(pPixels) + pitch);
+}
+
     //-- struct FrameScale --//
 
 struct FrameScale final
@@ -52,18 +58,50 @@ struct FramePos final
     int x, y;
 };
 
+    //-- struct FrameDamage --//
+
+// Changed areas of a frame against the previous one, in fixed size tiles
+
+struct FrameDamage final
+{
+    FrameDamage():
+        tileSize(0), grid{0, 0}, changed(100.0) {}
+
+    bool valid() const {
+        return tiles;
+    }
+    bool dirty(size_t tileX, size_t tileY) const {
+        return tiles.pData()[tileY * grid.width + tileX];
+    }
+
+    unsigned tileSize;      // in pixels
+    FrameSize grid;         // in tiles
+    double changed;         // changed area, in percent
+    PooledBufferRef tiles;  // byte per tile, nonzero if tile changed
+};
+
     //-- struct Frame --//
 
 struct Frame final
 {
-    Frame() = default;
+    Frame():
+        size{0, 0}, pitch(0), pPixels(nullptr), shared(false) {}
 
     Frame(const FrameSize & size, Pixel * pData = nullptr):
-        size(size), pitch(size.width * sizeof(Pixel)), pPixels(pData) {}
+        size(size), pitch(size.width * sizeof(Pixel)), pPixels(pData),
+        shared(false) {}
+
+    Frame(const FrameSize & size, size_t pitch, PooledBufferRef buffer):
+        size(size), pitch(pitch),
+        pPixels(reinterpret_cast<Pixel *>(buffer.pData())),
+        buffer(std::move(buffer)), shared(false) {}
 
     Pixel * pLine(int index) {
         return addPitch(pPixels, pitch * index);
     }
+    const Pixel * pLine(int index) const {
+        return addPitch(pPixels, pitch * index);
+    }
     size_t dataSize() const {
         return pitch * size.height;
     }
@@ -72,9 +110,15 @@ struct Frame final
                 pitch >= size.width * sizeof(Pixel) && pPixels);
     }
 
+    // Of pixel data only, for telling repeated frames apart
+    uint64_t hash() const;
+
     FrameSize size; // in pixels
     size_t pitch;   // in bytes
     Pixel * pPixels;
+    PooledBufferRef buffer; // holds pPixels if frame came from a pool
+    bool shared;            // pixels are reused by the source, copy to modify
+    FrameDamage damage;     // valid if frame passed damage tracking
 };
 
     //-- class FrameSource --//
@@ -87,6 +131,28 @@ public:
     virtual Frame getFrame() = 0;
 };
 
+    //-- class PooledFrameSource --//
+
+// Frame source producing frames of its own, in buffers of its pool. Has no
+// platform dependencies, so sources not tied to screen build anywhere
+
+class PooledFrameSource: public FrameSource
+{
+public:
+    // Size of frames to come, known before the first one
+    virtual FrameSize frameSize() const = 0;
+
+protected:
+    PooledFrameSource() = default;
+
+    Frame acquireFrame(const FrameSize & frameSize, size_t pitch = 0);
+    Frame getNullFrame(const FrameSize & frameSize);
+
+private:
+    BufferPool mFramePool;
+    Frame mNullFrame; // filled once per size, then shared
+};
+
     //-- struct Fps --//
 
 struct Fps final
@@ -41,6 +41,16 @@ inline void GstBuffer_Handle::close()
     gst_buffer_unref(mHandle);
 }
 
+    //-- class GstSample_Handle --//
+
+using GstSample_Handle = Handle<GstSample *>;
+
+template <>
+inline void GstSample_Handle::close()
+{
+    gst_sample_unref(mHandle);
+}
+
     //-- class GstRTSPMountPoints_Handle --//
 
 using GstRTSPMountPoints_Handle = Handle<GstRTSPMountPoints *>;
@@ -0,0 +1,137 @@
+#include "Glyphs.h"
+#include <cstring>
+
+namespace {
+
+const size_t fontWidth = 5;
+const size_t fontHeight = 9; // 7 above baseline, 2 for descenders
+const size_t fontAdvance = 6;
+
+struct GlyphData
+{
+    char code;
+    const char * rows[fontHeight]; // missing rows are blank
+};
+
+const GlyphData glyphData[] = {
+    {'?', {" ### ", "#   #", "    #", "   # ", "  #  ", "     ", "  #  "}},
+    {' ', {}},
+    {'-', {"     ", "     ", "     ", "#####"}},
+    {'.', {"     ", "     ", "     ", "     ", "     ", " ##  ", " ##  "}},
+    {':', {"     ", " ##  ", " ##  ", "     ", " ##  ", " ##  "}},
+    {'0', {" ### ", "#   #", "#  ##", "# # #", "##  #", "#   #", " ### "}},
+    {'1', {"  #  ", " ##  ", "  #  ", "  #  ", "  #  ", "  #  ", " ### "}},
+    {'2', {" ### ", "#   #", "    #", "   # ", "  #  ", " #   ", "#####"}},
+    {'3', {"#####", "   # ", "  #  ", "   # ", "    #", "#   #", " ### "}},
+    {'4', {"   # ", "  ## ", " # # ", "#  # ", "#####", "   # ", "   # "}},
+    {'5', {"#####", "#    ", "#### ", "    #", "    #", "#   #", " ### "}},
+    {'6', {"  ## ", " #   ", "#    ", "#### ", "#   #", "#   #", " ### "}},
+    {'7', {"#####", "    #", "   # ", "  #  ", " #   ", " #   ", " #   "}},
+    {'8', {" ### ", "#   #", "#   #", " ### ", "#   #", "#   #", " ### "}},
+    {'9', {" ### ", "#   #", "#   #", " ####", "    #", "   # ", " ##  "}},
+    {'E', {"#####", "#    ", "#    ", "#### ", "#    ", "#    ", "#####"}},
+    {'F', {"#####", "#    ", "#    ", "#### ", "#    ", "#    ", "#    "}},
+    {'G', {" ### ", "#   #", "#    ", "# ###", "#   #", "#   #", " ####"}},
+    {'H', {"#   #", "#   #", "#   #", "#####", "#   #", "#   #", "#   #"}},
+    {'J', {"  ###", "   # ", "   # ", "   # ", "   # ", "#  # ", " ##  "}},
+    {'L', {"#    ", "#    ", "#    ", "#    ", "#    ", "#    ", "#####"}},
+    {'M', {"#   #", "## ##", "# # #", "# # #", "#   #", "#   #", "#   #"}},
+    {'N', {"#   #", "#   #", "##  #", "# # #", "#  ##", "#   #", "#   #"}},
+    {'O', {" ### ", "#   #", "#   #", "#   #", "#   #", "#   #", " ### "}},
+    {'R', {"#### ", "#   #", "#   #", "#### ", "# #  ", "#  # ", "#   #"}},
+    {'S', {" ####", "#    ", "#    ", " ### ", "    #", "    #", "#### "}},
+    {'T', {"#####", "  #  ", "  #  ", "  #  ", "  #  ", "  #  ", "  #  "}},
+    {'V', {"#   #", "#   #", "#   #", "#   #", "#   #", " # # ", "  #  "}},
+    {'W', {"#   #", "#   #", "#   #", "# # #", "# # #", "# # #", " # # "}},
+    {'a', {"     ", "     ", " ### ", "    #", " ####", "#   #", " ####"}},
+    {'b', {"#    ", "#    ", "# ## ", "##  #", "#   #", "#   #", "#### "}},
+    {'c', {"     ", "     ", " ### ", "#    ", "#    ", "#   #", " ### "}},
+    {'d', {"    #", "    #", " ## #", "#  ##", "#   #", "#   #", " ####"}},
+    {'e', {"     ", "     ", " ### ", "#   #", "#####", "#    ", " ### "}},
+    {'g', {"     ", "     ", " ####", "#   #", "#   #", "#   #", " ####", "    #", " ### "}},
+    {'k', {"#    ", "#    ", "#  # ", "# #  ", "##   ", "# #  ", "#  # "}},
+    {'l', {" ##  ", "  #  ", "  #  ", "  #  ", "  #  ", "  #  ", " ### "}},
+    {'o', {"     ", "     ", " ### ", "#   #", "#   #", "#   #", " ### "}},
+    {'r', {"     ", "     ", "# ## ", "##  #", "#    ", "#    ", "#    "}},
+    {'s', {"     ", "     ", " ####", "#    ", " ### ", "    #", "#### "}},
+    {'t', {" #   ", " #   ", "#### ", " #   ", " #   ", " #  #", "  ## "}},
+    {'w', {"     ", "     ", "#   #", "#   #", "# # #", "# # #", " # # "}},
+    {'z', {"     ", "     ", "#####", "   # ", "  #  ", " #   ", "#####"}},
+};
+
+const size_t glyphCount = sizeof(glyphData) / sizeof(glyphData[0]);
+
+inline uint8_t blendChannel(unsigned source, unsigned target, unsigned alpha)
+{
+    unsigned t = source * alpha + target * (255 - alpha) + 1;
+    return uint8_t((t + (t >> 8)) >> 8);
+}
+
+} // namespace
+
+    //-- class GlyphAtlas --//
+
+GlyphAtlas::GlyphAtlas(unsigned scale, bool bold):
+    mGlyphSize{fontWidth * scale + (bold ? 1 : 0), fontHeight * scale},
+    mAdvance(fontAdvance * scale), mAtlasWidth(mGlyphSize.width * glyphCount),
+    mCoverage(mAtlasWidth * mGlyphSize.height)
+{
+    for(int & index: mIndexes)
+        index = -1;
+    memset(mCoverage.pData(), 0, mCoverage.size());
+
+    for(size_t i = 0; i < glyphCount; ++i) {
+        const GlyphData & data = glyphData[i];
+        mIndexes[int(data.code)] = i;
+        for(size_t row = 0; row < fontHeight; ++row) {
+            const char * pRow = data.rows[row];
+            for(size_t col = 0; pRow && col < fontWidth && pRow[col]; ++col) {
+                if(pRow[col] == ' ')
+                    continue;
+                for(size_t y = row * scale; y < (row + 1) * scale; ++y) {
+                    uint8_t * pLine = mCoverage.pData() + y * mAtlasWidth +
+                            i * mGlyphSize.width;
+                    // bold is one pixel wider stroke
+                    memset(pLine + col * scale, 255, scale + (bold ? 1 : 0));
+                }
+            }
+        }
+    }
+}
+
+size_t GlyphAtlas::textWidth(const std::string & text) const
+{
+    return (text.empty() ? 0 : (text.size() - 1) * mAdvance + mGlyphSize.width);
+}
+
+void GlyphAtlas::drawText(Frame & frame, FramePos pos, const std::string & text,
+                          const Pixel & color) const
+{
+    for(size_t i = 0; i < text.size(); ++i, pos.x += mAdvance) {
+        const uint8_t * pGlyphLine = pGlyph(text[i]);
+        for(size_t y = 0; y < mGlyphSize.height; ++y, pGlyphLine += mAtlasWidth) {
+            int targetY = pos.y + int(y);
+            if(targetY < 0 || targetY >= int(frame.size.height))
+                continue;
+            Pixel * pLine = frame.pLine(targetY);
+            for(size_t x = 0; x < mGlyphSize.width; ++x) {
+                int targetX = pos.x + int(x);
+                unsigned alpha = pGlyphLine[x];
+                if(!alpha || targetX < 0 || targetX >= int(frame.size.width))
+                    continue;
+                Pixel & p = pLine[targetX];
+                p.B = blendChannel(color.B, p.B, alpha);
+                p.G = blendChannel(color.G, p.G, alpha);
+                p.R = blendChannel(color.R, p.R, alpha);
+            }
+        }
+    }
+}
+
+const uint8_t * GlyphAtlas::pGlyph(char code) const
+{
+    int index = (code >= 0 ? mIndexes[int(code)] : -1);
+    if(index < 0)
+        index = mIndexes[int('?')];
+    return mCoverage.pData() + index * mGlyphSize.width;
+}
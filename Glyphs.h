@@ -0,0 +1,44 @@
+#ifndef GLYPHS_H
+#define GLYPHS_H
+
+#include "Frame.h"
+#include "Buffer.h"
+#include <string>
+
+    //-- class GlyphAtlas --//
+
+// Built-in monospaced bitmap font baked at construction into a coverage
+// atlas of given integer scale. Covers digits, sign and decimal point,
+// weight units, "OVERFLOW" and overlay titles; other characters are drawn
+// as '?'. Needs no OS drawing API, so overlays render the same anywhere
+
+class GlyphAtlas final
+{
+public:
+    GlyphAtlas(unsigned scale, bool bold = false);
+
+    // deleted
+    GlyphAtlas(const GlyphAtlas &) = delete;
+    GlyphAtlas & operator = (const GlyphAtlas &) = delete;
+
+    size_t textWidth(const std::string & text) const;
+    size_t textHeight() const {
+        return mGlyphSize.height;
+    }
+
+    // Blends text of given color into frame by glyph coverage, clipped
+    // by frame bounds. Only color channels are touched, alpha is kept
+    void drawText(Frame & frame, FramePos pos, const std::string & text,
+                  const Pixel & color) const;
+
+private:
+    const uint8_t * pGlyph(char code) const;
+
+    FrameSize mGlyphSize;   // in pixels
+    size_t mAdvance;        // in pixels
+    size_t mAtlasWidth;     // in pixels
+    ByteBuffer mCoverage;   // glyphs in a row
+    int mIndexes[128];      // glyph number by code, -1 if missing
+};
+
+#endif // GLYPHS_H
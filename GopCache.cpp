@@ -0,0 +1,165 @@
+#include "GopCache.h"
+#include "Msg.h"
+#include <algorithm>
+
+namespace {
+
+// Kept frames go to a new appsrc that close to each other
+const GstClockTime burstDuration = GST_MSECOND;
+
+} // namespace
+
+    //-- class GopCache --//
+
+GopCache::GopCache(size_t maxBytes, GstClockTime frameDuration):
+    mMaxBytes(maxBytes), mFrameDuration(frameDuration), mFirstUnit(0),
+    mFrameStart(0), mKeyUnit(0), mKeyValid(false), mGopBytes(0), mGopFrames(0)
+{
+}
+
+bool GopCache::attach(GstAppSrc * pAppSrc)
+{
+    Msg(FILELINE, 2) << "Attaching appsrc";
+    Viewer viewer;
+    viewer.pAppSrc = pAppSrc;
+    viewer.timestamp = 0;
+    viewer.stalled = false;
+    bool keyValid = start(viewer);
+    mViewers.push_back(viewer);
+
+    push(mViewers.back());
+    return keyValid;
+}
+
+void GopCache::detach(GstAppSrc * pAppSrc)
+{
+    Msg(FILELINE, 2) << "Detaching appsrc";
+    mViewers.erase(std::remove_if(mViewers.begin(), mViewers.end(),
+                                  [pAppSrc](const Viewer & viewer) {
+                                      return viewer.pAppSrc == pAppSrc;
+                                  }),
+                   mViewers.end());
+}
+
+void GopCache::add(GstBuffer_Handle & hBuffer, bool keyframe)
+{
+    uint64_t end = mFirstUnit + mUnits.size();
+    if(end == mFrameStart && keyframe) {
+        // New GOP, the previous one isn't needed for new appsrcs anymore
+        mKeyUnit = end;
+        mKeyValid = true;
+        mGopBytes = 0;
+        mGopFrames = 0;
+    }
+
+    mGopBytes += gst_buffer_get_size(hBuffer);
+    if(mKeyValid && mGopBytes > mMaxBytes) {
+        Msg(FILELINE, 2) << "GOP outgrows the cache, it's kept no more";
+        mKeyValid = false;
+    }
+
+    Unit unit;
+    unit.hBuffer = std::move(hBuffer);
+    unit.keyframe = keyframe;
+    unit.frameEnd = false;
+    mUnits.push_back(std::move(unit));
+}
+
+bool GopCache::endFrame()
+{
+    uint64_t end = mFirstUnit + mUnits.size();
+    if(end == mFrameStart)
+        return true; // nothing came out of encoder
+
+    mUnits.back().frameEnd = true;
+    mFrameStart = end;
+    ++mGopFrames;
+
+    bool keyValid = true;
+    for(Viewer & viewer: mViewers)
+        keyValid = push(viewer) && keyValid;
+    trim();
+    return keyValid;
+}
+
+bool GopCache::start(Viewer & viewer)
+{
+    viewer.started = false;
+    if(mKeyValid) {
+        Msg(FILELINE, 2) << mGopFrames << " kept frames go first";
+        viewer.nextUnit = mKeyUnit;
+        viewer.burstFrames = mGopFrames;
+    } else {
+        Msg(FILELINE, 2) << "No complete GOP kept, appsrc waits for keyframe";
+        viewer.nextUnit = mFrameStart;
+        viewer.burstFrames = 0;
+    }
+    return mKeyValid;
+}
+
+bool GopCache::push(Viewer & viewer)
+{
+    // Live frames would be queued for a client not taking them without
+    // bound, so its appsrc is left out till the queue drains
+    guint64 queuedBytes = gst_app_src_get_current_level_bytes(viewer.pAppSrc);
+    if(!viewer.stalled && queuedBytes > 2 * mMaxBytes) {
+        Msg(FILELINE) << "Appsrc queue is over " << 2 * mMaxBytes / 1024
+                      << " KiB, client is stalled, frames are dropped for it";
+        viewer.stalled = true;
+    }
+    if(viewer.stalled) {
+        if(queuedBytes > mMaxBytes)
+            return true;
+        Msg(FILELINE) << "Stalled appsrc queue drained, it starts over";
+        viewer.stalled = false;
+        if(!start(viewer))
+            return false;
+    }
+
+    if(viewer.nextUnit < mFirstUnit)
+        viewer.nextUnit = mFirstUnit;
+
+    // Complete frames only
+    for(; viewer.nextUnit < mFrameStart; ++viewer.nextUnit) {
+        Unit & unit = mUnits[viewer.nextUnit - mFirstUnit];
+        if(!viewer.started) {
+            if(!unit.keyframe)
+                continue;
+            viewer.started = true;
+        }
+
+        // Buffer memory is shared, timestamps are of the appsrc
+        GstBuffer * pBuffer = gst_buffer_copy(unit.hBuffer);
+        if(!pBuffer) {
+            Msg(FILELINE) << "Could not copy GStreamer buffer";
+            break;
+        }
+        GstClockTime duration = (viewer.burstFrames > 0 ?
+                                 burstDuration : mFrameDuration);
+        GST_BUFFER_PTS(pBuffer) = viewer.timestamp;
+        GST_BUFFER_DURATION(pBuffer) = duration;
+        if(unit.frameEnd) {
+            viewer.timestamp += duration;
+            if(viewer.burstFrames > 0)
+                --viewer.burstFrames;
+        }
+
+        GstFlowReturn ret = gst_app_src_push_buffer(viewer.pAppSrc, pBuffer);
+        if(ret != GST_FLOW_OK) {
+            Msg(FILELINE, 2) << "Could not push GStreamer buffer, error " << ret;
+            ++viewer.nextUnit;
+            break;
+        }
+    }
+    return true;
+}
+
+void GopCache::trim()
+{
+    // All appsrcs got the complete frames already
+    uint64_t keepFrom = (mKeyValid ? mKeyUnit : mFrameStart);
+    while(mFirstUnit < keepFrom && !mUnits.empty()) {
+        mUnits.pop_front();
+        ++mFirstUnit;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef GOPCACHE_H
+#define GOPCACHE_H
+
+#include "GStreamer.h"
+#include <gst/app/gstappsrc.h>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+    //-- class GopCache --//
+
+// Fans encoded data of a single encoder out to appsrc elements of several
+// media, one per client, and keeps the data since the last keyframe. A newly
+// attached appsrc gets the kept frames first, at burst rate, then goes on
+// with live ones, so it starts decoding right away without forcing a new
+// keyframe onto everyone else. If the GOP outgrows the size limit, nothing
+// is kept till the next keyframe, and new appsrcs wait for it. A stalled
+// client's appsrc is left out while its queue is over twice the size limit,
+// then starts over like a newly attached one once the queue drains.
+// Not thread safe, calls are to be serialized by the caller
+
+class GopCache final
+{
+public:
+    GopCache(size_t maxBytes, GstClockTime frameDuration);
+
+    // deleted
+    GopCache(const GopCache &) = delete;
+    GopCache & operator = (const GopCache &) = delete;
+
+    // Returns false if there is no complete GOP kept, so the appsrc waits
+    // for the next keyframe, which is then worth forcing
+    bool attach(GstAppSrc * pAppSrc);
+    void detach(GstAppSrc * pAppSrc);
+
+    // Encoded data of the frame being encoded, may come in several buffers
+    void add(GstBuffer_Handle & hBuffer, bool keyframe);
+    // Frame is complete, so it goes to all appsrcs. Returns false if some
+    // drained appsrc waits for keyframe, which is then worth forcing
+    bool endFrame();
+
+private:
+    struct Unit
+    {
+        GstBuffer_Handle hBuffer;
+        bool keyframe;
+        bool frameEnd;
+    };
+    struct Viewer
+    {
+        GstAppSrc * pAppSrc;
+        uint64_t nextUnit;      // sequence number
+        size_t burstFrames;     // left to push at burst rate
+        GstClockTime timestamp;
+        bool started;           // got a keyframe
+        bool stalled;           // queue is too long, nothing is pushed
+    };
+
+    bool start(Viewer & viewer);
+    bool push(Viewer & viewer);
+    void trim();
+
+    size_t mMaxBytes;
+    GstClockTime mFrameDuration;
+    std::deque<Unit> mUnits;
+    uint64_t mFirstUnit;        // sequence number of the front unit
+    uint64_t mFrameStart;       // of the frame being encoded
+    uint64_t mKeyUnit;          // where the last kept GOP starts
+    bool mKeyValid;             // GOP is kept complete
+    size_t mGopBytes;
+    size_t mGopFrames;
+    std::vector<Viewer> mViewers;
+};
+
+#endif // GOPCACHE_H
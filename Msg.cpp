@@ -1,3 +1,243 @@
 #include "Msg.h"
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef MSG_ASYNC
+#include <atomic>
+#include <thread>
+/* Qt 5.6.3's GCC 4.9.2 doesn't need it:
+#ifdef __MINGW32__
+#include <mingw.thread.h>
+#endif
+/**/
+#endif
+
+namespace {
+
+void writeText(const std::string & text)
+{
+    // Single call per batch, so lines of different threads don't mix
+    std::fwrite(text.data(), 1, text.size(), stderr);
+    std::fflush(stderr);
+}
+
+#ifdef MSG_ASYNC
+
+const size_t queueSize = 1024;          // lines, power of 2
+const size_t maxBatchSize = 65536;      // bytes per write
+const int idleMilliseconds = 10;        // between checks of empty queue
+const int flushMilliseconds = 1000;     // at most, e.g. if writer is gone
+
+    //-- class MsgWriter --//
+
+// Writes lines queued by any thread, in batches, on its own thread. Queue is
+// a bounded lock-free one, with sequence numbered cells (D. Vyukov's MPMC
+// queue, with a single consumer). If it's full, producers yield till the
+// writer catches up, rather than lose lines. Once stopped at exit, lines are
+// written right away by their producers
+
+class MsgWriter final
+{
+public:
+    static MsgWriter & instance();
+
+    // deleted
+    MsgWriter(const MsgWriter &) = delete;
+    MsgWriter & operator = (const MsgWriter &) = delete;
+
+    // Takes the text, leaving storage of some earlier line in exchange
+    void push(std::string & text);
+    void flush();
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        std::string text;
+    };
+
+    MsgWriter();
+
+    static void stop0();
+    void stop();
+    void writerMain();
+    bool pop(std::string & batch);
+
+    Cell mCells[queueSize];
+    std::atomic<size_t> mEnqueuePos;
+    size_t mDequeuePos;                 // owned by writer thread
+    std::atomic<size_t> mWrittenPos;    // everything before is written
+    std::atomic<bool> mStop;
+    std::thread mThread;
+};
+
+MsgWriter & MsgWriter::instance()
+{
+    // Never destroyed, as lines may come from destructors of other statics
+    static MsgWriter * pWriter = new MsgWriter();
+    return *pWriter;
+}
+
+MsgWriter::MsgWriter():
+    mEnqueuePos(0), mDequeuePos(0), mWrittenPos(0), mStop(false)
+{
+    for(size_t i = 0; i < queueSize; ++i)
+        mCells[i].sequence.store(i, std::memory_order_relaxed);
+    mThread = std::thread(&MsgWriter::writerMain, this);
+    std::atexit(&MsgWriter::stop0);
+}
+
+void MsgWriter::push(std::string & text)
+{
+    if(mStop.load(std::memory_order_acquire)) {
+        writeText(text);
+        text.clear();
+        return;
+    }
+
+    size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+    for(;;) {
+        Cell & cell = mCells[pos & (queueSize - 1)];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if(sequence == pos) {
+            if(mEnqueuePos.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed)) {
+                cell.text.swap(text);
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        } else if(sequence + queueSize == pos + 1) {
+            // Full, the cell still holds the line of the previous lap
+            std::this_thread::yield();
+            pos = mEnqueuePos.load(std::memory_order_relaxed);
+        } else {
+            pos = mEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void MsgWriter::flush()
+{
+    size_t pos = mEnqueuePos.load(std::memory_order_acquire);
+    auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(flushMilliseconds);
+    while(!mStop.load(std::memory_order_acquire) &&
+          mWrittenPos.load(std::memory_order_acquire) < pos &&
+          std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+}
+
+void MsgWriter::stop0()
+{
+    instance().stop();
+}
+
+void MsgWriter::stop()
+{
+    mStop.store(true, std::memory_order_release);
+    if(mThread.joinable())
+        mThread.join();
+}
+
+void MsgWriter::writerMain()
+{
+    std::string batch;
+    for(;;) {
+        // Lines queued before the stop are still written
+        bool stop = mStop.load(std::memory_order_acquire);
+        while(batch.size() < maxBatchSize && pop(batch));
+        if(!batch.empty()) {
+            writeText(batch);
+            batch.clear();
+            mWrittenPos.store(mDequeuePos, std::memory_order_release);
+            continue;
+        }
+        if(stop)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(idleMilliseconds));
+    }
+}
+
+bool MsgWriter::pop(std::string & batch)
+{
+    Cell & cell = mCells[mDequeuePos & (queueSize - 1)];
+    if(cell.sequence.load(std::memory_order_acquire) != mDequeuePos + 1)
+        return false;
+    batch += cell.text;
+    cell.text.clear(); // capacity stays, for the producer swapping with it
+    cell.sequence.store(mDequeuePos + queueSize, std::memory_order_release);
+    ++mDequeuePos;
+    return true;
+}
+
+#endif // MSG_ASYNC
+
+} // namespace
+
+    //-- class MsgLine --//
+
+std::atomic<MsgLine *> MsgLine::mpFree(nullptr);
+
+MsgLine::MsgLine():
+    mpNext(nullptr), mStream(&mBuf), mFlags(mStream.flags()),
+    mPrecision(mStream.precision()), mFill(mStream.fill())
+{
+}
+
+MsgLine * MsgLine::get()
+{
+    // Whole list is taken, as popping a single line would suffer from ABA.
+    // Concurrent callers find it empty meanwhile, and make new lines
+    MsgLine * pLine = mpFree.exchange(nullptr, std::memory_order_acquire);
+    if(!pLine)
+        return new MsgLine();
+
+    MsgLine * pRest = pLine->mpNext;
+    if(pRest) {
+        MsgLine * pLast = pRest;
+        while(pLast->mpNext)
+            pLast = pLast->mpNext;
+        putList(pRest, pLast);
+    }
+    pLine->mpNext = nullptr;
+    return pLine;
+}
+
+void MsgLine::putList(MsgLine * pFirst, MsgLine * pLast)
+{
+    MsgLine * pHead = mpFree.load(std::memory_order_relaxed);
+    do {
+        pLast->mpNext = pHead;
+    } while(!mpFree.compare_exchange_weak(pHead, pFirst,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+}
+
+void MsgLine::finish()
+{
+    mBuf.text.push_back('\n');
+#ifdef MSG_ASYNC
+    MsgWriter::instance().push(mBuf.text);
+#else
+    writeText(mBuf.text);
+#endif
+    mBuf.text.clear();
+
+    mStream.flags(mFlags);
+    mStream.precision(mPrecision);
+    mStream.width(0);
+    mStream.fill(mFill);
+
+    putList(this, this);
+}
+
+    //-- class Msg --//
 
 Msg::Settings Msg::mSettings = {1, false, false};
+
+void Msg::flush()
+{
+#ifdef MSG_ASYNC
+    MsgWriter::instance().flush();
+#endif
+}
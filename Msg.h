@@ -1,68 +1,20 @@
 #ifndef MSG_H
 #define MSG_H
 
+#include <atomic>
 #include <iostream>
 #include <sstream>
 #include <memory>
 #include <chrono>
 #include <stdexcept>
+#include <string>
 
 #define MSG_SOURCE_FILE_PREFIX "../wdvc/"
-#define MSG_SYNCHRONIZED
-//#define MSG_USE_COPYFMT
-
-#ifdef MSG_SYNCHRONIZED
-#include <mutex>
-/* Qt 5.6.3's GCC 4.9.2 doesn't need it:
-#ifdef __MINGW32__
-#include <mingw.mutex.h>
-#endif
-/**/
-#endif
-
-    //-- class FmtGuard --//
-
-template <typename CharT>
-class FmtGuard final
-{
-public:
-    FmtGuard(std::basic_ios<CharT> & stream):
-        mStream(stream),
-#ifdef MSG_USE_COPYFMT
-        mFmtHolder(nullptr)
-#else
-        mFlags(stream.flags()),
-        mPrecision(stream.precision()),
-        mWidth(stream.width()),
-        mFill(stream.fill())
-#endif
-    {
-#ifdef MSG_USE_COPYFMT
-        mFmtHolder.copyfmt(mStream);
-#endif
-    }
+#define MSG_ASYNC           // lines are written by background thread
 
-    ~FmtGuard() {
-#ifdef MSG_USE_COPYFMT
-        mStream.copyfmt(mFmtHolder);
-#else
-        mStream.flags(mFlags);
-        mStream.precision(mPrecision);
-        mStream.width(mWidth);
-        mStream.fill(mFill);
+#ifndef MSG_MAX_LEVEL
+#define MSG_MAX_LEVEL 3     // messages above are compiled out
 #endif
-    }
-
-private:
-    std::basic_ios<CharT> & mStream;
-#ifdef MSG_USE_COPYFMT
-    std::basic_ios<CharT> mFmtHolder;
-#endif
-    std::ios::fmtflags mFlags;
-    std::streamsize mPrecision;
-    std::streamsize mWidth;
-    CharT mFill;
-};
 
     //-- class MsgTimestamp --//
 
@@ -110,30 +62,88 @@ private:
     }
 };
 
+    //-- class MsgLine --//
+
+// Buffer the message is formatted into, so no locking is needed till the
+// line is complete. Then the line goes to the writer, and buffer gets storage
+// of some earlier line in exchange, so steady logging doesn't allocate.
+// Buffers are taken from a lock-free free list and given back once the line
+// is finished, so there are only as many as messages formatted at once
+
+class MsgLine final
+{
+public:
+    // from free list, or new one
+    static MsgLine * get();
+
+    std::ostream & stream() {
+        return mStream;
+    }
+
+    // Hands the line over to the writer, resets stream format and gives
+    // the buffer back to free list
+    void finish();
+
+private:
+    class Buf final: public std::streambuf
+    {
+    public:
+        std::string text;
+
+    protected:
+        virtual int_type overflow(int_type ch) override {
+            if(!traits_type::eq_int_type(ch, traits_type::eof()))
+                text.push_back(traits_type::to_char_type(ch));
+            return traits_type::not_eof(ch);
+        }
+        virtual std::streamsize xsputn(const char * s, std::streamsize n) override {
+            text.append(s, size_t(n));
+            return n;
+        }
+    };
+
+    MsgLine();
+
+    static void putList(MsgLine * pFirst, MsgLine * pLast);
+
+    static std::atomic<MsgLine *> mpFree;
+
+    MsgLine * mpNext;   // in free list
+    Buf mBuf;
+    std::ostream mStream;
+    std::ios::fmtflags mFlags;
+    std::streamsize mPrecision;
+    char mFill;
+};
+
     //-- class Msg --//
 
 class Msg final
 {
 public:
+    static constexpr int maxLevel = MSG_MAX_LEVEL;
+
     Msg(int level = 1):
-        mpGuards(mSettings.level && level <= mSettings.level ?
-                      std::make_unique<Guards>() : nullptr) {
-        if(mpGuards && mSettings.timestamps)
-            std::cerr << MsgTimestamp() << ": ";
+        mpLine(level <= maxLevel && mSettings.level && level <= mSettings.level ?
+                   MsgLine::get() : nullptr) {
+        if(mpLine && mSettings.timestamps)
+            mpLine->stream() << MsgTimestamp() << ": ";
     }
 
     Msg(const char * file, int line, int level = 1):
         Msg(level) {
-        if(mpGuards && mSettings.filelines)
-            std::cerr << MsgFileline(file, line) << ": ";
+        if(mpLine && mSettings.filelines)
+            mpLine->stream() << MsgFileline(file, line) << ": ";
     }
 
     Msg(Msg && other):
-        mpGuards(std::move(other.mpGuards)) {}
+        mpLine(other.mpLine) {
+        other.mpLine = nullptr;
+    }
 
     ~Msg() {
-        if(mpGuards)
-            std::cerr << std::endl;
+        if(mpLine)
+            mpLine->finish();
     }
 
     // deleted
@@ -142,17 +152,28 @@ public:
 
     template <typename T>
     Msg & operator << (const T & msg) {
-        if(mpGuards)
-            std::cerr << msg;
+        if(mpLine)
+            mpLine->stream() << msg;
         return *this;
     }
 
     Msg & operator << (std::ostream &(* func)(std::ostream &)) {
-        if(mpGuards)
-            func(std::cerr);
+        if(mpLine)
+            func(mpLine->stream());
         return *this;
     }
 
+    // Waits till lines queued so far are written, e.g. before writing to
+    // stderr bypassing Msg
+    static void flush();
+
+    // Compile-time part folds to false above maxLevel, making the statement
+    // guarded by it dead code, see MSG_TRACE
+    template <int level>
+    static bool passes() {
+        return level <= maxLevel && mSettings.level && level <= mSettings.level;
+    }
+
     static void setLevel(int level) {
         mSettings.level = std::max(level, 0);
     }
@@ -172,31 +193,19 @@ private:
         bool filelines;
     };
 
-    class Guards final
-    {
-    public:
-        Guards():
-#ifdef MSG_SYNCHRONIZED
-            mLockGuard(mutex()),
-#endif
-            mFmtGuard(std::cerr) {}
-    private:
-#ifdef MSG_SYNCHRONIZED
-        std::mutex & mutex() {
-            static std::mutex mutex;
-            return mutex;
-        }
-        std::lock_guard<std::mutex> mLockGuard;
-#endif
-        FmtGuard<char> mFmtGuard;
-    };
-
     static Settings mSettings;
-    std::unique_ptr<Guards> mpGuards;
+    MsgLine * mpLine;   // if the level passes
 
     friend class Err;
 };
 
+// Same as Msg(FILELINE, level) << ..., except operands aren't evaluated
+// unless the message passes, and above MSG_MAX_LEVEL the whole statement
+// compiles to nothing. For verbose levels in hot paths. Works in MsgPrefixer
+// descendants as well, with their prefixes
+#define MSG_TRACE(level) \
+    if(!::Msg::passes<level>()) {} else Msg(FILELINE, level)
+
     //-- class Err --//
 
 class Err final: public std::exception
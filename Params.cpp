@@ -1,18 +1,28 @@
 #include "Params.h"
 #include "Msg.h"
+#include "Trace.h"
 #include <iostream>
 #include <x264.h>
 
 namespace {
 
-enum Switch {
+enum Switch: uint64_t {
     capturer = 1, fps = 2, scale = 4, preset = 8, bitrate = 16,
     crf = 32, keyint = 64, intraRefresh = 128, rtspPort = 256,
     comPort = 512, panelPos = 1024, db = 2048, dbUser = 4096,
-    traceSource = 8192, traceLevel = 16384, gstTraceLevel = 32768
+    traceSource = 8192, traceLevel = 16384, gstTraceLevel = 32768,
+    damageTracking = 65536, encoder = 131072, workload = 262144,
+    workloadSize = 524288, benchFrames = 1048576, benchSizes = 2097152,
+    benchPresets = 4194304, benchReport = 8388608, replayFile = 16777216,
+    replayFps = 33554432, recordFile = 67108864, convertBands = 134217728,
+    encoderThreads = 268435456, threading = 536870912, slices = 1073741824,
+    sliceDelivery = 2147483648, noQuantOffsets = 4294967296,
+    noRepeatSkip = 8589934592, gopCache = 17179869184, simulcast = 34359738368,
+    frameTrace = 68719476736, traceFile = 137438953472,
+    benchScales = 274877906944
 };
 
-using Switches = int;
+using Switches = uint64_t;
 
 struct OptionDescr
 {
@@ -36,7 +46,15 @@ OptionDescr options[] = {
                                                 Switch::rtspPort | Switch::comPort |
                                                 Switch::panelPos | Switch::db |
                                                 Switch::dbUser | Switch::traceSource |
-                                                Switch::traceLevel | Switch::gstTraceLevel },
+                                                Switch::traceLevel | Switch::gstTraceLevel |
+                                                Switch::damageTracking | Switch::encoder |
+                                                Switch::workload | Switch::workloadSize |
+                                                Switch::replayFile | Switch::replayFps |
+                                                Switch::convertBands | Switch::encoderThreads |
+                                                Switch::threading | Switch::slices |
+                                                Switch::sliceDelivery | Switch::noQuantOffsets |
+                                                Switch::noRepeatSkip | Switch::gopCache |
+                                                Switch::simulcast | Switch::frameTrace },
     {Option::remove,        "remove",           Switch::traceSource | Switch::traceLevel},
     {Option::logfile,       "logfile",          0},
     {Option::console,       "console",          Switch::capturer | Switch::fps |
@@ -46,23 +64,77 @@ OptionDescr options[] = {
                                                 Switch::rtspPort | Switch::comPort |
                                                 Switch::panelPos | Switch::db |
                                                 Switch::dbUser | Switch::traceSource |
-                                                Switch::traceLevel | Switch::gstTraceLevel },
+                                                Switch::traceLevel | Switch::gstTraceLevel |
+                                                Switch::damageTracking | Switch::encoder |
+                                                Switch::workload | Switch::workloadSize |
+                                                Switch::replayFile | Switch::replayFps |
+                                                Switch::convertBands | Switch::encoderThreads |
+                                                Switch::threading | Switch::slices |
+                                                Switch::sliceDelivery | Switch::noQuantOffsets |
+                                                Switch::noRepeatSkip | Switch::gopCache |
+                                                Switch::simulcast | Switch::frameTrace },
+    {Option::bench,         "bench",            Switch::capturer | Switch::fps |
+                                                Switch::scale | Switch::preset |
+                                                Switch::bitrate | Switch::crf |
+                                                Switch::keyint | Switch::intraRefresh |
+                                                Switch::panelPos | Switch::traceSource |
+                                                Switch::traceLevel | Switch::gstTraceLevel |
+                                                Switch::damageTracking | Switch::encoder |
+                                                Switch::workload | Switch::workloadSize |
+                                                Switch::benchFrames | Switch::benchSizes |
+                                                Switch::benchPresets | Switch::benchReport |
+                                                Switch::benchScales |
+                                                Switch::replayFile | Switch::replayFps |
+                                                Switch::convertBands | Switch::encoderThreads |
+                                                Switch::threading | Switch::slices |
+                                                Switch::sliceDelivery | Switch::noQuantOffsets |
+                                                Switch::noRepeatSkip | Switch::frameTrace },
+    {Option::record,        "record",           Switch::recordFile | Switch::traceSource |
+                                                Switch::traceLevel },
+    {Option::endrecord,     "endrecord",        Switch::traceSource | Switch::traceLevel},
+    {Option::tune,          "tune",             Switch::bitrate | Switch::crf |
+                                                Switch::traceSource | Switch::traceLevel },
+    {Option::trace,         "trace",            Switch::traceFile | Switch::traceSource |
+                                                Switch::traceLevel },
     {Option::help,          "help",             0},
     {Option(0),             nullptr,            0}
 };
 
 SwitchDescr switches[] = {
     {Switch::capturer,      "--capturer",       true},
+    {Switch::workload,      "--workload",       true},
+    {Switch::workloadSize,  "--workload-size",  true},
+    {Switch::replayFile,    "--replay-file",    true},
+    {Switch::replayFps,     "--replay-fps",     true},
+    {Switch::recordFile,    "--record-file",    true},
+    {Switch::frameTrace,    "--frame-trace",    false},
+    {Switch::traceFile,     "--trace-file",     true},
+    {Switch::encoder,       "--encoder",        true},
+    {Switch::encoderThreads,"--encoder-threads",true},
+    {Switch::threading,     "--threading",      true},
+    {Switch::slices,        "--slices",         true},
+    {Switch::sliceDelivery, "--slice-delivery", false},
     {Switch::fps,           "--fps",            true},
     {Switch::scale,         "--scale",          true},
+    {Switch::convertBands,  "--convert-bands",  true},
     {Switch::preset,        "--preset",         true},
     {Switch::bitrate,       "--bitrate",        true},
     {Switch::crf,           "--crf",            true},
     {Switch::keyint,        "--keyint",         true},
     {Switch::intraRefresh,  "--intra-refresh",  false},
     {Switch::rtspPort,      "--rtsp-port",      true},
+    {Switch::gopCache,      "--gop-cache",      true},
+    {Switch::simulcast,     "--simulcast",      true},
     {Switch::comPort,       "--com-port",       true},
     {Switch::panelPos,      "--panel-pos",      true},
+    {Switch::damageTracking,"--damage-tracking",false},
+    {Switch::noQuantOffsets,"--no-quant-offsets",false},
+    {Switch::noRepeatSkip,  "--no-repeat-skip", false},
+    {Switch::benchFrames,   "--bench-frames",   true},
+    {Switch::benchSizes,    "--bench-sizes",    true},
+    {Switch::benchPresets,  "--bench-presets",  true},
+    {Switch::benchReport,   "--bench-report",   true},
+    {Switch::benchScales,   "--bench-scales",   true},
     {Switch::db,            "--db",             true},
     {Switch::dbUser,        "--db-user",        true},
     {Switch::traceSource,   "--trace-source",   false},
@@ -87,8 +159,23 @@ void Impl::init(int argc, char * argv[])
 {
     option          = options[0].option;
     capturerType    = CapturerType::gdi;
+    workload        = SyntheticWorkload::window;
+    workloadChanges = 0;
+    workloadSize    = {1920, 1080};
+    replayFile      = "";
+    replayRate      = ReplayCapturer::Rate::recorded;
+    replayFps       = 5;
+    recordFile      = "wdvc.wdr";
+    frameTrace      = false;
+    traceFile       = "wdvc.json";
+    encoderType     = EncoderType::gst;
+    encoderThreads  = 0;
+    encoderThreading = EncoderThreading::sliced;
+    slices          = 0;
+    sliceDelivery   = false;
     fps             = 5;
     scale           = {0, 0, 0, 0};
+    convertBands    = 0;
     preset          = "veryfast";
     bitrate         = 0; // no VBV bitrate control
     crf             = 35;
@@ -96,8 +183,17 @@ void Impl::init(int argc, char * argv[])
     keyint          = 5;
     intraRefresh    = false;
     rtspPort        = 8554;
+    gopCache        = 0;
     comPort         = 0;
     panelPos        = {12, 12};
+    damageTracking  = false;
+    quantOffsets    = true;
+    repeatSkip      = true;
+    benchFrames     = 300;
+    benchSizes      = {};
+    benchPresets    = {};
+    benchReport     = "";
+    benchScales     = "";
     dbHost          = "localhost";
     dbPort          = 3306;
     dbUser          = "";
@@ -107,6 +203,7 @@ void Impl::init(int argc, char * argv[])
     gstTraceLevel   = 1;
 
     int optionIdx = -1;
+    Switches givenSwitches = 0;
     for(int i = 1; i < argc; ++i) {
         int switchIdx = -1;
         if(argv[i][0] != '-') { // option
@@ -132,6 +229,7 @@ void Impl::init(int argc, char * argv[])
                         throw Err() << "Switch " << switches[j].name
                                     << " isn't applicable to option "
                                     << options[optionIdx].name;
+                    givenSwitches |= switches[j].switch_;
                     switchIdx = j;
                     break;
                 }
@@ -147,8 +245,29 @@ void Impl::init(int argc, char * argv[])
         }
     }
 
+    if(sliceDelivery && encoderThreading == EncoderThreading::frame)
+        throw Err() << "Slice delivery can't be used with frame threading";
+    if(capturerType == CapturerType::replay && replayFile.empty())
+        throw Err() << "No replay file specified for replay capturer";
+    if(gopCache > 0 && encoderType != EncoderType::x264)
+        throw Err() << "GOP cache can be used with x264 encoder only";
+    if(!simulcast.empty() && encoderType != EncoderType::x264)
+        throw Err() << "Simulcast can be used with x264 encoder only";
+    if(!simulcast.empty() && gopCache > 0)
+        throw Err() << "Simulcast can't be used with GOP cache";
+    if(option == Option::tune && tuneRate.empty())
+        throw Err() << "No rate control switch specified to tune";
+
+    // x264enc keeps its own defaults, frame threading included, unless told
+    if(encoderType == EncoderType::gst && !(givenSwitches & Switch::threading))
+        encoderThreading = EncoderThreading::frame;
+
     Msg::setLevel(traceLevel);
     Msg::setFilelines(traceSource);
+    if(traceLevel > Msg::maxLevel)
+        Msg(FILELINE) << "Trace level is limited to " << int(Msg::maxLevel)
+                      << " in this build";
+    FrameTrace::enable(frameTrace);
 }
 
 void Impl::parseSwitch(int switchIdx, char * pSwitchArg)
@@ -162,12 +281,68 @@ void Impl::parseSwitch(int switchIdx, char * pSwitchArg)
                 capturerType = CapturerType::dx;
             else if(!strcmpi(pSwitchArg, "null"))
                 capturerType = CapturerType::null;
+            else if(!strcmpi(pSwitchArg, "synthetic"))
+                capturerType = CapturerType::synthetic;
+            else if(!strcmpi(pSwitchArg, "replay"))
+                capturerType = CapturerType::replay;
             else
                 throw Err() << "Unknown capturer specified";
             break;
         }
-        case Switch::fps:
+        case Switch::workload:
+        {
+            char * p = pSwitchArg;
+            while(*p && *p != ':') ++p;
+            if(*p) {
+                *p++ = 0;
+                int value = atoi(p);
+                if(value < 0 || value > 100)
+                    throw Err() << "Invalid workload changed pixels percent specified";
+                workloadChanges = value;
+            }
+            if(!strcmpi(pSwitchArg, "still"))
+                workload = SyntheticWorkload::still;
+            else if(!strcmpi(pSwitchArg, "text"))
+                workload = SyntheticWorkload::text;
+            else if(!strcmpi(pSwitchArg, "window"))
+                workload = SyntheticWorkload::window;
+            else if(!strcmpi(pSwitchArg, "video"))
+                workload = SyntheticWorkload::video;
+            else if(!strcmpi(pSwitchArg, "form"))
+                workload = SyntheticWorkload::form;
+            else
+                throw Err() << "Unknown workload specified";
+            break;
+        }
+        case Switch::workloadSize:
         {
+            char * p = pSwitchArg;
+            while(*p && *p != 'x') ++p;
+            if(!*p)
+                throw Err() << "Invalid workload size specified";
+            *p++ = 0;
+            int width = atoi(pSwitchArg);
+            int height = atoi(p);
+            if(width < 320 || height < 200 || width > 8192 || height > 8192)
+                throw Err() << "Invalid workload size specified";
+            workloadSize = {size_t(width), size_t(height)};
+            break;
+        }
+        case Switch::replayFile:
+        {
+            replayFile = pSwitchArg;
+            break;
+        }
+        case Switch::replayFps:
+        {
+            if(!strcmpi(pSwitchArg, "recorded")) {
+                replayRate = ReplayCapturer::Rate::recorded;
+                break;
+            }
+            if(!strcmpi(pSwitchArg, "each")) {
+                replayRate = ReplayCapturer::Rate::each;
+                break;
+            }
             Fps value;
             char * p = pSwitchArg;
             while(*p && *p != '/') ++p;
@@ -179,36 +354,121 @@ void Impl::parseSwitch(int switchIdx, char * pSwitchArg)
             }
             value.num = atoi(pSwitchArg);
             if(!value.isValid())
-                throw Err() << "Invalid fps specified";
-            fps = value;
+                throw Err() << "Invalid replay fps specified";
+            replayRate = ReplayCapturer::Rate::forced;
+            replayFps = value;
             break;
         }
-        case Switch::scale:
+        case Switch::recordFile:
+        {
+            recordFile = pSwitchArg;
+            break;
+        }
+        case Switch::frameTrace:
+        {
+            frameTrace = true;
+            break;
+        }
+        case Switch::traceFile:
+        {
+            traceFile = pSwitchArg;
+            break;
+        }
+        case Switch::encoder:
+        {
+            if(!strcmpi(pSwitchArg, "gst"))
+                encoderType = EncoderType::gst;
+            else if(!strcmpi(pSwitchArg, "x264"))
+                encoderType = EncoderType::x264;
+            else
+                throw Err() << "Unknown encoder specified";
+            break;
+        }
+        case Switch::encoderThreads:
         {
-            FrameScale value;
+            int value = atoi(pSwitchArg);
+            if(value < 0 || value > 64)
+                throw Err() << "Invalid encoder thread count specified";
+            encoderThreads = value;
+            break;
+        }
+        case Switch::threading:
+        {
+            if(!strcmpi(pSwitchArg, "sliced"))
+                encoderThreading = EncoderThreading::sliced;
+            else if(!strcmpi(pSwitchArg, "frame"))
+                encoderThreading = EncoderThreading::frame;
+            else
+                throw Err() << "Unknown encoder threading specified";
+            break;
+        }
+        case Switch::slices:
+        {
+            int value = atoi(pSwitchArg);
+            if(value < 0 || value > 32)
+                throw Err() << "Invalid slice count specified";
+            slices = value;
+            break;
+        }
+        case Switch::sliceDelivery:
+        {
+            sliceDelivery = true;
+            break;
+        }
+        case Switch::fps:
+        {
+            Fps value;
             char * p = pSwitchArg;
             while(*p && *p != '/') ++p;
             if(*p) {
                 *p++ = 0;
-                value.num = atoi(pSwitchArg);
                 value.den = atoi(p);
-                if(!value.num || !value.den)
-                    throw Err() << "Invalid scale in format N/D specified";
-                scale = value;
-                break;
+            } else {
+                value.den = 1;
             }
-            p = pSwitchArg;
-            while(*p && *p != 'x') ++p;
+            value.num = atoi(pSwitchArg);
+            if(!value.isValid())
+                throw Err() << "Invalid fps specified";
+            fps = value;
+            break;
+        }
+        case Switch::scale:
+        {
+            scale = parseScale(pSwitchArg);
+            break;
+        }
+        case Switch::simulcast:
+        {
+            SimulcastStream stream;
+            char * p = pSwitchArg;
+            while(*p && *p != ':') ++p;
+            if(!*p || p == pSwitchArg)
+                throw Err() << "Invalid simulcast stream specified";
+            *p++ = 0;
+            stream.mount = std::string("/desktop/") + pSwitchArg;
+            char * pScale = p;
+            while(*p && *p != ':') ++p;
+            stream.bitrate = 0;
             if(*p) {
                 *p++ = 0;
-                value.width = atoi(pSwitchArg);
-                value.height = atoi(p);
-                if(!value.width || !value.height)
-                    throw Err() << "Invalid scale in format WxH specified";
-                scale = value;
-                break;
+                int value = atoi(p);
+                if(value < 100 || value > 10000)
+                    throw Err() << "Invalid simulcast stream bitrate specified";
+                stream.bitrate = value;
             }
-            throw Err() << "Invalid scale specified";
+            stream.scale = parseScale(pScale);
+            for(const SimulcastStream & other: simulcast)
+                if(other.mount == stream.mount)
+                    throw Err() << "Duplicate simulcast stream name specified";
+            simulcast.push_back(stream);
+            break;
+        }
+        case Switch::convertBands:
+        {
+            int value = atoi(pSwitchArg);
+            if(value < 0 || value > 64)
+                throw Err() << "Invalid conversion band count specified";
+            convertBands = value;
             break;
         }
         case Switch::preset:
@@ -229,6 +489,7 @@ void Impl::parseSwitch(int switchIdx, char * pSwitchArg)
             if(value < 100 || value > 10000)
                 throw Err() << "Invalid bitrate specified";
             bitrate = value;
+            tuneRate.bitrate = bitrate;
             break;
         }
         case Switch::crf:
@@ -249,6 +510,8 @@ void Impl::parseSwitch(int switchIdx, char * pSwitchArg)
                 throw Err() << "Invalid crf interval specified";
             crfMax = std::max(crfValue, crfMaxValue);
             crf = crfValue;
+            tuneRate.crf = crf;
+            tuneRate.crfMax = crfMax;
             break;
         }
         case Switch::keyint:
@@ -264,6 +527,14 @@ void Impl::parseSwitch(int switchIdx, char * pSwitchArg)
             intraRefresh = true;
             break;
         }
+        case Switch::gopCache:
+        {
+            int value = atoi(pSwitchArg);
+            if(value < 1 || value > 65536)
+                throw Err() << "Invalid GOP cache size specified";
+            gopCache = value;
+            break;
+        }
         case Switch::rtspPort:
         {
             int value = atoi(pSwitchArg);
@@ -307,6 +578,73 @@ void Impl::parseSwitch(int switchIdx, char * pSwitchArg)
             panelPos.y = atoi(p);
             break;
         }
+        case Switch::damageTracking:
+        {
+            damageTracking = true;
+            break;
+        }
+        case Switch::benchFrames:
+        {
+            int value = atoi(pSwitchArg);
+            if(value < 10 || value > 100000)
+                throw Err() << "Invalid benchmark frame count specified";
+            benchFrames = value;
+            break;
+        }
+        case Switch::benchSizes:
+        {
+            benchSizes.clear();
+            char * pSize = strtok(pSwitchArg, ",");
+            for(; pSize; pSize = strtok(nullptr, ",")) {
+                char * p = pSize;
+                while(*p && *p != 'x') ++p;
+                if(!*p)
+                    throw Err() << "Invalid benchmark frame size specified";
+                *p++ = 0;
+                int width = atoi(pSize);
+                int height = atoi(p);
+                if(width < 320 || height < 200 || width > 8192 || height > 8192)
+                    throw Err() << "Invalid benchmark frame size specified";
+                benchSizes.push_back({size_t(width), size_t(height)});
+            }
+            break;
+        }
+        case Switch::benchPresets:
+        {
+            benchPresets.clear();
+            char * pPreset = strtok(pSwitchArg, ",");
+            for(; pPreset; pPreset = strtok(nullptr, ",")) {
+                int i;
+                for(i = 0; x264_preset_names[i]; ++i)
+                    if(!strcmp(pPreset, x264_preset_names[i])) {
+                        benchPresets.push_back(x264_preset_names[i]);
+                        break;
+                    }
+                if(!x264_preset_names[i])
+                    throw Err() << "Unknown benchmark preset specified";
+            }
+            break;
+        }
+        case Switch::benchReport:
+        {
+            benchReport = pSwitchArg;
+            break;
+        }
+        case Switch::benchScales:
+        {
+            benchScales = pSwitchArg;
+            break;
+        }
+        case Switch::noQuantOffsets:
+        {
+            quantOffsets = false;
+            break;
+        }
+        case Switch::noRepeatSkip:
+        {
+            repeatSkip = false;
+            break;
+        }
         case Switch::db:
         {
             char * p = pSwitchArg;
@@ -369,11 +707,29 @@ void Impl::showUsage() const
              "      wdvc.exe remove     Stop process and remove it from autorun\n"
              "      wdvc.exe logfile    Show process log file name with path\n"
              "      wdvc.exe console    Start server in console\n"
+             "      wdvc.exe bench      Benchmark capturing and encoding stages\n"
+             "      wdvc.exe record     Start recording captured frames of running process\n"
+             "      wdvc.exe endrecord  Stop recording captured frames\n"
+             "      wdvc.exe tune       Change rate control of running process\n"
+             "      wdvc.exe trace      Dump frame trace of running process\n"
              "      wdvc.exe help       Show usage\n"
              "Switches:\n"
-             "      --capturer <GDI|DX|null>\n"
+             "      --capturer <GDI|DX|null|synthetic|replay>\n"
+             "      --workload <still|text|window|video|form>[:<changed %>]\n"
+             "      --workload-size <width>x<height>\n"
+             "      --replay-file <recording file>\n"
+             "      --replay-fps <recorded|each|<numerator>[/<denominator>]>\n"
+             "      --record-file <recording file>\n"
+             "      --frame-trace\n"
+             "      --trace-file <Chrome trace JSON file>\n"
+             "      --encoder <gst|x264>\n"
+             "      --encoder-threads <thread count, 0 for auto>\n"
+             "      --threading <sliced|frame>\n"
+             "      --slices <slice count>\n"
+             "      --slice-delivery\n"
              "      --fps <numerator>[/<denominator>]\n"
              "      --scale <numerator>/<denominator>|<width>x<height>\n"
+             "      --convert-bands <band count, 0 for CPU count>\n"
              "      --preset <ultrafast|superfast|veryfast|faster|fast|\n"
              "                medium|slow|slower|veryslow|placebo>\n"
              "      --bitrate <bitrate in kbps>\n"
@@ -381,8 +737,18 @@ void Impl::showUsage() const
              "      --keyint <keyint>\n"
              "      --intra-refresh\n"
              "      --rtsp-port <RTSP port>\n"
+             "      --gop-cache <max GOP size in KB>\n"
+             "      --simulcast <name>:<scale>[:<bitrate>], may be repeated\n"
              "      --com-port <scales' COM port>\n"
              "      --panel-pos (<x>,<y>)\n"
+             "      --damage-tracking\n"
+             "      --no-quant-offsets\n"
+             "      --no-repeat-skip\n"
+             "      --bench-frames <frames per run>\n"
+             "      --bench-sizes <width>x<height>[,<width>x<height>...]\n"
+             "      --bench-presets <preset>[,<preset>...]\n"
+             "      --bench-report <file.csv|file.json>\n"
+             "      --bench-scales <scales data file>\n"
              "      --db <dbname[@dbhost[:dbport]]>\n"
              "      --db-user <dbuser[/dbpass]>\n"
              "      --trace-source\n"
@@ -390,6 +756,32 @@ void Impl::showUsage() const
              "      --gst-trace-level <gst trace level>";
 }
 
+FrameScale Impl::parseScale(char * pSwitchArg)
+{
+    FrameScale value = {0, 0, 0, 0};
+    char * p = pSwitchArg;
+    while(*p && *p != '/') ++p;
+    if(*p) {
+        *p++ = 0;
+        value.num = atoi(pSwitchArg);
+        value.den = atoi(p);
+        if(!value.num || !value.den)
+            throw Err() << "Invalid scale in format N/D specified";
+        return value;
+    }
+    p = pSwitchArg;
+    while(*p && *p != 'x') ++p;
+    if(*p) {
+        *p++ = 0;
+        value.width = atoi(pSwitchArg);
+        value.height = atoi(p);
+        if(!value.width || !value.height)
+            throw Err() << "Invalid scale in format WxH specified";
+        return value;
+    }
+    throw Err() << "Invalid scale specified";
+}
+
 void Impl::throwUsage() const
 {
     showUsage();
@@ -2,12 +2,28 @@
 #define PARAMS_H
 
 #include "Capturer.h"
+#include "Synthetic.h"
+#include "Replay.h"
+#include "Encoder.h"
 #include "Frame.h"
+#include <string>
+#include <vector>
 
     //-- enum struct Option --//
 
 enum struct Option: int {
-    start, remove, logfile, console, help
+    start, remove, logfile, console, bench, record, endrecord, tune, trace, help
+};
+
+    //-- struct SimulcastStream --//
+
+// Additional encoding of the same captured frames, on its own mount point
+
+struct SimulcastStream final
+{
+    std::string mount;  // e.g. "/desktop/low"
+    FrameScale scale;
+    unsigned bitrate;   // in kbps, 0 for the one of main stream
 };
 
     //-- class Params --//
@@ -22,17 +38,43 @@ public:
 
         Option option;
         CapturerType capturerType;
+        SyntheticWorkload workload;  // for synthetic capturer
+        unsigned workloadChanges;    // in percent of pixels per frame
+        FrameSize workloadSize;
+        std::string replayFile;      // for replay capturer
+        ReplayCapturer::Rate replayRate;
+        Fps replayFps;               // for forced replay rate
+        std::string recordFile;      // to request recording into
+        bool frameTrace;             // record per-frame spans of stages
+        std::string traceFile;       // to request frame trace dump into
+        EncoderType encoderType;
+        unsigned encoderThreads;     // 0 for auto
+        EncoderThreading encoderThreading;
+        unsigned slices;             // per frame, 0 for x264 default
+        bool sliceDelivery;          // NALs go out as soon as slice is done
         Fps fps;
         FrameScale scale;    // frame scaling params
+        unsigned convertBands; // parallel conversion bands, 0 for CPU count
         const char * preset; // x264 preset
         unsigned bitrate;    // in kbps
         unsigned crf;        // Constant Rate Factor (see http://slhck.info/video/2017/02/24/crf-guide.html)
         unsigned crfMax;     // worst CRF as caused by VBV (Video Buffering Verifier)
+        RateControl tuneRate; // given ones of the above, to tune running process
         unsigned keyint;     // keyframe frequency (every keyint-th frame will be keyframe)
         bool intraRefresh;   // forbid IDR frames
         unsigned rtspPort;
+        unsigned gopCache;   // in KB, 0 for none, instead of shared media
+        std::vector<SimulcastStream> simulcast;
         unsigned comPort;
         FramePos panelPos;
+        bool damageTracking; // hash frame tiles to find changed areas
+        bool quantOffsets;   // raise QP of unchanged areas, by frame damage
+        bool repeatSkip;     // don't convert frames identical to the previous
+        unsigned benchFrames;                   // per benchmark run
+        std::vector<FrameSize> benchSizes;      // for synthetic capturer
+        std::vector<const char *> benchPresets;
+        std::string benchReport; // CSV or JSON, by file extension
+        std::string benchScales; // parser input, expected weights next to it
         std::string dbHost;
         unsigned dbPort;
         std::string dbUser;
@@ -44,6 +86,7 @@ public:
     private:
         void init(int argc, char * argv[]);
         void parseSwitch(int switchIdx, char * pSwitchParam);
+        static FrameScale parseScale(char * pSwitchArg);
         void throwUsage() const;
 
         friend class Params;
@@ -0,0 +1,248 @@
+#include "Record.h"
+#include "Msg.h"
+#include "Common.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+namespace {
+
+const size_t minFill = 4; // shorter runs go into literals
+
+const size_t fileBufSize = 1 << 20;
+
+} // namespace
+
+    //-- class FrameRecorder --//
+
+FrameRecorder::FrameRecorder(FrameSource * pSource):
+    mpSource(pSource), mControlTimeout(1000), mpFile(nullptr),
+    mFrameSize{0, 0}, mFrames(0), mRawBytes(0), mFileBytes(0),
+    mStatTimeout(10000)
+{
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    close();
+}
+
+Frame FrameRecorder::getFrame()
+{
+    Frame frame = mpSource->getFrame();
+
+    if(mControlTimeout) {
+        checkControl();
+        mControlTimeout.start();
+    }
+
+    if(mpFile && frame.valid()) {
+        write(frame);
+        updateStat();
+    }
+    return frame;
+}
+
+void FrameRecorder::request(const std::string & fileName)
+{
+    // Running process may have another current folder
+    char fullName[MAX_PATH];
+    if(!_fullpath(fullName, fileName.data(), sizeof(fullName))) {
+        Msg(FILELINE) << "Invalid recording file name: \"" << fileName << "\"";
+        return;
+    }
+
+    Msg(FILELINE, 2) << "Writing recording control file";
+    std::FILE * pFile = std::fopen(controlFileName().data(), "w");
+    if(!pFile) {
+        Msg(FILELINE) << "Could not write recording control file";
+        return;
+    }
+    std::fputs(fullName, pFile);
+    std::fclose(pFile);
+
+    Msg(FILELINE) << "Recording requested into \"" << fullName << "\"";
+}
+
+void FrameRecorder::cancel()
+{
+    Msg(FILELINE, 2) << "Removing recording control file";
+    if(std::remove(controlFileName().data())) {
+        Msg(FILELINE) << "No recording was requested";
+        return;
+    }
+    Msg(FILELINE) << "Recording cancelled";
+}
+
+std::string FrameRecorder::controlFileName()
+{
+    return CharText(getTempPath() + "wdvc.rec").str();
+}
+
+void FrameRecorder::checkControl()
+{
+    MSG_TRACE(3) << "Checking recording control file";
+
+    std::string fileName;
+    std::FILE * pFile = std::fopen(controlFileName().data(), "r");
+    if(pFile) {
+        char buf[4096];
+        if(std::fgets(buf, sizeof(buf), pFile))
+            fileName = buf;
+        std::fclose(pFile);
+        while(!fileName.empty() && (fileName.back() == '\n' || fileName.back() == '\r'))
+            fileName.pop_back();
+    }
+
+    if(fileName == mFileName)
+        return;
+
+    close();
+    if(!fileName.empty() && !open(fileName))
+        cancel(); // so it isn't retried every second
+}
+
+bool FrameRecorder::open(const std::string & fileName)
+{
+    Msg(FILELINE) << "Start recording into \"" << fileName << "\"";
+    mpFile = std::fopen(fileName.data(), "wb");
+    if(!mpFile) {
+        Msg(FILELINE) << "Could not open recording file";
+        return false;
+    }
+    std::setvbuf(mpFile, nullptr, _IOFBF, fileBufSize);
+
+    mFileName = fileName;
+    mStartTime.reset();
+    mFrameSize = {0, 0};
+    mFrames = 0;
+    mRawBytes = 0;
+    mFileBytes = 0;
+    mStatTimeout.start();
+    return true;
+}
+
+void FrameRecorder::close()
+{
+    if(!mpFile)
+        return;
+
+    Msg(FILELINE) << "Stop recording, " << mFrames << " frames, "
+                  << (mFileBytes >> 10) << " KiB written";
+    std::fclose(mpFile);
+    mpFile = nullptr;
+    mFileName.clear();
+}
+
+void FrameRecorder::write(const Frame & frame)
+{
+    MSG_TRACE(3) << "Recording frame";
+
+    bool key = (frame.size != mFrameSize);
+    if(!mFrames) {
+        RecordFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, recordMagic, sizeof(header.magic));
+        header.width = frame.size.width;
+        header.height = frame.size.height;
+        std::fwrite(&header, sizeof(header), 1, mpFile);
+        mFileBytes += sizeof(header);
+    }
+
+    // Frames are packed, so pitch doesn't matter for comparison
+    size_t rowSize = frame.size.width * sizeof(Pixel);
+    mCurrent.resize(frame.size.area());
+    for(size_t y = 0; y < frame.size.height; ++y)
+        memcpy(&mCurrent[y * frame.size.width], frame.pLine(y), rowSize);
+
+    encode(key);
+
+    RecordFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.timestamp = uint64_t(TimeInterval(mStartTime).seconds() * 1000000.0);
+    header.width = frame.size.width;
+    header.height = frame.size.height;
+    header.flags = (key ? keyFrame : 0);
+    header.size = mCodes.size() * sizeof(uint32_t);
+    std::fwrite(&header, sizeof(header), 1, mpFile);
+    std::fwrite(mCodes.data(), sizeof(uint32_t), mCodes.size(), mpFile);
+    if(std::ferror(mpFile)) {
+        Msg(FILELINE) << "Could not write recording file";
+        close();
+        cancel();
+        return;
+    }
+
+    mCurrent.swap(mPrevious);
+    mFrameSize = frame.size;
+    ++mFrames;
+    mRawBytes += frame.dataSize();
+    mFileBytes += sizeof(header) + header.size;
+}
+
+void FrameRecorder::encode(bool key)
+{
+    mCodes.clear();
+    const uint32_t * pCur = mCurrent.data();
+    const uint32_t * pPrev = mPrevious.data();
+    size_t count = mCurrent.size();
+
+    auto fillLength = [pCur, count](size_t i) {
+        size_t j = i + 1;
+        while(j < count && pCur[j] == pCur[i]) ++j;
+        return j - i;
+    };
+
+    size_t i = 0;
+    while(i < count) {
+        if(!key && pCur[i] == pPrev[i]) {
+            size_t j = i + 1;
+            while(j < count && pCur[j] == pPrev[j]) ++j;
+            putCodes(recordSkipOp, j - i);
+            i = j;
+            continue;
+        }
+
+        size_t fill = fillLength(i);
+        if(fill >= minFill) {
+            putCodes(recordFillOp, fill, pCur + i);
+            i += fill;
+            continue;
+        }
+
+        size_t j = i + fill;
+        while(j < count && (key || pCur[j] != pPrev[j]) &&
+              !(j + minFill <= count && pCur[j] == pCur[j + 1] &&
+                pCur[j] == pCur[j + 2] && pCur[j] == pCur[j + 3]))
+            ++j;
+        putCodes(recordLiteralOp, j - i, pCur + i);
+        i = j;
+    }
+}
+
+void FrameRecorder::putCodes(uint32_t op, size_t count, const uint32_t * pPixels)
+{
+    while(count > 0) {
+        uint32_t part = uint32_t(std::min(count, size_t(recordCountMask)));
+        mCodes.push_back((op << recordOpShift) | part);
+        if(op == recordLiteralOp) {
+            mCodes.insert(mCodes.end(), pPixels, pPixels + part);
+            pPixels += part;
+        } else if(op == recordFillOp) {
+            mCodes.push_back(*pPixels);
+        }
+        count -= part;
+    }
+}
+
+void FrameRecorder::updateStat()
+{
+    if(!mStatTimeout)
+        return;
+
+    Msg(FILELINE, 2) << "Recording: " << mFrames << " frames, "
+                     << (mFileBytes >> 10) << " KiB written, ratio "
+                     << (mFileBytes ? mRawBytes / mFileBytes : 0) << ":1";
+    mStatTimeout.start();
+}
@@ -0,0 +1,96 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "Frame.h"
+#include "Timing.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Recording file starts with RecordFileHeader, followed by frame records,
+// each being RecordFrameHeader and codes. Codes are 32-bit words with
+// operation in two upper bits and pixel count in the rest: skip pixels
+// unchanged since the previous frame, copy literal pixels following the
+// code, or fill with a single pixel following the code. Key frames have
+// no skips, so they don't depend on the previous frame. Format is shared
+// by recorder and replay, the latter being platform free, see Replay.h
+
+const char recordMagic[8] = {'W', 'D', 'V', 'C', 'R', 'E', 'C', '1'};
+
+enum RecordOp: uint32_t {
+    recordSkipOp = 0, recordLiteralOp = 1, recordFillOp = 2
+};
+
+const int recordOpShift = 30;
+const uint32_t recordCountMask = (1u << recordOpShift) - 1;
+
+struct RecordFileHeader
+{
+    char magic[8];      // "WDVCREC1"
+    uint32_t width;     // of the first frame
+    uint32_t height;
+    uint32_t reserved[2];
+};
+
+struct RecordFrameHeader
+{
+    uint64_t timestamp; // in microseconds since recording start
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+    uint32_t size;      // of codes, in bytes
+};
+
+    //-- class FrameRecorder --//
+
+// Passes frames of the source through and writes them into recording file
+// while recording is requested. Request is a control file in temp folder
+// holding the recording file name, so it can be started and stopped for
+// a running process from the command line
+
+class FrameRecorder final: public FrameSource
+{
+public:
+    enum Flag: uint32_t {
+        keyFrame = 1
+    };
+
+    FrameRecorder(FrameSource * pSource);
+    ~FrameRecorder();
+
+    // deleted
+    FrameRecorder(const FrameRecorder &) = delete;
+    FrameRecorder & operator = (const FrameRecorder &) = delete;
+
+    virtual Frame getFrame() override;
+
+    static void request(const std::string & fileName);
+    static void cancel();
+
+private:
+    static std::string controlFileName();
+
+    void checkControl();
+    bool open(const std::string & fileName);
+    void close();
+    void write(const Frame & frame);
+    void encode(bool key);
+    void putCodes(uint32_t op, size_t count, const uint32_t * pPixels = nullptr);
+    void updateStat();
+
+    FrameSource * mpSource;
+    Timeout mControlTimeout;
+    std::string mFileName;
+    std::FILE * mpFile;
+    TimePoint mStartTime;
+    FrameSize mFrameSize;
+    std::vector<uint32_t> mCurrent;  // packed frame pixels
+    std::vector<uint32_t> mPrevious;
+    std::vector<uint32_t> mCodes;
+    size_t mFrames;
+    uint64_t mRawBytes;
+    uint64_t mFileBytes;
+    Timeout mStatTimeout;
+};
+
+#endif // RECORD_H
@@ -0,0 +1,256 @@
+#include "Replay.h"
+#include "Msg.h"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#ifdef _WIN32
+#include "Win.h"
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+    //-- class MappedFile --//
+
+MappedFile::MappedFile(const std::string & fileName):
+    mpData(nullptr), mSize(0)
+{
+    Msg(FILELINE, 2) << "Mapping file \"" << fileName << "\"";
+
+#ifdef _WIN32
+    HANDLE_Handle hFile = CreateFileA(
+                fileName.data(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile.handle() == INVALID_HANDLE_VALUE) {
+        hFile.reset();
+        Msg(FILELINE) << "Could not open file, error " << GetLastError();
+        return;
+    }
+    LARGE_INTEGER fileSize;
+    if(!GetFileSizeEx(hFile, &fileSize) || !fileSize.QuadPart) {
+        Msg(FILELINE) << "Could not obtain file size or file is empty";
+        return;
+    }
+    HANDLE_Handle hMapping = CreateFileMapping(
+                hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!hMapping) {
+        Msg(FILELINE) << "Could not create file mapping, error " << GetLastError();
+        return;
+    }
+    // View keeps the mapping alive when the handles are closed
+    mpData = static_cast<const uint8_t *>(
+                MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+    if(!mpData) {
+        Msg(FILELINE) << "Could not map file view, error " << GetLastError();
+        return;
+    }
+    mSize = fileSize.QuadPart;
+#else
+    int fd = ::open(fileName.data(), O_RDONLY);
+    if(fd < 0) {
+        Msg(FILELINE) << "Could not open file, error " << errno;
+        return;
+    }
+    struct stat st;
+    if(fstat(fd, &st) || !st.st_size) {
+        Msg(FILELINE) << "Could not obtain file size or file is empty";
+        ::close(fd);
+        return;
+    }
+    void * p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(p == MAP_FAILED) {
+        Msg(FILELINE) << "Could not map file, error " << errno;
+        return;
+    }
+    mpData = static_cast<const uint8_t *>(p);
+    mSize = st.st_size;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+    if(!mpData)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(mpData);
+#else
+    munmap(const_cast<uint8_t *>(mpData), mSize);
+#endif
+}
+
+    //-- class ReplayCapturer --//
+
+ReplayCapturer::ReplayCapturer(const std::string & fileName, Rate rate, Fps fps):
+    mFile(fileName), mRate(rate), mFps(fps), mDuration(0), mStarted(false),
+    mNextFrame(0), mDecodedFrame(0), mDecoded(false), mFrameSize{0, 0}
+{
+    index();
+}
+
+FrameSize ReplayCapturer::fileFrameSize(const std::string & fileName)
+{
+    RecordFileHeader header;
+    std::FILE * pFile = std::fopen(fileName.data(), "rb");
+    bool valid = (pFile && std::fread(&header, sizeof(header), 1, pFile) == 1 &&
+                  !memcmp(header.magic, recordMagic, sizeof(header.magic)));
+    if(pFile)
+        std::fclose(pFile);
+    if(!valid)
+        throw Err(FILELINE) << "Invalid recording file \"" << fileName << "\"";
+    return {header.width, header.height};
+}
+
+void ReplayCapturer::index()
+{
+    if(!mFile.valid())
+        return;
+
+    Msg(FILELINE, 2) << "Indexing recording file";
+    const uint8_t * p = mFile.pData();
+    const uint8_t * pEnd = p + mFile.size();
+
+    if(size_t(pEnd - p) < sizeof(RecordFileHeader) ||
+            memcmp(p, recordMagic, sizeof(recordMagic))) {
+        Msg(FILELINE) << "Not a recording file";
+        return;
+    }
+    RecordFileHeader fileHeader;
+    memcpy(&fileHeader, p, sizeof(fileHeader));
+    mFrameSize = {fileHeader.width, fileHeader.height};
+    p += sizeof(RecordFileHeader);
+
+    while(size_t(pEnd - p) >= sizeof(RecordFrameHeader)) {
+        RecordFrameHeader header;
+        memcpy(&header, p, sizeof(header));
+        if(size_t(pEnd - p) - sizeof(header) < header.size)
+            break;
+        if(mEntries.empty() && !(header.flags & FrameRecorder::keyFrame))
+            break;
+        mEntries.push_back({p, header.timestamp});
+        p += sizeof(header) + header.size;
+    }
+    if(p != pEnd)
+        Msg(FILELINE) << "Recording file is truncated, replaying "
+                      << mEntries.size() << " complete frames";
+
+    if(mEntries.empty())
+        return;
+    // Last frame lasts as long as the one before it
+    uint64_t last = mEntries.back().timestamp;
+    uint64_t prior = (mEntries.size() > 1 ? mEntries[mEntries.size() - 2].timestamp : 0);
+    mDuration = last + std::max<uint64_t>(last - prior, 1);
+
+    Msg(FILELINE) << "Replaying " << mEntries.size() << " frames, "
+                  << mDuration / 1000 << " ms long";
+}
+
+Frame ReplayCapturer::getFrame()
+{
+    if(mEntries.empty())
+        return getNullFrame(mFrameSize.area() ? mFrameSize : FrameSize{320, 200});
+
+    size_t frameIdx = targetFrame();
+    if(!mDecoded || frameIdx != mDecodedFrame) {
+        // Delta frames can only be decoded in order, so restart on looping
+        size_t i = (mDecoded && frameIdx > mDecodedFrame ? mDecodedFrame + 1 : 0);
+        for(; i <= frameIdx; ++i) {
+            if(!decode(i)) {
+                Msg(FILELINE) << "Corrupted recording frame " << i
+                              << ", replay is stopped";
+                mEntries.resize(i);
+                mDecoded = false;
+                return getNullFrame(mFrameSize.area() ? mFrameSize : FrameSize{320, 200});
+            }
+        }
+        mDecodedFrame = frameIdx;
+        mDecoded = true;
+    }
+
+    MSG_TRACE(3) << "Replaying frame " << frameIdx;
+    Frame frame = acquireFrame(mFrameSize);
+    memcpy(frame.pPixels, mCanvas.data(), frame.dataSize());
+    return frame;
+}
+
+size_t ReplayCapturer::targetFrame()
+{
+    if(mRate == Rate::each)
+        return mNextFrame++ % mEntries.size();
+
+    if(!mStarted) {
+        mStartTime.reset();
+        mStarted = true;
+    }
+    double elapsed = TimeInterval(mStartTime).seconds();
+
+    if(mRate == Rate::forced)
+        return size_t(elapsed * mFps.num / mFps.den) % mEntries.size();
+
+    uint64_t timestamp = uint64_t(elapsed * 1000000.0) % mDuration;
+    auto it = std::upper_bound(
+                mEntries.begin(), mEntries.end(), timestamp,
+                [](uint64_t value, const Entry & entry) {
+                    return value < entry.timestamp;
+                });
+    return (it == mEntries.begin() ? 0 : it - mEntries.begin() - 1);
+}
+
+bool ReplayCapturer::decode(size_t frameIdx)
+{
+    const uint8_t * p = mEntries[frameIdx].pRecord;
+    RecordFrameHeader header;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+
+    FrameSize frameSize{header.width, header.height};
+    if(frameSize != mFrameSize || mCanvas.size() != frameSize.area()) {
+        if(!(header.flags & FrameRecorder::keyFrame) ||
+                !frameSize.width || !frameSize.height ||
+                frameSize.width > 16384 || frameSize.height > 16384)
+            return false;
+        mFrameSize = frameSize;
+        mCanvas.resize(frameSize.area());
+    }
+
+    uint32_t * pCanvas = mCanvas.data();
+    size_t count = mCanvas.size();
+    size_t i = 0;
+    size_t codeCount = header.size / sizeof(uint32_t);
+    size_t c = 0;
+    while(c < codeCount) {
+        uint32_t code;
+        memcpy(&code, p + c++ * sizeof(uint32_t), sizeof(code));
+        uint32_t op = code >> recordOpShift;
+        size_t n = code & recordCountMask;
+        if(n > count - i)
+            return false;
+
+        switch(op) {
+            case recordSkipOp:
+                break;
+            case recordLiteralOp:
+                if(n > codeCount - c)
+                    return false;
+                memcpy(pCanvas + i, p + c * sizeof(uint32_t), n * sizeof(uint32_t));
+                c += n;
+                break;
+            case recordFillOp:
+            {
+                if(c >= codeCount)
+                    return false;
+                uint32_t value;
+                memcpy(&value, p + c++ * sizeof(uint32_t), sizeof(value));
+                std::fill(pCanvas + i, pCanvas + i + n, value);
+                break;
+            }
+            default:
+                return false;
+        }
+        i += n;
+    }
+    return (i == count);
+}
@@ -0,0 +1,91 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "Record.h"
+#include "Frame.h"
+#include "Timing.h"
+#include <string>
+#include <vector>
+
+    //-- class MappedFile --//
+
+// Read-only memory mapping of the whole file
+
+class MappedFile final
+{
+public:
+    explicit MappedFile(const std::string & fileName);
+    ~MappedFile();
+
+    // deleted
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator = (const MappedFile &) = delete;
+
+    bool valid() const {
+        return mpData;
+    }
+    const uint8_t * pData() const {
+        return mpData;
+    }
+    size_t size() const {
+        return mSize;
+    }
+
+private:
+    const uint8_t * mpData;
+    size_t mSize;
+};
+
+    //-- class ReplayCapturer --//
+
+// Serves frames of recording file made by FrameRecorder, looping over it.
+// Frames follow either at the recorded rate, at forced fps, or one by one
+// on each request no matter how fast frames are requested. Needs no platform
+// API but memory mapping, so recordings replay on a build box too
+
+class ReplayCapturer final: public PooledFrameSource
+{
+public:
+    enum struct Rate {
+        recorded, forced, each
+    };
+
+    ReplayCapturer(const std::string & fileName, Rate rate, Fps fps = 0);
+
+    // deleted
+    ReplayCapturer(const ReplayCapturer &) = delete;
+    ReplayCapturer & operator = (const ReplayCapturer &) = delete;
+
+    virtual Frame getFrame() override;
+    virtual FrameSize frameSize() const override {
+        return mFrameSize;
+    }
+
+    static FrameSize fileFrameSize(const std::string & fileName);
+
+private:
+    struct Entry
+    {
+        const uint8_t * pRecord;
+        uint64_t timestamp;
+    };
+
+    void index();
+    size_t targetFrame();
+    bool decode(size_t frameIdx);
+
+    MappedFile mFile;
+    Rate mRate;
+    Fps mFps;
+    std::vector<Entry> mEntries;
+    uint64_t mDuration;     // in microseconds, including the last frame
+    bool mStarted;
+    TimePoint mStartTime;
+    size_t mNextFrame;      // for one by one rate
+    size_t mDecodedFrame;   // the one held by canvas
+    bool mDecoded;
+    FrameSize mFrameSize;
+    std::vector<uint32_t> mCanvas;
+};
+
+#endif // REPLAY_H
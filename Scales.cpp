@@ -4,138 +4,195 @@
 #include "Params.h"
 #include "Guard.h"
 #include "Common.h"
+#include "Trace.h"
+#include <algorithm>
 #include <iomanip>
+#include <limits>
+#include <clocale>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 
-    //-- class Scales --//
+namespace {
+
+// Longest wait for port readiness, so that idle timeout is checked
+const int waitTimeout = 1000;
 
-Scales::Scales():
-    mRecoveryTimeout(3000), mIdleTimeout(3000), mReadBuf(1024)
+// Spaces only, as protocols have nothing else around fields
+void trimSpaces(char *& pBegin, char *& pEnd)
 {
+    while(pBegin != pEnd && *pBegin == ' ')
+        ++pBegin;
+    while(pEnd != pBegin && pEnd[-1] == ' ')
+        --pEnd;
 }
 
-void Scales::updateWeight()
+template<size_t size>
+bool equals(const char * pBegin, const char * pEnd, const char (&str)[size])
 {
-    Msg(FILELINE, 3) << "Updating scales weight";
+    return (size_t(pEnd - pBegin) == size - 1 && !std::memcmp(pBegin, str, size - 1));
+}
 
-    if(state(State::invalid))
-        recover();
-    if(state(State::initial))
-        init();
-    if(state(State::valid))
-        update();
+// Value is digits with optional decimal point, the rest past the second point
+// being ignored, as stream extraction does. Short ones, i.e. all real ones,
+// are exact by a single division, as both operands are. Long ones are left
+// to strtod(), which goes by the locale set in main(), unlike streams
+double parseValue(char * pValue, char * pValueEnd)
+{
+    static const double powersOf10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const size_t powerCount = sizeof(powersOf10) / sizeof(powersOf10[0]);
+    const uint64_t maxExact = uint64_t(1) << 53;
+
+    uint64_t mantissa = 0;
+    size_t fractionDigits = 0;
+    char * pPoint = nullptr;
+    bool exact = true;
+    for(char * p = pValue; p != pValueEnd; ++p) {
+        if(*p == '.') {
+            if(pPoint)
+                break;
+            pPoint = p;
+            continue;
+        }
+        mantissa = mantissa * 10 + (*p - '0');
+        if(pPoint)
+            ++fractionDigits;
+        if(mantissa > maxExact || fractionDigits >= powerCount) {
+            exact = false;
+            break;
+        }
+    }
+    if(exact)
+        return double(mantissa) / powersOf10[fractionDigits];
+
+    char valueEnd = *pValueEnd;
+    *pValueEnd = '\0';
+    char point = '.';
+    if(pPoint) {
+        point = *pPoint;
+        *pPoint = *std::localeconv()->decimal_point;
+    }
+    double value = std::strtod(pValue, nullptr);
+    if(pPoint)
+        *pPoint = point;
+    *pValueEnd = valueEnd;
+    // Overflow gives max, as stream extraction does
+    return (std::isinf(value) ? std::numeric_limits<double>::max() : value);
 }
 
-void Scales::init()
+struct WeightUnit
 {
-    if(!state(State::initial)) {
-        Msg(FILELINE) << "Invalid initial scales state";
-        return;
+    template<size_t size>
+    constexpr WeightUnit(const char (&name)[size], double grams):
+        pName(name), length(size - 1), grams(grams) {}
+
+    const char * pName;
+    size_t length;
+    double grams;
+};
+
+constexpr WeightUnit weightUnits[] = {
+    {"g",       1},             // грамм
+    {"ct",      0.1999694},     // карат
+    {"lb",      453.59237},     // фунт
+    {"oz",      28.349523125},  // унция
+    {"dr",      1.7718451},     // драхма
+    {"GN",      0.06479891},    // гран
+    {"ozt",     31.1034768},    // унция тройская
+    {"dwt",     1.55517384},    // пеннивейт
+    {"MM",      3.749996},      // момм
+    {"tl.J",    37.4290018},    // тейл гонконгский ювелирный
+    {"tl.T",    37.49995},      // тейл тайваньский
+    {"tl.H",    37.799375},     // тейл гонконгский
+    {"t",       11.6638038}     // тола
+};
+
+const WeightUnit * findWeightUnit(const char * pUnit, const char * pUnitEnd)
+{
+    size_t length = pUnitEnd - pUnit;
+    for(const WeightUnit & weightUnit: weightUnits) {
+        if(weightUnit.length == length && !std::memcmp(weightUnit.pName, pUnit, length))
+            return &weightUnit;
     }
+    return nullptr;
+}
 
-    ScopeGuard failureGuard([this]() {
-        setState(State::invalid);
-        mRecoveryTimeout.start();
-    });
+} // namespace
 
-    Msg(FILELINE, 2) << "Opening COM port: COM" << Params()->comPort;
-    mhComPort = CreateFile(
-                Text<TCHAR>("COM") + std::to_string(Params()->comPort),
-                GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
-    if(mhComPort == INVALID_HANDLE_VALUE) {
-        Msg(FILELINE) << "Could not open COM port, error " << GetLastError();
-        return; // failureGuard
-    }
+    //-- class Scales --//
 
-    Msg(FILELINE, 2) << "Tuning COM port";
-    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
-    DCB dcb = {};
-    /**/
-    DCB dcb;
-    memset(&dcb, 0, sizeof(dcb));
-    /**/
-    dcb.DCBlength = sizeof(DCB);
-    if(!GetCommState(mhComPort, &dcb)) {
-        Msg(FILELINE) << "Could not retrieve current COM port settings, error "
-                      << GetLastError();
-        return; // failureGuard
-    }
-    dcb.fBinary         = 1;
-    dcb.BaudRate        = CBR_9600;
-    dcb.ByteSize        = 8;
-    dcb.Parity          = NOPARITY;
-    dcb.StopBits        = ONESTOPBIT;
-    dcb.fOutxCtsFlow    = 0;
-    dcb.fOutxDsrFlow    = 0;
-    dcb.fDtrControl     = DTR_CONTROL_ENABLE;
-    dcb.fDsrSensitivity = 0;
-    dcb.fOutX           = 0;
-    dcb.fInX            = 0;
-    dcb.fNull           = 0;
-    dcb.fRtsControl     = RTS_CONTROL_ENABLE;
-    dcb.fAbortOnError   = 1;
-    if(!SetCommState(mhComPort, &dcb)) {
-        Msg(FILELINE) << "Could not tune COM port, error " << GetLastError();
-        return; // failureGuard
+Scales::Scales(const std::string & portName):
+    mPortName(portName), mRecoveryTimeout(3000), mIdleTimeout(3000),
+    mLineLength(0), mPublishedSeq(0), mPublishedState(-1),
+    mPublishedValue(0), mStop(false)
+{
+    if(mPortName.empty()) {
+#ifdef _WIN32
+        mPortName = "COM" + std::to_string(Params()->comPort);
+#else
+        mPortName = "/dev/ttyS" + std::to_string(int(Params()->comPort) - 1);
+#endif
     }
+}
 
-    Msg(FILELINE, 2) << "Setting COM port timeouts";
-    // Set timeouts so data will be read immediately with no waiting
-    // at all, even if no any data came at the moment of reading
-    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
-    COMMTIMEOUTS timeouts = {};
-    /**/
-    COMMTIMEOUTS timeouts;
-    memset(&timeouts, 0, sizeof(timeouts));
-    /**/
-    timeouts.ReadIntervalTimeout = MAXDWORD;
-    timeouts.ReadTotalTimeoutMultiplier = 0;
-    timeouts.ReadTotalTimeoutConstant = 0;
-    timeouts.WriteTotalTimeoutMultiplier = 0;
-    timeouts.WriteTotalTimeoutConstant = 0;
-    if(!SetCommTimeouts(mhComPort, &timeouts)) {
-        Msg(FILELINE) << "Could not set COM port timeouts, error " << GetLastError();
-        return; // failureGuard
+Scales::~Scales()
+{
+    if(mReaderThread.joinable()) {
+        Msg(FILELINE, 2) << "Stopping scales reader thread";
+        mStop = true;
+        mPort.requestStop();
+        mReaderThread.join();
     }
+    reset();
+}
 
-    Msg(FILELINE, 2) << "Setting COM port event mask";
-    if(!SetCommMask(mhComPort, EV_BREAK | EV_CTS | EV_DSR | EV_ERR |
-                    EV_RING | EV_RLSD | EV_RXCHAR | EV_RXFLAG | EV_TXEMPTY)) {
-        Msg(FILELINE) << "Could not set COM port event mask, error " << GetLastError();
-        return; // failureGuard
-    }
+void Scales::start()
+{
+    if(mReaderThread.joinable())
+        return;
 
-    Msg(FILELINE, 2) << "Creating sync event for COM port event";
-    mhStatEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if(!mhStatEvent) {
-        Msg(FILELINE) << "Could not create sync event for COM port event, error "
-                      << GetLastError();
-        return; // failureGuard
+    if(!mPort.initStop())
+        return;
+
+    Msg(FILELINE, 2) << "Starting scales reader thread";
+    mReaderThread = std::thread(&Scales::readerMain, this);
+}
+
+void Scales::readerMain()
+{
+    Msg(FILELINE, 2) << "Reading scales on " << mPortName;
+    while(!mStop) {
+        if(state(State::invalid)) {
+            if(mPort.waitStop(waitTimeout))
+                break;
+            recover();
+        }
+        if(state(State::initial))
+            init();
+        if(state(State::valid))
+            update(); // blocks till data, stop or wait timeout
+        publish();
     }
+    MSG_TRACE(3) << "Leaving scales reader thread";
+}
 
-    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
-    mStatOverlapped = {};
-    /**/
-    memset(&mStatOverlapped, 0, sizeof(mStatOverlapped));
-    /**/
-    mStatOverlapped.hEvent = mhStatEvent;
-    mStatWait = false;
-
-    Msg(FILELINE, 2) << "Creating sync event for COM port overlapped reading";
-    mhReadEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if(!mhReadEvent) {
-        Msg(FILELINE) << "Could not create sync event for COM port overlapped reading, error "
-                      << GetLastError();
-        return; // failureGuard
+void Scales::init()
+{
+    if(!state(State::initial)) {
+        Msg(FILELINE) << "Invalid initial scales state";
+        return;
     }
 
-    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
-    mReadOverlapped = {};
-    /**/
-    memset(&mReadOverlapped, 0, sizeof(mReadOverlapped));
-    /**/
-    mReadOverlapped.hEvent = mhReadEvent;
-    mReadWait = false;
+    ScopeGuard failureGuard([this]() {
+        setState(State::invalid);
+        mRecoveryTimeout.start();
+    });
+
+    if(!mPort.open(mPortName))
+        return; // failureGuard
 
     mWeight = {};
 
@@ -158,86 +215,12 @@ void Scales::update()
         mRecoveryTimeout.start();
     });
 
-    DWORD comStatEvent;
-    if(!mStatWait) {
-        Msg(FILELINE, 3) << "Start detecting COM port events";
-        if(!WaitCommEvent(mhComPort, &comStatEvent, &mStatOverlapped)) {
-            if(GetLastError() != ERROR_IO_PENDING) {
-                Msg(FILELINE) << "Could not detect COM port events, error "
-                              << GetLastError();
-                return; // failureGuard
-            }
-            Msg(FILELINE, 3) << "Waiting for overlapped COM port event detect completion";
-            mStatWait = true;
-        } else {
-            Msg(FILELINE, 3) << "COM port event(s) detected, processing";
-            updateStat(comStatEvent);
-            ResetEvent(mhStatEvent);
-        }
-    }
-
-    DWORD readCount;
-    if(!mReadWait) {
-        Msg(FILELINE, 3) << "Start reading COM port data";
-        if(!ReadFile(mhComPort, mReadBuf.pData(), mReadBuf.count(), &readCount, &mReadOverlapped)) {
-            if(GetLastError() != ERROR_IO_PENDING) {
-                Msg(FILELINE) << "Could not read COM port data, error "
-                              << GetLastError();
-                return; // failureGuard
-            }
-            Msg(FILELINE, 3) << "Waiting for overlapped COM port data read completion";
-            mReadWait = true;
-        } else if(!readCount) {
-            Msg(FILELINE, 3) << "Zero length COM port data has been read";
-            ResetEvent(mhReadEvent);
-        } else {
-            Msg(FILELINE, 3) << "COM port data has been read, processing";
-            updateData({mReadBuf.pData(), readCount});
-            ResetEvent(mhReadEvent);
-            mIdleTimeout.start();
-        }
-    }
-
-    if(mStatWait || mReadWait) {
-        Msg(FILELINE, 3) << "Checking overlapped COM port operation(s) status";
-        HANDLE handles[] = {mhStatEvent, mhReadEvent};
-        for(;;) {
-            DWORD res = WaitForMultipleObjects(2, handles, FALSE, 0);
-            if(res == WAIT_OBJECT_0) { // COM port event
-                Msg(FILELINE, 3) << "Overlapped COM port event detect completed, retrieving result";
-                if(!GetOverlappedResult(mhComPort, &mStatOverlapped, &comStatEvent, FALSE)) {
-                    Msg(FILELINE) << "Could not retrieve overlapped COM port event detect result, error "
-                                  << GetLastError();
-                    return; // failureGuard
-                }
-                Msg(FILELINE, 3) << "COM port event(s) detected overlapped, processing";
-                updateStat(comStatEvent);
-                mStatWait = false;
-                ResetEvent(mhStatEvent);
-            } else if(res == WAIT_OBJECT_0 + 1) { // COM port data
-                Msg(FILELINE, 3) << "Overlapped COM port data read completed, retrieving result";
-                if(!GetOverlappedResult(mhComPort, &mReadOverlapped, &readCount, FALSE)) {
-                    Msg(FILELINE) << "Could not retrieve overlapped COM port data read result, error "
-                                  << GetLastError();
-                    return; // failureGuard
-                } else if(!readCount) {
-                    Msg(FILELINE, 3) << "Zero length COM port data has been read overlapped";
-                } else {
-                    Msg(FILELINE, 3) << "COM port data has been read overlapped, processing";
-                    updateData({mReadBuf.pData(), readCount});
-                    mIdleTimeout.start();
-                }
-                mReadWait = false;
-                ResetEvent(mhReadEvent);
-            } else if(res == WAIT_TIMEOUT) {
-                Msg(FILELINE, 3) << "No (more) COM port overlapped operations completed";
-                break;
-            } else {
-                Msg(FILELINE) << "Could not check overlapped COM port operation(s) status, error "
-                              << GetLastError();
-                return; // failureGuard
-            }
-        }
+    ByteBufferRef data;
+    if(!mPort.read(data, waitTimeout))
+        return; // failureGuard
+    if(data.count) {
+        updateData(data);
+        mIdleTimeout.start();
     }
 
     failureGuard.reset();
@@ -249,229 +232,137 @@ void Scales::update()
     }
 }
 
-void Scales::updateStat(DWORD comStatEvent)
-{
-    Msg(FILELINE, 3) << "COM port status event flags: " << comStatEvent;
-    if(comStatEvent & EV_BREAK) {
-        Msg(FILELINE) << "Break on input";
-    }
-    if(comStatEvent & (EV_CTS | EV_DSR | EV_RING | EV_RLSD)) {
-        DWORD comSignalStat;
-        if(!GetCommModemStatus(mhComPort, &comSignalStat)) {
-            Msg(FILELINE) << "Could not retrieve COM port signal status";
-        } else {
-            std::stringstream ss;
-            if(comSignalStat & MS_CTS_ON)
-                ss << " CTS";
-            if(comSignalStat & MS_DSR_ON)
-                ss << " DSR";
-            if(comSignalStat & MS_RING_ON)
-                ss << " RING";
-            if(comSignalStat & MS_RLSD_ON)
-                ss << " RLSD";
-            if(!ss.tellp())
-                ss << " (none)";
-            Msg(FILELINE, 2) << "COM port signals active:" << ss.str();
-        }
-    }
-    if(comStatEvent & EV_ERR) {
-        DWORD comErr;
-        COMSTAT comStat;
-        if(!ClearCommError(mhComPort, &comErr, &comStat)) {
-            Msg(FILELINE) << "Could not retrieve COM port error status";
-        } else {
-            std::stringstream ss;
-            if(comErr & CE_BREAK)
-                ss << " BREAK";
-            if(comErr & CE_FRAME)
-                ss << " FRAME";
-            if(comErr & CE_OVERRUN)
-                ss << " OVERRUN";
-            if(comErr & CE_RXOVER)
-                ss << " RXOVER";
-            if(comErr & CE_RXPARITY)
-                ss << " RXPARITY";
-            if(!ss.tellp())
-                ss << " (none)";
-            Msg(FILELINE) << "COM port errors occured:" << ss.str();
-
-            ss.str("");
-            if(comStat.fCtsHold)
-                ss << " CTS hold";
-            if(comStat.fDsrHold)
-                ss << " DSR hold";
-            if(comStat.fRlsdHold)
-                ss << " RLSD hold";
-            if(comStat.fXoffHold)
-                ss << " XOFF hold";
-            if(comStat.fXoffSent)
-                ss << " XOFF sent";
-            if(comStat.fEof)
-                ss << " EOF";
-            if(comStat.fTxim)
-                ss << " TXIM";
-            if(!ss.tellp())
-                Msg(2) << " (none)";
-            Msg(FILELINE, 2) << "COM port statuses:" << ss.str();
-
-            Msg(FILELINE, 2) << "COM port input  queue size: " << comStat.cbInQue;
-            Msg(FILELINE, 2) << "COM port output queue size: " << comStat.cbInQue;
-        }
-    }
-    if(comStatEvent & EV_RXCHAR) {
-        Msg(FILELINE, 2) << "Character(s) was received via COM port";
-    }
-    if(comStatEvent & EV_RXFLAG) {
-        Msg(FILELINE, 2) << "Event character(s) was received via COM port";
-    }
-    if(comStatEvent & EV_TXEMPTY) {
-        Msg(FILELINE, 2) << "Last character in the COM output buffer was sent";
-    }
-}
-
 void Scales::updateData(const ByteBufferRef & data)
 {
     Msg(FILELINE, 2) << "Received " << data.count << " bytes from COM port";
-    Msg(FILELINE, 3) << "Data: \"" << std::string((char *)data.pData, data.count) << "\"";
-
-    ByteBufferRef dataRef = data;
-    ByteBufferRef tokenRef = {data.pData, 0};
-    while(dataRef.count) {
-        if(*dataRef.pData == '\r' || *dataRef.pData == '\n') {
-            std::string token = mReadPending +
-                    std::string((char *)tokenRef.pData, tokenRef.count);
-            mReadPending.clear();
-            if(!token.empty())
-                parseLine(token);
-            tokenRef += (tokenRef.count + 1);
+    MSG_TRACE(3) << "Data: \"" << std::string((char *)data.pData, data.count) << "\"";
+
+    // Line is gathered in place, since it may be split over several reads
+    const char * pData = (const char *)data.pData;
+    const char * pDataEnd = pData + data.count;
+    while(pData != pDataEnd) {
+        const char * pBreak = pData;
+        while(pBreak != pDataEnd && *pBreak != '\r' && *pBreak != '\n')
+            ++pBreak;
+        size_t count = std::min<size_t>(pBreak - pData, maxLineLength - mLineLength);
+        std::memcpy(mLine + mLineLength, pData, count);
+        mLineLength += count;
+        if(pBreak == pDataEnd)
+            break;
+        if(mLineLength) {
+            mLine[mLineLength] = '\0';
+            parseLine(mLine, mLine + mLineLength);
+            mLineLength = 0;
         }
-        ++tokenRef.count;
-        ++dataRef;
+        pData = pBreak + 1;
     }
-    mReadPending += std::string((char *)tokenRef.pData, tokenRef.count);
-    if(mReadPending.length() > 50) {
+    if(mLineLength > 50) {
         Msg(FILELINE, 2) << "Pending data get too large, bad COM port stream format?";
-        mReadPending.clear();
+        mLineLength = 0;
     }
 }
 
-void Scales::parseLine(const std::string & line)
+void Scales::parseLine(char * pLine, char * pLineEnd)
 {
-    Msg(FILELINE, 3) << "Extracted token: \"" << line << "\"";
+    MSG_TRACE(3) << "Extracted token: \"" << pLine << "\"";
+
+    // Single scan for either protocol, i.e. up to 4 commas, as 3 or 4 fields
+    // are expected, and first 3 words separated by spaces
+    const size_t maxFields = 4;
+    char * pCommas[maxFields];
+    size_t commaCount = 0;
+    char * pWords[3];
+    char * pWordEnds[3];
+    size_t wordCount = 0;
+    for(char * p = pLine; p != pLineEnd; ++p) {
+        if(*p == ',') {
+            if(commaCount < maxFields)
+                pCommas[commaCount] = p;
+            ++commaCount;
+        }
+        if(*p == ' ')
+            continue;
+        if(p == pLine || p[-1] == ' ') {
+            if(wordCount < 3)
+                pWords[wordCount] = p;
+            ++wordCount;
+        }
+        if((p + 1 == pLineEnd || p[1] == ' ') && wordCount <= 3)
+            pWordEnds[wordCount - 1] = p + 1;
+    }
 
-    std::vector<std::string> tokens = splitLine(line, ',');
-    if(tokens.size() == 3 || tokens.size() == 4) {
-        if(tokens[0] == "ST") {
+    // Empty field after trailing comma doesn't count
+    size_t fieldCount = commaCount + (pLineEnd[-1] != ',' ? 1 : 0);
+    if(fieldCount == 3 || fieldCount == 4) {
+        char * pState = pLine;
+        char * pStateEnd = pCommas[0];
+        trimSpaces(pState, pStateEnd);
+        if(equals(pState, pStateEnd, "ST")) {
             mWeight.state = WeightState::stable;
-        } else if(tokens[0] == "US") {
+        } else if(equals(pState, pStateEnd, "US")) {
             mWeight.state = WeightState::unstable;
-        } else if(tokens[0] == "OL") {
+        } else if(equals(pState, pStateEnd, "OL")) {
             mWeight.state = WeightState::overload;
         } else {
             mWeight = {};
         }
-        if(mWeight.state != WeightState::unknown)
-            parseWeight(tokens[tokens.size() - 1]);
         if(mWeight.state != WeightState::unknown) {
-            Msg(FILELINE, 3) << "Weight value updated by protocol 1 or 2";
+            char * pValue = pCommas[fieldCount - 2] + 1;
+            char * pValueEnd = (fieldCount - 1 < commaCount ?
+                                    pCommas[fieldCount - 1] : pLineEnd);
+            trimSpaces(pValue, pValueEnd);
+            parseWeight(pValue, pValueEnd);
+        }
+        if(mWeight.state != WeightState::unknown) {
+            MSG_TRACE(3) << "Weight value updated by protocol 1 or 2";
             return;
         }
     }
 
-    tokens = splitLine(line, ' ');
-    if(tokens.size() == 3) {
-        if(tokens[1] == "W:") {
+    if(wordCount == 3) {
+        if(equals(pWords[1], pWordEnds[1], "W:")) {
             mWeight.state = WeightState::stable;
-        } else if(tokens[1] == "w:") {
+        } else if(equals(pWords[1], pWordEnds[1], "w:")) {
             mWeight.state = WeightState::unstable;
         } else {
             mWeight = {};
         }
         if(mWeight.state != WeightState::unknown)
-            parseWeight(tokens[2]);
+            parseWeight(pWords[2], pWordEnds[2]);
         if(mWeight.state != WeightState::unknown) {
-            Msg(FILELINE, 3) << "Weight value updated by protocol 3";
+            MSG_TRACE(3) << "Weight value updated by protocol 3";
             return;
         }
     }
 }
 
-std::vector<std::string> Scales::splitLine(const std::string & line, char delim)
-{
-    std::stringstream ss(line);
-    std::string token;
-    std::vector<std::string> tokens;
-    while(std::getline(ss, token, delim)) {
-        token = trimToken(token);
-        if(delim != ' ' || !token.empty())
-            tokens.push_back(std::move(token));
-    }
-    return std::move(tokens);
-}
-
-std::string Scales::trimToken(const std::string & token)
+void Scales::parseWeight(char * pToken, char * pTokenEnd)
 {
-    size_t firstPos = token.find_first_not_of(' ');
-    if(firstPos == std::string::npos)
-        return "";
-    size_t lastPos = token.find_last_not_of(' ');
-    return token.substr(firstPos, (lastPos - firstPos + 1));
-}
-
-void Scales::parseWeight(const std::string & token)
-{
-    Msg(FILELINE, 3) << "Parsing weight: \"" << token << "\"";
-
-    size_t unitPos = token.find_first_not_of("0123456789.");
-    if(unitPos == std::string::npos || !unitPos) {
-        Msg(FILELINE, 3) << "Invalid weight token";
+    MSG_TRACE(3) << "Parsing weight: \"" << std::string(pToken, pTokenEnd) << "\"";
+
+    char * pValueEnd = pToken;
+    while(pValueEnd != pTokenEnd && ((*pValueEnd >= '0' && *pValueEnd <= '9') ||
+                                     *pValueEnd == '.'))
+        ++pValueEnd;
+    char * pUnit = pValueEnd;
+    char * pUnitEnd = pTokenEnd;
+    trimSpaces(pUnit, pUnitEnd);
+    if(pValueEnd == pToken || pUnit == pUnitEnd) {
+        MSG_TRACE(3) << "Invalid weight token";
         mWeight.state = {};
         return;
     }
 
-    std::string valueStr = token.substr(0, unitPos);
-    std::string unitStr = trimToken(token.substr(unitPos));
-    if(valueStr.empty() || unitStr.empty()) {
-        Msg(FILELINE, 3) << "Invalid weight token";
-        mWeight.state = {};
-        return;
-    }
+    mWeight.value = parseValue(pToken, pValueEnd);
 
-    std::stringstream ss(valueStr.data());
-    ss >> mWeight.value;
-
-    if(unitStr == "g") {            // грамм
-        mWeight.value *= 1;
-    } else if(unitStr == "ct") {    // карат
-        mWeight.value *= 0.1999694;
-    } else if(unitStr == "lb") {    // фунт
-        mWeight.value *= 453.59237;
-    } else if(unitStr == "oz") {    // унция
-        mWeight.value *= 28.349523125;
-    } else if(unitStr == "dr") {    // драхма
-        mWeight.value *= 1.7718451;
-    } else if(unitStr == "GN") {    // гран
-        mWeight.value *= 0.06479891;
-    } else if(unitStr == "ozt") {   // унция тройская
-        mWeight.value *= 31.1034768;
-    } else if(unitStr == "dwt") {   // пеннивейт
-        mWeight.value *= 1.55517384;
-    } else if(unitStr == "MM") {    // момм
-        mWeight.value *= 3.749996;
-    } else if(unitStr == "tl.J") {  // тейл гонконгский ювелирный
-        mWeight.value *= 37.4290018;
-    } else if(unitStr == "tl.T") {  // тейл тайваньский
-        mWeight.value *= 37.49995;
-    } else if(unitStr == "tl.H") {  // тейл гонконгский
-        mWeight.value *= 37.799375;
-    } else if(unitStr == "t") {     // тола
-        mWeight.value *= 11.6638038;
-    } else {
-        Msg(FILELINE, 3) << "Unknown weight unit";
+    const WeightUnit * pWeightUnit = findWeightUnit(pUnit, pUnitEnd);
+    if(!pWeightUnit) {
+        MSG_TRACE(3) << "Unknown weight unit";
         mWeight.state = {};
         return;
     }
-    Msg(FILELINE, 3) << "Parsed succesfully";
+    mWeight.value *= pWeightUnit->grams;
+    MSG_TRACE(3) << "Parsed succesfully";
 }
 
 void Scales::recover()
@@ -485,23 +376,71 @@ void Scales::recover()
 
 void Scales::reset()
 {
-    mhComPort.release();
-    mhStatEvent.release();
-    mhReadEvent.release();
-    mReadPending.clear();
+    mPort.close();
+    mLineLength = 0;
 
     setState(State::initial);
 }
 
+void Scales::publish()
+{
+    int publishedState = (state(State::valid) ? int(mWeight.state) : -1);
+    uint64_t publishedValue;
+    memcpy(&publishedValue, &mWeight.value, sizeof(publishedValue));
+    if(publishedState == mPublishedState.load(std::memory_order_relaxed) &&
+            publishedValue == mPublishedValue.load(std::memory_order_relaxed))
+        return;
+
+    // Single writer, so sequence needs no read-modify-write
+    unsigned seq = mPublishedSeq.load(std::memory_order_relaxed);
+    mPublishedSeq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    mPublishedState.store(publishedState, std::memory_order_relaxed);
+    mPublishedValue.store(publishedValue, std::memory_order_relaxed);
+    mPublishedSeq.store(seq + 2, std::memory_order_release);
+}
+
+void Scales::simulateWeight(const Weight & weight)
+{
+    mWeight = weight;
+    setState(State::valid);
+    publish();
+}
+
+const Scales::Weight & Scales::simulateData(const ByteBufferRef & data)
+{
+    updateData(data);
+    return mWeight;
+}
+
 Scales::Weight Scales::weight() const
 {
-    return (state(State::valid) ? mWeight : Weight{});
+    unsigned seq;
+    int publishedState;
+    uint64_t publishedValue;
+    do {
+        seq = mPublishedSeq.load(std::memory_order_acquire);
+        publishedState = mPublishedState.load(std::memory_order_relaxed);
+        publishedValue = mPublishedValue.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while((seq & 1) || seq != mPublishedSeq.load(std::memory_order_relaxed));
+
+    Weight weight;
+    if(publishedState >= 0) {
+        weight.state = WeightState(publishedState);
+        memcpy(&weight.value, &publishedValue, sizeof(weight.value));
+    }
+    return weight;
 }
 
     //-- class ScalesFilter --//
 
 ScalesFilter::ScalesFilter(FrameSource * pSource, Scales * pScales):
-    mpSource(pSource), mpScales(pScales)
+    mpSource(pSource), mpScales(pScales), mPanelSize{150, 50},
+    mPanelPixels(mPanelSize.area()), mPanelValid(false),
+    mTitleGlyphs(2), mValueGlyphs(2, true),
+    mPanelState(Scales::WeightState::unknown),
+    mCacheHits(0), mCacheRenders(0), mStatTimeout(10000)
 {
 }
 
@@ -509,149 +448,39 @@ Frame ScalesFilter::getFrame()
 {
     Frame frame = mpSource->getFrame();
 
-    if(!mpScales->state(Scales::State::valid))
-        return frame;
-
-    Msg(FILELINE, 3) << "Obtaining screen and info panel DC";
-    WndHDC_Handle hScreenDC = WndHDC(NULL);
-    HDC_Handle hInfoDC = CreateCompatibleDC(hScreenDC->hDC);
-    if(!hScreenDC || !hInfoDC) {
-        Msg(FILELINE) << "Could not obtain screen and info panel DC";
-        return frame;
-    }
-
-    Frame infoFrame({150, 50});
-
-    Msg(FILELINE, 3) << "Creating and selecting info panel bitmap";
-    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
-    BITMAPINFOHEADER bitmapHdr = {};
-    /**/
-    BITMAPINFOHEADER bitmapHdr;
-    memset(&bitmapHdr, 0,sizeof(bitmapHdr));
-    /**/
-    bitmapHdr.biSize = sizeof(BITMAPINFOHEADER);
-    bitmapHdr.biWidth = infoFrame.size.width;
-    bitmapHdr.biHeight = -infoFrame.size.height;
-    bitmapHdr.biPlanes = 1;
-    bitmapHdr.biBitCount = 32;
-    bitmapHdr.biCompression = BI_RGB;
-
-    HBITMAP_Handle hInfoBitmap = CreateDIBSection(
-                hInfoDC, (BITMAPINFO*)&bitmapHdr,
-                DIB_RGB_COLORS, (void**)&infoFrame.pPixels, NULL, 0);
-    if(!hInfoBitmap || !infoFrame.pPixels) {
-        Msg(FILELINE) << "Could not create info panel DC";
-        return frame;
-    }
-    HGDIOBJ_Guard hOldBitmap = SelectObjectGuarded(hInfoDC, hInfoBitmap);
-    if(!hOldBitmap) {
-        Msg(FILELINE) << "Could not select info panel bitmap into DC";
-        return frame;
-    }
-
-    memset(infoFrame.pPixels, 255, infoFrame.dataSize());
-
-    Msg(FILELINE, 3) << "Creating and selecting info panel background brush";
-    HBRUSH_Handle hBrush = CreateSolidBrush(RGB(32, 32, 32));
-    if(!hBrush) {
-        Msg(FILELINE) << "Could not create info panel background brush";
-        return frame;
-    }
-    HGDIOBJ_Guard hOldBrush = SelectObjectGuarded(hInfoDC, hBrush);
-    if(!hOldBrush) {
-        Msg(FILELINE) << "Could not select info panel background brush into DC";
+    if(!mpScales->connected())
         return frame;
-    }
-
-    Msg(FILELINE, 3) << "Painting info panel background";
-    if(!RoundRect(hInfoDC, 0, 0,
-                  infoFrame.size.width, infoFrame.size.height, 13, 13)) {
-        Msg(FILELINE) << "Could not paint info panel background";
-        return frame;
-    }
-
-    Msg(FILELINE, 3) << "Creating info panel title font";
-    HFONT_Handle hTitleFont = CreateFont(
-                18, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE, DEFAULT_CHARSET,
-                OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS, CLEARTYPE_QUALITY,
-                DEFAULT_PITCH | FF_MODERN, Text<TCHAR>("Courier New"));
-    if(!hTitleFont) {
-        Msg(FILELINE) << "Could not create info panel title font";
-        return frame;
-    }
-
-    Msg(FILELINE, 3) << "Creating weight value font";
-    HFONT_Handle hWeightFont = CreateFont(
-                22, 0, 0, 0, FW_BOLD, FALSE, FALSE, FALSE, DEFAULT_CHARSET,
-                OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS, CLEARTYPE_QUALITY,
-                DEFAULT_PITCH | FF_MODERN, Text<TCHAR>("Courier New"));
-    if(!hWeightFont) {
-        Msg(FILELINE) << "Could not create weight value font";
-        return frame;
-    }
-
-    SetBkMode(hInfoDC, TRANSPARENT);
-
-    Msg(FILELINE, 3) << "Painting info panel title";
-    SetTextColor(hInfoDC, RGB(200, 200, 200));
-    HGDIOBJ_Guard hOldFont = SelectObjectGuarded(hInfoDC, hTitleFont);
-    if(!hOldFont) {
-        Msg(FILELINE) << "Could not select info panel title font into DC";
-        return frame;
-    }
-    RECT textRect{4, 4, LONG(infoFrame.size.width) - 4,
-                  LONG(infoFrame.size.height) / 2 - 2};
-    if(!DrawTextEx(hInfoDC, (TCHAR *)Text<TCHAR>("Scales data").pStr(), -1,
-                   &textRect, DT_CENTER | DT_TOP, NULL)) {
-        Msg(FILELINE) << "Could not paint info panel title";
-        return frame;
-    }
 
     Scales::Weight weight = mpScales->weight();
 
-    Msg(FILELINE, 3) << "Painting weight value";
-    bool unknownState = false;
-    if(weight.state == Scales::WeightState::stable) {
-        SetTextColor(hInfoDC, RGB(224, 224, 224));
-    } else if(weight.state == Scales::WeightState::unstable) {
-        SetTextColor(hInfoDC, RGB(192, 192, 16));
-    } else if(weight.state == Scales::WeightState::overload) {
-        SetTextColor(hInfoDC, RGB(255, 16, 16));
-    } else {
-        Msg(FILELINE, 3) << "Could not paint weight value: Unknown weight state";
-        unknownState = true;
-    }
-    if(!unknownState) {
+    std::string text;
+    if(weight.state != Scales::WeightState::unknown) {
         std::stringstream ss;
         if(weight.value > -10000.0 && weight.value < 10000.0)
             ss << std::fixed << std::setprecision(3)
                << weight.value << " g";
         else
             ss << "OVERFLOW";
-
-        if(!SelectObject(hInfoDC, hWeightFont)) {
-            Msg(FILELINE) << "Could not select weight value font into DC";
-            return frame;
-        }
-        textRect = {
-            4, LONG(infoFrame.size.height) / 2 - 2,
-            LONG(infoFrame.size.width) - 4,
-            LONG(infoFrame.size.height) - 4};
-        if(!DrawTextEx(hInfoDC, (TCHAR *)Text<TCHAR>(ss.str()).pStr(), -1,
-                       &textRect, DT_CENTER | DT_TOP, NULL)) {
-            Msg(FILELINE) << "Could not paint weight value";
-            return frame;
-        }
+        text = ss.str();
+    }
+
+    if(!mPanelValid || weight.state != mPanelState || text != mPanelText) {
+        MSG_TRACE(3) << "Rendering info panel";
+        TraceSpan renderSpan("overlay");
+        renderPanel(weight.state, text);
+        renderSpan.end();
+        mPanelValid = true;
+        mPanelState = weight.state;
+        mPanelText = text;
+        ++mCacheRenders;
+    } else {
+        ++mCacheHits;
     }
+    updateStat();
 
-    Msg(FILELINE, 3) << "Adjusting info panel alpha";
-    Pixel * p = infoFrame.pPixels;
-    for(int i = infoFrame.size.area(); i > 0; --i, ++p)
-        p->A = (p->A ? 0 : 216);
-
-    Msg(FILELINE, 3) << "Calculating info panel position";
-    FrameSize boundsSize{frame.size.width - infoFrame.size.width,
-                         frame.size.height - infoFrame.size.height};
+    MSG_TRACE(3) << "Calculating info panel position";
+    FrameSize boundsSize{frame.size.width - mPanelSize.width,
+                         frame.size.height - mPanelSize.height};
     FramePos panelPos = Params()->panelPos;
     if(panelPos.x < 0)
         panelPos.x += boundsSize.width;
@@ -660,14 +489,84 @@ Frame ScalesFilter::getFrame()
     panelPos.x = std::min(std::max(panelPos.x, 0), int(boundsSize.width));
     panelPos.y = std::min(std::max(panelPos.y, 0), int(boundsSize.height));
 
-    Msg(FILELINE, 3) << "Blending info panel into frame";
-    blendImage(frame.pLine(panelPos.y) + panelPos.x, frame.pitch,
-               infoFrame.size.width, infoFrame.size.height,
-               infoFrame.pPixels, infoFrame.pitch);
+    TraceSpan blendSpan("blend");
+    if(frame.shared) {
+        // Source keeps on serving the same pixels, so panel goes into a copy
+        MSG_TRACE(3) << "Copying shared frame";
+        size_t pitch = frame.size.width * sizeof(Pixel);
+        Frame copy(frame.size, pitch, mFramePool.acquire(pitch * frame.size.height));
+        for(size_t y = 0; y < frame.size.height; ++y)
+            memcpy(copy.pLine(y), frame.pLine(y), pitch);
+        copy.damage = frame.damage;
+        frame = std::move(copy);
+    }
+
+    MSG_TRACE(3) << "Blending info panel into frame";
+    blendPremultipliedImage(frame.pLine(panelPos.y) + panelPos.x, frame.pitch,
+                            mPanelSize.width, mPanelSize.height,
+                            mPanelPixels, mPanelSize.width * sizeof(Pixel));
 
     return frame;
 }
 
+void ScalesFilter::renderPanel(Scales::WeightState state, const std::string & text)
+{
+    Frame panel(mPanelSize, mPanelPixels);
+
+    MSG_TRACE(3) << "Painting info panel background";
+    // Rounded rectangle with black border, transparent outside corners
+    const int radius = 6;
+    int width = panel.size.width;
+    int height = panel.size.height;
+    for(int y = 0; y < height; ++y) {
+        Pixel * p = panel.pLine(y);
+        for(int x = 0; x < width; ++x, ++p) {
+            int dx = x - std::min(std::max(x, radius), width - 1 - radius);
+            int dy = y - std::min(std::max(y, radius), height - 1 - radius);
+            int distance = dx * dx + dy * dy;
+            if(distance > radius * radius)
+                *p = {0, 0, 0, 0};
+            else if(distance > (radius - 1) * (radius - 1))
+                *p = {0, 0, 0, 216};
+            else
+                *p = {32, 32, 32, 216};
+        }
+    }
+
+    MSG_TRACE(3) << "Painting info panel title";
+    std::string title = "Scales data";
+    mTitleGlyphs.drawText(
+                panel, {int(width - mTitleGlyphs.textWidth(title)) / 2, 4},
+                title, {200, 200, 200, 0});
+
+    MSG_TRACE(3) << "Painting weight value";
+    Pixel color{0, 0, 0, 0};
+    if(state == Scales::WeightState::stable) {
+        color = {224, 224, 224, 0};
+    } else if(state == Scales::WeightState::unstable) {
+        color = {16, 192, 192, 0};
+    } else if(state == Scales::WeightState::overload) {
+        color = {16, 16, 255, 0};
+    } else {
+        // text is empty then
+        MSG_TRACE(3) << "Could not paint weight value: Unknown weight state";
+    }
+    mValueGlyphs.drawText(
+                panel, {int(width - mValueGlyphs.textWidth(text)) / 2, height / 2},
+                text, color);
+
+    premultiplyImage(panel.pPixels, panel.pitch, width, height);
+}
+
+void ScalesFilter::updateStat()
+{
+    if(!mStatTimeout)
+        return;
+    Msg(FILELINE, 2) << "Info panel cache: " << mCacheHits << " hits, "
+                     << mCacheRenders << " re-renders in total";
+    mStatTimeout.start();
+}
+
     //-- class ScalesLogger --//
 
 ScalesLogger::ScalesLogger():
@@ -680,7 +579,7 @@ ScalesLogger::~ScalesLogger()
     Msg(FILELINE, 2) << "Stopping weight log writer";
     mStopWriter = true;
     mWriterThread.join();
-    Msg(FILELINE, 3) << "Weight log writer stopped";
+    MSG_TRACE(3) << "Weight log writer stopped";
 }
 
 void ScalesLogger::logWeight(const Scales::Weight & weight)
@@ -705,12 +604,12 @@ void ScalesLogger::logWeight(const Scales::Weight & weight)
 
 void ScalesLogger::writerMain()
 {
-    Msg(FILELINE, 3) << "Starting weight log writer";
+    MSG_TRACE(3) << "Starting weight log writer";
     while(!mStopWriter) {
         bool empty;
         LogEntry entry;
         {
-            Msg(FILELINE, 3) << "Reading weight log queue";
+            MSG_TRACE(3) << "Reading weight log queue";
             std::lock_guard<std::mutex> logMutexGuard(mLogMutex);
             empty = mLog.empty();
             if(!empty) {
@@ -719,7 +618,7 @@ void ScalesLogger::writerMain()
             }
         }
         if(empty) {
-            Msg(FILELINE, 3) << "Weight log queue is empty";
+            MSG_TRACE(3) << "Weight log queue is empty";
             std::this_thread::sleep_for(std::chrono::seconds(1));
         } else {
             while(!writeEntry(entry)) {
@@ -738,7 +637,7 @@ bool ScalesLogger::writeEntry(const LogEntry & entry)
     }
 
     if(!mhCon) {
-        Msg(FILELINE, 3) << "Initializing MySQL connection";
+        MSG_TRACE(3) << "Initializing MySQL connection";
         mhCon = mysql_init(nullptr);
         if(!mhCon) {
             Msg(FILELINE) << "Could not initialize MySQL connection";
@@ -749,7 +648,7 @@ bool ScalesLogger::writeEntry(const LogEntry & entry)
     }
 
     if(!mWriterConnected) {
-        Msg(FILELINE, 3) << "Connecting to database";
+        MSG_TRACE(3) << "Connecting to database";
         if(!mysql_real_connect(mhCon,
                     Params()->dbHost.data(),
                     Params()->dbUser.data(),
@@ -769,7 +668,7 @@ bool ScalesLogger::writeEntry(const LogEntry & entry)
     sql << "call wdvc.log_weight("
         << std::fixed << std::setprecision(3) << entry.weight.value
         << ", current_user())";
-    Msg(FILELINE, 3) << "Executing query:\n" << sql.str();
+    MSG_TRACE(3) << "Executing query:\n" << sql.str();
     if(mysql_query(mhCon, sql.str().data())) {
         Msg(FILELINE) << "Could not execute weight logging query:\n"
                       << mysql_error(mhCon);
@@ -3,14 +3,17 @@
 
 #include "Stateful.h"
 #include "Timing.h"
-#include "Win.h"
 #include "Buffer.h"
 #include "Frame.h"
+#include "Glyphs.h"
 #include "MySQL.h"
-#include "Timing.h"
+#include "SerialPort.h"
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <thread>
 #include <mutex>
+#include <string>
 #include <vector>
 
 /* Qt 5.6.3's GCC 4.9.2 doesn't need it:
@@ -22,6 +25,12 @@
 
     //-- class Scales --//
 
+// Reads weight from scales on COM port. Port is served by its own thread,
+// blocking on port readiness through SerialPort, so data is parsed as
+// soon as it comes, whatever the video fps is. The latest weight is published
+// through a sequence lock, for any thread to take with no locking. State is
+// owned by the reader thread
+
 class Scales: public CommonStateful
 {
 public:
@@ -37,44 +46,63 @@ public:
         double value;
     };
 
-    Scales();
+    // Port is e.g. a pty for testing, COM port of params by default
+    explicit Scales(const std::string & portName = std::string());
+    ~Scales();
 
     // deleted
     Scales(const Scales &) = delete;
     Scales & operator = (const Scales &) = delete;
 
-    void updateWeight();
-
+    // Starts reader thread
+    void start();
+    // Sets weight bypassing COM port, e.g. for benchmarking
+    void simulateWeight(const Weight & weight);
+    // Parses data bypassing COM port, e.g. for benchmarking. Returns weight
+    // being parsed, not published
+    const Weight & simulateData(const ByteBufferRef & data);
+
+    bool connected() const {
+        return (mPublishedState.load(std::memory_order_acquire) >= 0);
+    }
     Weight weight() const;
 
 private:
+    void readerMain();
     void init();
     void update();
-    void updateStat(DWORD comStatEvent);
     void updateData(const ByteBufferRef & data);
-    void parseLine(const std::string & line);
-    std::vector<std::string> splitLine(const std::string & line, char delim);
-    std::string trimToken(const std::string & token);
-    void parseWeight(const std::string & token);
+    // Both parse in place, and may modify the line temporarily
+    void parseLine(char * pLine, char * pLineEnd);
+    void parseWeight(char * pToken, char * pTokenEnd);
     void recover();
     void reset();
+    void publish();
 
+    std::string mPortName;
     Timeout mRecoveryTimeout;
     Timeout mIdleTimeout;
-    HANDLE_Handle mhComPort;
-    HANDLE_Handle mhStatEvent;
-    OVERLAPPED mStatOverlapped;
-    bool mStatWait;
-    HANDLE_Handle mhReadEvent;
-    OVERLAPPED mReadOverlapped;
-    bool mReadWait;
-    ByteBuffer mReadBuf;
-    std::string mReadPending;
-    Weight mWeight;
+    SerialPort mPort;
+    enum: size_t {
+        maxLineLength = 2047    // longer ones are cut, 50 at most are valid
+    };
+
+    char mLine[maxLineLength + 1]; // pending line, null terminated when parsed
+    size_t mLineLength;
+    Weight mWeight;             // being parsed
+    std::atomic<unsigned> mPublishedSeq; // odd while being published
+    std::atomic<int> mPublishedState;    // WeightState, -1 if not connected
+    std::atomic<uint64_t> mPublishedValue; // bits of double
+    std::atomic<bool> mStop;
+    std::thread mReaderThread;
 };
 
     //-- class ScalesFilter --//
 
+// Blends info panel with the current weight into frames. Panel is rendered
+// with built-in glyphs once per weight state and value into a premultiplied
+// sprite, which is then reused until either of them changes
+
 class ScalesFilter final: public FrameSource
 {
 public:
@@ -82,9 +110,30 @@ public:
 
     virtual Frame getFrame() override;
 
+    size_t cacheHits() const {
+        return mCacheHits;
+    }
+    size_t cacheRenders() const {
+        return mCacheRenders;
+    }
+
 private:
+    void renderPanel(Scales::WeightState state, const std::string & text);
+    void updateStat();
+
     FrameSource * mpSource;
     Scales * mpScales;
+    FrameSize mPanelSize;
+    Buffer<Pixel> mPanelPixels; // premultiplied
+    bool mPanelValid;
+    GlyphAtlas mTitleGlyphs;
+    GlyphAtlas mValueGlyphs;
+    Scales::WeightState mPanelState;
+    std::string mPanelText;
+    BufferPool mFramePool;      // for copies of shared frames
+    size_t mCacheHits;
+    size_t mCacheRenders;
+    Timeout mStatTimeout;
 };
 
     //-- class ScalesLogger --//
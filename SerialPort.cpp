@@ -0,0 +1,429 @@
+#include "SerialPort.h"
+#include "Msg.h"
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+    //-- class SerialPort --//
+
+SerialPort::SerialPort():
+#ifdef _WIN32
+    mStatWait(false), mReadWait(false),
+#else
+    mFd(-1), mStopPipe{-1, -1},
+#endif
+    mReadBuf(1024)
+{
+}
+
+SerialPort::~SerialPort()
+{
+    close();
+#ifndef _WIN32
+    for(int fd: mStopPipe)
+        if(fd >= 0)
+            ::close(fd);
+#endif
+}
+
+#ifdef _WIN32
+
+bool SerialPort::initStop()
+{
+    Msg(FILELINE, 2) << "Creating serial port stop event";
+    mhStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if(!mhStopEvent) {
+        Msg(FILELINE) << "Could not create serial port stop event, error " << GetLastError();
+        return false;
+    }
+    return true;
+}
+
+void SerialPort::requestStop()
+{
+    SetEvent(mhStopEvent);
+}
+
+bool SerialPort::waitStop(int timeout)
+{
+    return (WaitForSingleObject(mhStopEvent, timeout) == WAIT_OBJECT_0);
+}
+
+bool SerialPort::open(const std::string & name)
+{
+    Msg(FILELINE, 2) << "Opening COM port: " << name;
+    mhPort = CreateFileA(
+                name.data(),
+                GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if(mhPort.handle() == INVALID_HANDLE_VALUE) {
+        mhPort.reset();
+        Msg(FILELINE) << "Could not open COM port, error " << GetLastError();
+        return false;
+    }
+
+    Msg(FILELINE, 2) << "Tuning COM port";
+    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
+    DCB dcb = {};
+    /**/
+    DCB dcb;
+    memset(&dcb, 0, sizeof(dcb));
+    /**/
+    dcb.DCBlength = sizeof(DCB);
+    if(!GetCommState(mhPort, &dcb)) {
+        Msg(FILELINE) << "Could not retrieve current COM port settings, error "
+                      << GetLastError();
+        return false;
+    }
+    dcb.fBinary         = 1;
+    dcb.BaudRate        = CBR_9600;
+    dcb.ByteSize        = 8;
+    dcb.Parity          = NOPARITY;
+    dcb.StopBits        = ONESTOPBIT;
+    dcb.fOutxCtsFlow    = 0;
+    dcb.fOutxDsrFlow    = 0;
+    dcb.fDtrControl     = DTR_CONTROL_ENABLE;
+    dcb.fDsrSensitivity = 0;
+    dcb.fOutX           = 0;
+    dcb.fInX            = 0;
+    dcb.fNull           = 0;
+    dcb.fRtsControl     = RTS_CONTROL_ENABLE;
+    dcb.fAbortOnError   = 1;
+    if(!SetCommState(mhPort, &dcb)) {
+        Msg(FILELINE) << "Could not tune COM port, error " << GetLastError();
+        return false;
+    }
+
+    Msg(FILELINE, 2) << "Setting COM port timeouts";
+    // Set timeouts so data will be read immediately with no waiting
+    // at all, even if no any data came at the moment of reading
+    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
+    COMMTIMEOUTS timeouts = {};
+    /**/
+    COMMTIMEOUTS timeouts;
+    memset(&timeouts, 0, sizeof(timeouts));
+    /**/
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier = 0;
+    timeouts.ReadTotalTimeoutConstant = 0;
+    timeouts.WriteTotalTimeoutMultiplier = 0;
+    timeouts.WriteTotalTimeoutConstant = 0;
+    if(!SetCommTimeouts(mhPort, &timeouts)) {
+        Msg(FILELINE) << "Could not set COM port timeouts, error " << GetLastError();
+        return false;
+    }
+
+    Msg(FILELINE, 2) << "Setting COM port event mask";
+    if(!SetCommMask(mhPort, EV_BREAK | EV_CTS | EV_DSR | EV_ERR |
+                    EV_RING | EV_RLSD | EV_RXCHAR | EV_RXFLAG | EV_TXEMPTY)) {
+        Msg(FILELINE) << "Could not set COM port event mask, error " << GetLastError();
+        return false;
+    }
+
+    Msg(FILELINE, 2) << "Creating sync event for COM port event";
+    mhStatEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if(!mhStatEvent) {
+        Msg(FILELINE) << "Could not create sync event for COM port event, error "
+                      << GetLastError();
+        return false;
+    }
+
+    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
+    mStatOverlapped = {};
+    /**/
+    memset(&mStatOverlapped, 0, sizeof(mStatOverlapped));
+    /**/
+    mStatOverlapped.hEvent = mhStatEvent;
+    mStatWait = false;
+
+    Msg(FILELINE, 2) << "Creating sync event for COM port overlapped reading";
+    mhReadEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if(!mhReadEvent) {
+        Msg(FILELINE) << "Could not create sync event for COM port overlapped reading, error "
+                      << GetLastError();
+        return false;
+    }
+
+    /* Qt 5.6.3's GCC 4.9.2 doesn't like it:
+    mReadOverlapped = {};
+    /**/
+    memset(&mReadOverlapped, 0, sizeof(mReadOverlapped));
+    /**/
+    mReadOverlapped.hEvent = mhReadEvent;
+    mReadWait = false;
+    return true;
+}
+
+void SerialPort::close()
+{
+    mhPort.release();
+    mhStatEvent.release();
+    mhReadEvent.release();
+}
+
+bool SerialPort::read(ByteBufferRef & data, int timeout)
+{
+    data = {mReadBuf.pData(), 0};
+
+    DWORD comStatEvent;
+    if(!mStatWait) {
+        MSG_TRACE(3) << "Start detecting COM port events";
+        if(!WaitCommEvent(mhPort, &comStatEvent, &mStatOverlapped)) {
+            if(GetLastError() != ERROR_IO_PENDING) {
+                Msg(FILELINE) << "Could not detect COM port events, error "
+                              << GetLastError();
+                return false;
+            }
+            MSG_TRACE(3) << "Waiting for overlapped COM port event detect completion";
+            mStatWait = true;
+        } else {
+            MSG_TRACE(3) << "COM port event(s) detected, processing";
+            updateStat(comStatEvent);
+            ResetEvent(mhStatEvent);
+        }
+    }
+
+    DWORD readCount;
+    if(!mReadWait) {
+        MSG_TRACE(3) << "Start reading COM port data";
+        if(!ReadFile(mhPort, mReadBuf.pData(), mReadBuf.count(), &readCount, &mReadOverlapped)) {
+            if(GetLastError() != ERROR_IO_PENDING) {
+                Msg(FILELINE) << "Could not read COM port data, error "
+                              << GetLastError();
+                return false;
+            }
+            MSG_TRACE(3) << "Waiting for overlapped COM port data read completion";
+            mReadWait = true;
+        } else {
+            MSG_TRACE(3) << "COM port data has been read: " << readCount << " bytes";
+            data.count = readCount;
+            ResetEvent(mhReadEvent);
+        }
+    }
+
+    if(mStatWait || mReadWait) {
+        MSG_TRACE(3) << "Checking overlapped COM port operation(s) status";
+        HANDLE handles[] = {mhStatEvent, mhReadEvent, mhStopEvent};
+        // Blocks till the first completion, unless data is there already,
+        // then takes the rest, if any
+        DWORD waitTimeout = (data.count ? 0 : timeout);
+        for(;; waitTimeout = 0) {
+            DWORD res = WaitForMultipleObjects(3, handles, FALSE, waitTimeout);
+            if(res == WAIT_OBJECT_0) { // COM port event
+                MSG_TRACE(3) << "Overlapped COM port event detect completed, retrieving result";
+                if(!GetOverlappedResult(mhPort, &mStatOverlapped, &comStatEvent, FALSE)) {
+                    Msg(FILELINE) << "Could not retrieve overlapped COM port event detect result, error "
+                                  << GetLastError();
+                    return false;
+                }
+                MSG_TRACE(3) << "COM port event(s) detected overlapped, processing";
+                updateStat(comStatEvent);
+                mStatWait = false;
+                ResetEvent(mhStatEvent);
+            } else if(res == WAIT_OBJECT_0 + 1) { // COM port data
+                MSG_TRACE(3) << "Overlapped COM port data read completed, retrieving result";
+                if(!GetOverlappedResult(mhPort, &mReadOverlapped, &readCount, FALSE)) {
+                    Msg(FILELINE) << "Could not retrieve overlapped COM port data read result, error "
+                                  << GetLastError();
+                    return false;
+                }
+                MSG_TRACE(3) << "COM port data has been read overlapped: " << readCount << " bytes";
+                data.count = readCount;
+                mReadWait = false;
+                ResetEvent(mhReadEvent);
+            } else if(res == WAIT_OBJECT_0 + 2) { // stop
+                break;
+            } else if(res == WAIT_TIMEOUT) {
+                MSG_TRACE(3) << "No (more) COM port overlapped operations completed";
+                break;
+            } else {
+                Msg(FILELINE) << "Could not check overlapped COM port operation(s) status, error "
+                              << GetLastError();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void SerialPort::updateStat(DWORD comStatEvent)
+{
+    MSG_TRACE(3) << "COM port status event flags: " << comStatEvent;
+    if(comStatEvent & EV_BREAK) {
+        Msg(FILELINE) << "Break on input";
+    }
+    if(comStatEvent & (EV_CTS | EV_DSR | EV_RING | EV_RLSD)) {
+        DWORD comSignalStat;
+        if(!GetCommModemStatus(mhPort, &comSignalStat)) {
+            Msg(FILELINE) << "Could not retrieve COM port signal status";
+        } else {
+            std::stringstream ss;
+            if(comSignalStat & MS_CTS_ON)
+                ss << " CTS";
+            if(comSignalStat & MS_DSR_ON)
+                ss << " DSR";
+            if(comSignalStat & MS_RING_ON)
+                ss << " RING";
+            if(comSignalStat & MS_RLSD_ON)
+                ss << " RLSD";
+            if(!ss.tellp())
+                ss << " (none)";
+            Msg(FILELINE, 2) << "COM port signals active:" << ss.str();
+        }
+    }
+    if(comStatEvent & EV_ERR) {
+        DWORD comErr;
+        COMSTAT comStat;
+        if(!ClearCommError(mhPort, &comErr, &comStat)) {
+            Msg(FILELINE) << "Could not retrieve COM port error status";
+        } else {
+            std::stringstream ss;
+            if(comErr & CE_BREAK)
+                ss << " BREAK";
+            if(comErr & CE_FRAME)
+                ss << " FRAME";
+            if(comErr & CE_OVERRUN)
+                ss << " OVERRUN";
+            if(comErr & CE_RXOVER)
+                ss << " RXOVER";
+            if(comErr & CE_RXPARITY)
+                ss << " RXPARITY";
+            if(!ss.tellp())
+                ss << " (none)";
+            Msg(FILELINE) << "COM port errors occured:" << ss.str();
+
+            ss.str("");
+            if(comStat.fCtsHold)
+                ss << " CTS hold";
+            if(comStat.fDsrHold)
+                ss << " DSR hold";
+            if(comStat.fRlsdHold)
+                ss << " RLSD hold";
+            if(comStat.fXoffHold)
+                ss << " XOFF hold";
+            if(comStat.fXoffSent)
+                ss << " XOFF sent";
+            if(comStat.fEof)
+                ss << " EOF";
+            if(comStat.fTxim)
+                ss << " TXIM";
+            if(!ss.tellp())
+                Msg(2) << " (none)";
+            Msg(FILELINE, 2) << "COM port statuses:" << ss.str();
+
+            Msg(FILELINE, 2) << "COM port input  queue size: " << comStat.cbInQue;
+            Msg(FILELINE, 2) << "COM port output queue size: " << comStat.cbInQue;
+        }
+    }
+    if(comStatEvent & EV_RXCHAR) {
+        Msg(FILELINE, 2) << "Character(s) was received via COM port";
+    }
+    if(comStatEvent & EV_RXFLAG) {
+        Msg(FILELINE, 2) << "Event character(s) was received via COM port";
+    }
+    if(comStatEvent & EV_TXEMPTY) {
+        Msg(FILELINE, 2) << "Last character in the COM output buffer was sent";
+    }
+}
+
+#else // _WIN32
+
+bool SerialPort::initStop()
+{
+    Msg(FILELINE, 2) << "Creating serial port stop pipe";
+    if(pipe(mStopPipe)) {
+        Msg(FILELINE) << "Could not create serial port stop pipe, error " << errno;
+        return false;
+    }
+    return true;
+}
+
+void SerialPort::requestStop()
+{
+    char wakeup = 0;
+    if(write(mStopPipe[1], &wakeup, 1) < 0)
+        Msg(FILELINE) << "Could not wake up serial port reader, error " << errno;
+}
+
+bool SerialPort::waitStop(int timeout)
+{
+    pollfd stopFd = {mStopPipe[0], POLLIN, 0};
+    return (poll(&stopFd, 1, timeout) > 0);
+}
+
+bool SerialPort::open(const std::string & name)
+{
+    Msg(FILELINE, 2) << "Opening serial port: " << name;
+    mFd = ::open(name.data(), O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if(mFd < 0) {
+        Msg(FILELINE) << "Could not open serial port, error " << errno;
+        return false;
+    }
+
+    Msg(FILELINE, 2) << "Tuning serial port";
+    termios tio;
+    if(tcgetattr(mFd, &tio)) {
+        Msg(FILELINE) << "Could not retrieve current serial port settings, error "
+                      << errno;
+        return false;
+    }
+    // 9600 8N1, no flow control, bytes come as they are
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B9600);
+    cfsetospeed(&tio, B9600);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    if(tcsetattr(mFd, TCSANOW, &tio)) {
+        Msg(FILELINE) << "Could not tune serial port, error " << errno;
+        return false;
+    }
+    return true;
+}
+
+void SerialPort::close()
+{
+    if(mFd >= 0)
+        ::close(mFd);
+    mFd = -1;
+}
+
+bool SerialPort::read(ByteBufferRef & data, int timeout)
+{
+    data = {mReadBuf.pData(), 0};
+
+    MSG_TRACE(3) << "Waiting for serial port data";
+    pollfd fds[] = {{mFd, POLLIN, 0}, {mStopPipe[0], POLLIN, 0}};
+    int res = poll(fds, 2, timeout);
+    if(res < 0 && errno != EINTR) {
+        Msg(FILELINE) << "Could not wait for serial port data, error " << errno;
+        return false;
+    }
+    if(res > 0 && !fds[1].revents) {
+        if(fds[0].revents & POLLIN) {
+            ssize_t readCount = ::read(mFd, mReadBuf.pData(), mReadBuf.count());
+            if(readCount < 0 && errno != EAGAIN && errno != EINTR) {
+                Msg(FILELINE) << "Could not read serial port data, error " << errno;
+                return false;
+            }
+            if(readCount > 0) {
+                MSG_TRACE(3) << "Serial port data has been read: " << readCount << " bytes";
+                data.count = readCount;
+                return true;
+            }
+        }
+        // Data pending is taken first, hang up comes with nothing to read
+        if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            Msg(FILELINE) << "Serial port has been hung up or failed";
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif // _WIN32
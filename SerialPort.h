@@ -0,0 +1,60 @@
+#ifndef SERIALPORT_H
+#define SERIALPORT_H
+
+#include "Buffer.h"
+#include <string>
+
+#ifdef _WIN32
+#include "Win.h"
+#endif
+
+    //-- class SerialPort --//
+
+// Read-only serial port at 9600 8N1 with no flow control, served by a single
+// reader thread which blocks on port readiness: overlapped I/O on Windows,
+// poll() over termios elsewhere, so the reader runs against a pty as well.
+// Stop may be requested from any thread, waking the reader up
+
+class SerialPort final
+{
+public:
+    SerialPort();
+    ~SerialPort();
+
+    // deleted
+    SerialPort(const SerialPort &) = delete;
+    SerialPort & operator = (const SerialPort &) = delete;
+
+    // Prepares stop request, before the reader thread starts
+    bool initStop();
+    void requestStop();
+    bool waitStop(int timeout); // in milliseconds, true if stop requested
+
+    bool open(const std::string & name);
+    void close();
+
+    // Blocks till data, stop or timeout, in milliseconds. Data refers to the
+    // internal buffer till the next read, and is empty if nothing came. False
+    // on port failure, the port is to be reopened then
+    bool read(ByteBufferRef & data, int timeout);
+
+private:
+#ifdef _WIN32
+    void updateStat(DWORD comStatEvent);
+
+    HANDLE_Handle mhPort;
+    HANDLE_Handle mhStatEvent;
+    OVERLAPPED mStatOverlapped;
+    bool mStatWait;
+    HANDLE_Handle mhReadEvent;
+    OVERLAPPED mReadOverlapped;
+    bool mReadWait;
+    HANDLE_Handle mhStopEvent;
+#else
+    int mFd;
+    int mStopPipe[2];
+#endif
+    ByteBuffer mReadBuf;
+};
+
+#endif // SERIALPORT_H
@@ -4,12 +4,23 @@
 #include "Capturer.h"
 #include "Guard.h"
 #include "GStreamer.h"
+#include "Trace.h"
+#include <gst/video/video.h>
+#include <gst/rtp/gstrtpbuffer.h>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <chrono>
+#include <thread>
 #include <cstdlib>
 #include <sys/time.h>
 
+/* Qt 5.6.3's GCC 4.9.2 doesn't need it:
+#ifdef __MINGW32__
+#include <mingw.thread.h>
+#endif
+/**/
+
     //-- class Server --//
 
 void Server::run()
@@ -19,51 +30,40 @@ void Server::run()
         return;
     }
 
-    std::string gstDebug = "GST_DEBUG=" +
-            std::to_string(Params()->gstTraceLevel);
-    putenv(gstDebug.data());
-    Msg(FILELINE, 3) << gstDebug;
-
-    std::string gstPluginPath = "GST_PLUGIN_PATH=" +
-            CharText(getExePath()) + "plugins";
-    putenv(gstPluginPath.data());
-    Msg(FILELINE, 3) << gstPluginPath;
+    initGStreamer();
 
-    Msg(FILELINE, 2) << "Init GStreamer";
-    gst_init(NULL, NULL);
+    if(Params()->gopCache > 0) {
+        Msg(FILELINE, 2) << "Creating GOP cache";
+        mpGopCache = std::make_unique<GopCache>(
+                    Params()->gopCache * 1024, frameDuration());
+    }
 
     std::ostringstream ss;
 
-    ss << "( appsrc name=desktopcapsrc ! videoconvert ! video/x-raw,format=I420";
-
-    FrameSize frameSize = {size_t(GetSystemMetrics(SM_CXSCREEN)),
-                           size_t(GetSystemMetrics(SM_CYSCREEN))};
-    FrameSize encodeSize = frameSize.scaled(Params()->scale)
-            .aligned(4).bounded({320, 200}, {1920, 1080});
-    if(encodeSize != frameSize) {
-        ss << " ! videoscale ! video/x-raw,width=" << encodeSize.width
-           << ",height=" << encodeSize.height;
+    if(Params()->encoderType == EncoderType::x264) {
+        // Encoded by H264Encoder right in need-data handler
+        ss << "( appsrc name=desktopcapsrc";
+    } else {
+        ss << "( appsrc name=desktopcapsrc ! "
+           << encodeDescr(Capturer::screenSize(), Params()->preset)
+           << " ! queue";
     }
 
-    ss << " ! x264enc speed-preset=" << Params()->preset
-       << " psy-tune=animation pass=qual quantizer=" << Params()->crf
-       << " qp-max=" << Params()->crfMax
-       << " key-int-max=" << Params()->keyint
-       << " bitrate=" << (Params()->bitrate > 0 ? Params()->bitrate : 2048)
-       << " intra-refresh=" << (Params()->intraRefresh ? "true" : "false");
-
-    ss << " ! queue ! rtph264pay name=pay0 pt=96 perfect-rtptime=false config-interval=1 )";
+    ss << " ! rtph264pay name=pay0 pt=96 perfect-rtptime=false config-interval=1 )";
     Msg(FILELINE, 2) << "Pipeline description: \"" << ss.str() << "\"";
 
     Msg(FILELINE, 2) << "Creating and setting up RTSP Media Factory";
     GstRTSPMediaFactory * pFactory = gst_rtsp_media_factory_new();
     g_signal_connect(pFactory, "media-configure", (GCallback)&onMediaConfigure0, this);
     gst_rtsp_media_factory_set_launch(pFactory, ss.str().data());
-    gst_rtsp_media_factory_set_shared(pFactory, TRUE);
+    // With GOP cache each client has its own media, but encoder is still
+    // a single one, its data goes to all of them through the cache
+    gst_rtsp_media_factory_set_shared(pFactory, (mpGopCache ? FALSE : TRUE));
 
     Msg(FILELINE, 2) << "Creating and setting up RTSP Server";
     GstRTSPServer * pServer = gst_rtsp_server_new();
     gst_rtsp_server_set_service(pServer, std::to_string(Params()->rtspPort).data());
+    g_signal_connect(pServer, "client-connected", (GCallback)&onClientConnected0, this);
     if(!gst_rtsp_server_attach(pServer, NULL)) {
         Msg(FILELINE) << "Couldn't start RTSP Server";
         setState(State::failed);
@@ -77,6 +77,27 @@ void Server::run()
     Msg(FILELINE) << "Activated URL: rtsp://localhost:"
                   << Params()->rtspPort << "/desktop";
 
+    // Simulcast streams share capture and colour conversion with the main one
+    for(const SimulcastStream & streamParams: Params()->simulcast) {
+        mSubStreams.push_back(std::make_unique<SubStream>());
+        SubStream * pStream = mSubStreams.back().get();
+        pStream->pServer = this;
+        pStream->pParams = &streamParams;
+        pStream->pAppSrc = nullptr;
+        pStream->timestamp = 0;
+
+        GstRTSPMediaFactory * pSubFactory = gst_rtsp_media_factory_new();
+        g_signal_connect(pSubFactory, "media-configure",
+                         (GCallback)&onSubMediaConfigure0, pStream);
+        gst_rtsp_media_factory_set_launch(pSubFactory, ss.str().data());
+        gst_rtsp_media_factory_set_shared(pSubFactory, TRUE);
+        gst_rtsp_mount_points_add_factory(hMounts, streamParams.mount.data(),
+                                          pSubFactory);
+
+        Msg(FILELINE) << "Activated URL: rtsp://localhost:"
+                      << Params()->rtspPort << streamParams.mount;
+    }
+
     Msg(FILELINE, 2) << "Creating and starting main loop";
     GMainLoop_Handle hMainLoop = g_main_loop_new(NULL, FALSE);
     g_main_loop_run(hMainLoop);
@@ -84,6 +105,51 @@ void Server::run()
     setState(State::zombie);
 }
 
+void Server::initGStreamer()
+{
+    std::string gstDebug = "GST_DEBUG=" +
+            std::to_string(Params()->gstTraceLevel);
+    putenv(gstDebug.data());
+    MSG_TRACE(3) << gstDebug;
+
+    std::string gstPluginPath = "GST_PLUGIN_PATH=" +
+            CharText(getExePath()) + "plugins";
+    putenv(gstPluginPath.data());
+    MSG_TRACE(3) << gstPluginPath;
+
+    Msg(FILELINE, 2) << "Init GStreamer";
+    gst_init(NULL, NULL);
+}
+
+std::string Server::encodeDescr(
+        const FrameSize & frameSize, const char * preset)
+{
+    std::ostringstream ss;
+    ss << "videoconvert ! video/x-raw,format=I420";
+
+    FrameSize encodeSize = frameSize.scaled(Params()->scale)
+            .aligned(4).bounded({320, 200}, {1920, 1080});
+    if(encodeSize != frameSize) {
+        ss << " ! videoscale ! video/x-raw,width=" << encodeSize.width
+           << ",height=" << encodeSize.height;
+    }
+
+    ss << " ! x264enc name=encoder speed-preset=" << preset
+       << " psy-tune=animation pass=qual quantizer=" << Params()->crf
+       << " qp-max=" << Params()->crfMax
+       << " key-int-max=" << Params()->keyint
+       << " bitrate=" << (Params()->bitrate > 0 ? Params()->bitrate : 2048)
+       << " intra-refresh=" << (Params()->intraRefresh ? "true" : "false");
+    // Only those given, defaults are of x264enc
+    if(Params()->encoderThreads > 0)
+        ss << " threads=" << Params()->encoderThreads;
+    if(Params()->encoderThreading == EncoderThreading::sliced)
+        ss << " sliced-threads=true";
+    if(Params()->slices > 0)
+        ss << " option-string=slices=" << Params()->slices;
+    return ss.str();
+}
+
 void Server::onMediaConfigure0(
         GstRTSPMediaFactory * pFactory, GstRTSPMedia * pMedia, Server * pThis)
 {
@@ -95,35 +161,162 @@ void Server::onMediaConfigure(
 {
     Msg(FILELINE, 2) << "Configuring GStreamer media";
 
-    Msg(FILELINE, 3) << "Obtaining GStreamer element from media";
+    MSG_TRACE(3) << "Obtaining GStreamer element from media";
     GstElement_Handle hElement = gst_rtsp_media_get_element(pMedia);
-    Msg(FILELINE, 3) << "Obtaining GStreamer appsrc element";
+    MSG_TRACE(3) << "Obtaining GStreamer appsrc element";
     GstElement_Handle hAppSrc = gst_bin_get_by_name_recurse_up(
                 GST_BIN((GstElement *)hElement), "desktopcapsrc");
-    Msg(FILELINE, 3) << "Set GStreamer appsrc format";
+    MSG_TRACE(3) << "Set GStreamer appsrc format";
     gst_util_set_object_arg(
                 G_OBJECT((GstElement *)hAppSrc), "format", "time");
 
-    FrameSize frameSize = {size_t(GetSystemMetrics(SM_CXSCREEN)),
-                           size_t(GetSystemMetrics(SM_CYSCREEN))};
+    FrameSize frameSize = Capturer::screenSize();
     Fps fps = Params()->fps;
-    Msg(FILELINE, 3) << "Set GStreamer appsrc caps";
-    g_object_set(G_OBJECT((GstElement *)hAppSrc), "caps",
-                 gst_caps_new_simple(
-                     "video/x-raw",
-                     "format", G_TYPE_STRING, "BGRx",
-                     "width", G_TYPE_INT, frameSize.width,
-                     "height", G_TYPE_INT, frameSize.height,
-                     "framerate", GST_TYPE_FRACTION, fps.num, fps.den,
-                     NULL), NULL);
-
-    Msg(FILELINE, 3) << "Connecting need-data signal";
+    MSG_TRACE(3) << "Set GStreamer appsrc caps";
+    if(Params()->encoderType == EncoderType::x264) {
+        g_object_set(G_OBJECT((GstElement *)hAppSrc), "caps",
+                     encodedCaps(), NULL);
+    } else {
+        g_object_set(G_OBJECT((GstElement *)hAppSrc), "caps",
+                     gst_caps_new_simple(
+                         "video/x-raw",
+                         "format", G_TYPE_STRING, "BGRx",
+                         "width", G_TYPE_INT, frameSize.width,
+                         "height", G_TYPE_INT, frameSize.height,
+                         "framerate", GST_TYPE_FRACTION, fps.num, fps.den,
+                         NULL), NULL);
+    }
+
+    if(Params()->encoderType != EncoderType::x264) {
+        MSG_TRACE(3) << "Obtaining GStreamer x264enc element";
+        mhGstEncoder = gst_bin_get_by_name_recurse_up(
+                    GST_BIN((GstElement *)hElement), "encoder");
+        applyGstRateControl(mRateControl);
+    }
+
+    MSG_TRACE(3) << "Connecting need-data signal";
     g_signal_connect(hAppSrc, "need-data", (GCallback)&onNeedData0, this);
 
+    if(FrameTrace::enabled()) {
+        MSG_TRACE(3) << "Adding GStreamer payloader probe for frame trace";
+        GstElement_Handle hPay = gst_bin_get_by_name_recurse_up(
+                    GST_BIN((GstElement *)hElement), "pay0");
+        GstPad * pPad = gst_element_get_static_pad(hPay, "src");
+        gst_pad_add_probe(pPad, GstPadProbeType(
+                              GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          (GstPadProbeCallback)&onPayloaded0, this, NULL);
+        gst_object_unref(pPad);
+    }
+
+    if(mpGopCache) {
+        g_signal_connect(pMedia, "unprepared", (GCallback)&onMediaUnprepared0, this);
+        std::lock_guard<std::mutex> cacheLock(mCacheMutex);
+        // Encoder goes on, new media starts with the kept GOP
+        if(!mpGopCache->attach(GST_APP_SRC((GstElement *)hAppSrc)))
+            mKeyframeRequested = true;
+        MSG_TRACE(3) << "Configuring GStreamer media finished";
+        return;
+    }
+
+    std::lock_guard<std::mutex> cacheLock(mCacheMutex);
+    if(!mSubStreams.empty()) {
+        // Need-data of simulcast streams encodes this one as well
+        g_signal_connect(pMedia, "unprepared", (GCallback)&onMediaUnprepared0, this);
+        mpMainAppSrc = GST_APP_SRC((GstElement *)hAppSrc);
+    }
+
     mTimestamp = 0;
     mFrameSerial = 0;
+    // New stream has to start from scratch, i.e. from keyframe
+    mpEncoder.reset();
+
+    MSG_TRACE(3) << "Configuring GStreamer media finished";
+}
+
+void Server::onMediaUnprepared0(
+        GstRTSPMedia * pMedia, Server * pThis)
+{
+    pThis->onMediaUnprepared(pMedia);
+}
+
+void Server::onMediaUnprepared(
+        GstRTSPMedia * pMedia)
+{
+    Msg(FILELINE, 2) << "Unpreparing GStreamer media";
+    GstElement_Handle hElement = gst_rtsp_media_get_element(pMedia);
+    GstElement_Handle hAppSrc = gst_bin_get_by_name_recurse_up(
+                GST_BIN((GstElement *)hElement), "desktopcapsrc");
+    if(!hAppSrc)
+        return;
 
-    Msg(FILELINE, 3) << "Configuring GStreamer media finished";
+    std::lock_guard<std::mutex> cacheLock(mCacheMutex);
+    if(mpGopCache)
+        mpGopCache->detach(GST_APP_SRC((GstElement *)hAppSrc));
+    if(mpMainAppSrc == GST_APP_SRC((GstElement *)hAppSrc))
+        mpMainAppSrc = nullptr;
+}
+
+void Server::onSubMediaConfigure0(
+        GstRTSPMediaFactory *, GstRTSPMedia * pMedia, SubStream * pStream)
+{
+    Msg(FILELINE, 2) << "Configuring GStreamer media of "
+                     << pStream->pParams->mount;
+
+    GstElement_Handle hElement = gst_rtsp_media_get_element(pMedia);
+    GstElement_Handle hAppSrc = gst_bin_get_by_name_recurse_up(
+                GST_BIN((GstElement *)hElement), "desktopcapsrc");
+    gst_util_set_object_arg(
+                G_OBJECT((GstElement *)hAppSrc), "format", "time");
+    g_object_set(G_OBJECT((GstElement *)hAppSrc), "caps", encodedCaps(), NULL);
+
+    // Any stream may drive encoding of all of them
+    g_signal_connect(hAppSrc, "need-data", (GCallback)&onSubNeedData0, pStream);
+    g_signal_connect(pMedia, "unprepared", (GCallback)&onSubMediaUnprepared0, pStream);
+
+    std::lock_guard<std::mutex> cacheLock(pStream->pServer->mCacheMutex);
+    pStream->pAppSrc = GST_APP_SRC((GstElement *)hAppSrc);
+    pStream->timestamp = 0;
+    pStream->pEncoder.reset();
+}
+
+void Server::onSubMediaUnprepared0(
+        GstRTSPMedia *, SubStream * pStream)
+{
+    Msg(FILELINE, 2) << "Unpreparing GStreamer media of "
+                     << pStream->pParams->mount;
+
+    std::lock_guard<std::mutex> cacheLock(pStream->pServer->mCacheMutex);
+    pStream->pAppSrc = nullptr;
+}
+
+void Server::onSubNeedData0(
+        GstAppSrc * pAppSrc, guint, SubStream * pStream)
+{
+    pStream->pServer->onNeedData(pAppSrc);
+}
+
+void Server::onClientConnected0(
+        GstRTSPServer *, GstRTSPClient * pClient, Server * pThis)
+{
+    Msg(FILELINE, 2) << "RTSP client connected";
+    g_signal_connect(pClient, "play-request", (GCallback)&onPlayRequest0, pThis);
+}
+
+void Server::onPlayRequest0(
+        GstRTSPClient * pClient, GstRTSPContext *, Server * pThis)
+{
+    pThis->onPlayRequest(pClient);
+}
+
+void Server::onPlayRequest(
+        GstRTSPClient *)
+{
+    // Media is shared, so a joining client would otherwise wait for
+    // a decodable picture up to a whole GOP
+    if(mpGopCache)
+        return; // it starts with the kept GOP instead
+    Msg(FILELINE, 2) << "RTSP client starts playing, keyframe requested";
+    mKeyframeRequested = true;
 }
 
 void Server::onNeedData0(
@@ -135,20 +328,150 @@ void Server::onNeedData0(
 void Server::onNeedData(
         GstAppSrc * pAppSrc)
 {
-    Msg(FILELINE, 3) << "Data request for new frame: " << ++mFrameSerial;
+    std::unique_lock<std::mutex> cacheLock(mCacheMutex, std::defer_lock);
+    if(mpGopCache || !mSubStreams.empty()) {
+        cacheLock.lock();
+        // Frames encoded on request of other media came here already
+        if(gst_app_src_get_current_level_bytes(pAppSrc) > 0)
+            return;
+    }
+
+    MSG_TRACE(3) << "Data request for new frame: " << ++mFrameSerial;
+
+    if(mControlTimeout) {
+        checkRateControl();
+        FrameTrace::checkRequest();
+        mControlTimeout.start();
+    }
+    if(mKeyframeRequested.exchange(false))
+        forceKeyframe();
 
+    if(!mpCaptureThread) {
+        Msg(FILELINE, 2) << "Creating capture thread";
+        mpCaptureThread = std::make_unique<CaptureThread>(
+                    [this]() { return captureFrame(); }, Params()->fps);
+    }
+    // Valid one, capturer gives null frame on failure
+    Frame frame = mpCaptureThread->getFrame();
+    mCaptureSerial = mpCaptureThread->frameSerial();
+    FrameTrace::setFrame(mFrameSerial, mCaptureSerial);
+
+    if(Params()->encoderType == EncoderType::x264) {
+        if(!mpEncoder) {
+            Msg(FILELINE, 2) << "Creating H.264 encoder";
+            mpEncoder = std::make_unique<H264Encoder>(
+                        this, &Server::onEncodedData);
+            mpEncoder->reconfigure(mRateControl);
+        }
+        encodeFrame(pAppSrc, frame);
+
+        // Appsrc waits for a buffer once requested, with no more requests,
+        // so encoding goes on with fresh frames till something comes out:
+        // encoder may hold frames back, or be recovering from a failure
+        if(!gst_app_src_get_current_level_bytes(pAppSrc)) {
+            Msg(FILELINE, 2) << "No encoded data for appsrc yet, encoding goes on";
+            while(!gst_app_src_get_current_level_bytes(pAppSrc) && streaming(pAppSrc)) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(frameDuration()));
+                if(mKeyframeRequested.exchange(false))
+                    forceKeyframe();
+                frame = mpCaptureThread->getFrame();
+                mCaptureSerial = mpCaptureThread->frameSerial();
+                FrameTrace::setFrame(mFrameSerial, mCaptureSerial);
+                encodeFrame(pAppSrc, frame);
+            }
+        }
+        MSG_TRACE(3) << "Data request for new frame finished";
+        return;
+    }
+
+    GstBuffer_Handle hBuffer;
+    if(frame.buffer) {
+        MSG_TRACE(3) << "Wrapping pooled frame buffer into GStreamer buffer";
+        hBuffer = gst_buffer_new_wrapped_full(
+                    GST_MEMORY_FLAG_READONLY, frame.pPixels,
+                    frame.dataSize(), 0, frame.dataSize(),
+                    PooledBufferRef(frame.buffer).detach(), &onBufferRelease0);
+        if(!hBuffer) {
+            Msg(FILELINE) << "Could not wrap pooled frame buffer";
+            return;
+        }
+    } else {
+        MSG_TRACE(3) << "Allocating GStreamer frame buffer";
+        hBuffer = gst_buffer_new_allocate(NULL, frame.dataSize(), NULL);
+        if(!hBuffer) {
+            Msg(FILELINE) << "Could not allocate GStreamer frame buffer";
+            return;
+        }
+
+        MSG_TRACE(3) << "Mapping GStreamer frame buffer";
+        GstMapInfo map;
+        if(!gst_buffer_map(hBuffer, &map, GST_MAP_WRITE)) {
+            Msg(FILELINE) << "Could not map GStreamer frame buffer";
+            return;
+        }
+        ScopeGuard mapGuard([&hBuffer, &map](){
+            gst_buffer_unmap(hBuffer, &map);
+        });
+
+        MSG_TRACE(3) << "Copying data into GStreamer frame buffer";
+        TraceSpan copySpan("copy");
+        memcpy(map.data, frame.pPixels, frame.dataSize());
+    }
+
+    if(!pushBuffer(pAppSrc, hBuffer))
+        return;
+
+    MSG_TRACE(3) << "Data request for new frame finished";
+}
+
+void Server::encodeFrame(
+        GstAppSrc * pAppSrc, const Frame & frame)
+{
+    if(!mSubStreams.empty()) {
+        encodeSimulcast(frame);
+        return;
+    }
+    mpEncoderAppSrc = pAppSrc;
+    mpEncoder->encode(frame);
+    mpEncoderAppSrc = nullptr;
+    // Encoded data of a frame may be pushed in several buffers
+    if(mpGopCache) {
+        if(!mpGopCache->endFrame())
+            mKeyframeRequested = true;
+    } else
+        mTimestamp += frameDuration();
+}
+
+bool Server::streaming(
+        GstAppSrc * pAppSrc)
+{
+    // Target goes down first on media teardown, then appsrc flushes
+    GST_OBJECT_LOCK(pAppSrc);
+    bool streaming = (GST_STATE_TARGET(pAppSrc) >= GST_STATE_PAUSED);
+    GST_OBJECT_UNLOCK(pAppSrc);
+    return streaming;
+}
+
+Frame Server::captureFrame()
+{
     if(!mpCapturer) {
         Msg(FILELINE, 2) << "Creating capturer";
         mpCapturer = Capturer::create();
     }
-    FrameSource * pFrameSource = mpCapturer.get();
+
+    // Records raw captured frames while requested, see FrameRecorder
+    if(!mpRecorder) {
+        Msg(FILELINE, 2) << "Creating frame recorder";
+        mpRecorder = std::make_unique<FrameRecorder>(mpCapturer.get());
+    }
+    FrameSource * pFrameSource = mpRecorder.get();
 
     if(Params()->comPort) {
         if(!mpScales) {
             Msg(FILELINE, 2) << "Creating scales object";
             mpScales = std::make_unique<Scales>();
+            mpScales->start();
         }
-        mpScales->updateWeight();
 
         if(!Params()->dbUser.empty()) {
             if(!mpScalesLogger) {
@@ -161,48 +484,281 @@ void Server::onNeedData(
         if(!mpScalesFilter) {
             Msg(FILELINE, 2) << "Creating frame source";
             mpScalesFilter = std::make_unique<ScalesFilter>(
-                        mpCapturer.get(), mpScales.get());
+                        pFrameSource, mpScales.get());
         }
         pFrameSource = mpScalesFilter.get();
     }
 
-    Frame frame = pFrameSource->getFrame();
+    if(Params()->damageTracking) {
+        if(!mpDamageTracker) {
+            Msg(FILELINE, 2) << "Creating damage tracker";
+            mpDamageTracker = std::make_unique<DamageTracker>(pFrameSource);
+        }
+        pFrameSource = mpDamageTracker.get();
+    }
 
-    Msg(FILELINE, 3) << "Allocating GStreamer frame buffer";
-    GstBuffer_Handle hBuffer = gst_buffer_new_allocate(
-                NULL, frame.dataSize(), NULL);
-    if(!hBuffer) {
-        Msg(FILELINE) << "Could not allocate GStreamer frame buffer";
+    return pFrameSource->getFrame();
+}
+
+void Server::forceKeyframe()
+{
+    if(mpEncoder) {
+        mpEncoder->requestKeyframe();
+        for(auto & pStream: mSubStreams)
+            if(pStream->pEncoder)
+                pStream->pEncoder->requestKeyframe();
+    } else if(mhGstEncoder) {
+        Msg(FILELINE, 2) << "Sending force key unit event to x264enc";
+        // Upstream event goes into src pad of the element
+        gst_element_send_event(mhGstEncoder,
+                               gst_video_event_new_upstream_force_key_unit(
+                                   GST_CLOCK_TIME_NONE, TRUE, 0));
+    }
+}
+
+void Server::encodeSimulcast(
+        const Frame & frame)
+{
+    // Colour conversion is done once, by the main encoder, others scale
+    // its image to their own sizes
+    if(!mpEncoder->convert(frame))
         return;
+
+    std::vector<SubStream *> streams;
+    for(auto & pStream: mSubStreams) {
+        if(!pStream->pAppSrc)
+            continue; // no clients
+        if(!pStream->pEncoder) {
+            Msg(FILELINE, 2) << "Creating H.264 encoder for "
+                             << pStream->pParams->mount;
+            pStream->pEncoder = std::make_unique<H264Encoder>(
+                        pStream.get(), &SubStream::onEncodedData);
+            pStream->pEncoder->setScale(&pStream->pParams->scale);
+            RateControl rateControl;
+            if(pStream->pParams->bitrate > 0)
+                rateControl.bitrate = pStream->pParams->bitrate;
+            pStream->pEncoder->reconfigure(rateControl);
+        }
+        streams.push_back(pStream.get());
     }
 
-    Msg(FILELINE, 3) << "Setting up GStreamer frame buffer";
-    Fps fps = Params()->fps;
-    GST_BUFFER_PTS((GstBuffer *)hBuffer) = mTimestamp;
-    GST_BUFFER_DURATION((GstBuffer *)hBuffer) =
-            gst_util_uint64_scale_int(fps.den, GST_SECOND, fps.num);
-    mTimestamp += GST_BUFFER_DURATION((GstBuffer *)hBuffer);
+    if(!mpStreamWorkers) {
+        Msg(FILELINE, 2) << "Creating worker pool for simulcast encoders";
+        mpStreamWorkers = std::make_unique<WorkerPool>(mSubStreams.size());
+    }
 
-    Msg(FILELINE, 3) << "Mapping GStreamer frame buffer";
-    GstMapInfo map;
-    if(!gst_buffer_map(hBuffer, &map, GST_MAP_WRITE)) {
-        Msg(FILELINE) << "Could not map GStreamer frame buffer";
+    size_t mainTasks = (mpMainAppSrc ? 1 : 0);
+    if(mainTasks + streams.size() == 0)
         return;
-    }
-    ScopeGuard mapGuard([&hBuffer, &map](){
-        gst_buffer_unmap(hBuffer, &map);
+    mpEncoderAppSrc = mpMainAppSrc;
+    mpStreamWorkers->run(mainTasks + streams.size(),
+                         [this, &frame, &streams, mainTasks](size_t taskIdx) {
+        FrameTrace::setFrame(mFrameSerial, mCaptureSerial);
+        if(taskIdx < mainTasks)
+            mpEncoder->encode(frame, *mpEncoder);
+        else
+            streams[taskIdx - mainTasks]->pEncoder->encode(frame, *mpEncoder);
     });
+    mpEncoderAppSrc = nullptr;
+
+    if(mpMainAppSrc)
+        mTimestamp += frameDuration();
+    for(SubStream * pStream: streams)
+        pStream->timestamp += frameDuration();
+}
 
-    Msg(FILELINE, 3) << "Copying data into GStreamer frame buffer";
-    memcpy(map.data, frame.pPixels, frame.dataSize());
-    mapGuard.release();
+void Server::checkRateControl()
+{
+    MSG_TRACE(3) << "Checking rate control file";
+
+    // Requested by tune option from the command line
+    RateControl rateControl = RateControl::take();
+    if(rateControl.empty())
+        return;
+
+    mRateControl.merge(rateControl);
+    if(mpEncoder)
+        mpEncoder->reconfigure(rateControl);
+    if(mhGstEncoder)
+        applyGstRateControl(rateControl);
+}
+
+void Server::applyGstRateControl(const RateControl & rateControl)
+{
+    if(!mhGstEncoder || rateControl.empty())
+        return;
+
+    // x264enc reconfigures its encoder on some properties while playing,
+    // the rest it ignores then, so they only take effect on the next media
+    Msg(FILELINE, 2) << "Setting GStreamer x264enc rate control";
+    GObject * pEncoder = G_OBJECT((GstElement *)mhGstEncoder);
+    bool playing = (GST_STATE((GstElement *)mhGstEncoder) > GST_STATE_READY);
+    auto setProperty = [pEncoder, playing](const char * pName, guint value) {
+        GParamSpec * pSpec = g_object_class_find_property(
+                    G_OBJECT_GET_CLASS(pEncoder), pName);
+        if(!pSpec) {
+            Msg(FILELINE) << "x264enc has no " << pName << " property";
+            return;
+        }
+        if(playing && !(pSpec->flags & GST_PARAM_MUTABLE_PLAYING)) {
+            Msg(FILELINE) << "x264enc can't change " << pName
+                          << " while playing, skipped till the next media";
+            return;
+        }
+        g_object_set(pEncoder, pName, value, NULL);
+        Msg(FILELINE) << "x264enc " << pName << " set to " << value;
+    };
+    if(rateControl.bitrate >= 0)
+        setProperty("bitrate", guint(rateControl.bitrate > 0 ? rateControl.bitrate : 2048));
+    if(rateControl.crf >= 0)
+        setProperty("quantizer", guint(rateControl.crf));
+    if(rateControl.crfMax >= 0)
+        setProperty("qp-max", guint(rateControl.crfMax));
+}
+
+void Server::onEncodedData(
+        uint8_t * pData, size_t size)
+{
+    if(!mpEncoderAppSrc) {
+        Msg(FILELINE, 2) << "Dropping encoded data flushed with no stream";
+        return;
+    }
+
+    MSG_TRACE(3) << "Allocating GStreamer encoded data buffer";
+    // Encoder reuses its output memory, so the data is copied
+    GstBuffer_Handle hBuffer = gst_buffer_new_allocate(NULL, size, NULL);
+    if(!hBuffer) {
+        Msg(FILELINE) << "Could not allocate GStreamer encoded data buffer";
+        return;
+    }
+    gst_buffer_fill(hBuffer, 0, pData, size);
+    if(!mpEncoder->keyframe())
+        GST_BUFFER_FLAG_SET((GstBuffer *)hBuffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if(mpGopCache) {
+        mpGopCache->add(hBuffer, mpEncoder->keyframe());
+        return;
+    }
+    pushBuffer(mpEncoderAppSrc, hBuffer, false);
+}
+
+bool Server::pushBuffer(
+        GstAppSrc * pAppSrc, GstBuffer_Handle & hBuffer, bool advance)
+{
+    MSG_TRACE(3) << "Setting up GStreamer buffer";
+    GST_BUFFER_PTS((GstBuffer *)hBuffer) = mTimestamp;
+    GST_BUFFER_DURATION((GstBuffer *)hBuffer) = frameDuration();
+    if(FrameTrace::enabled())
+        tracePush(mTimestamp);
+    if(advance)
+        mTimestamp += frameDuration();
 
     GstFlowReturn ret = gst_app_src_push_buffer(pAppSrc, hBuffer);
+    hBuffer.reset(); // taken by appsrc anyway
     if(ret != GST_FLOW_OK) {
-        Msg(FILELINE) << "Could not push GStreamer frame buffer, error " << ret;
+        Msg(FILELINE) << "Could not push GStreamer buffer, error " << ret;
+        return false;
+    }
+    return true;
+}
+
+void Server::tracePush(
+        GstClockTime timestamp)
+{
+    std::lock_guard<std::mutex> traceGuard(mTraceMutex);
+    TracedPush & push = mTracedPushes[mFrameSerial % tracedPushCount];
+    if(push.frame == uint64_t(mFrameSerial) && push.timestamp == timestamp)
+        return; // another slice of the frame
+    push = {timestamp, uint64_t(mFrameSerial), mCaptureSerial, FrameTrace::now()};
+}
+
+GstPadProbeReturn Server::onPayloaded0(
+        GstPad *, GstPadProbeInfo * pInfo, Server * pThis)
+{
+    if(GST_PAD_PROBE_INFO_TYPE(pInfo) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList * pList = GST_PAD_PROBE_INFO_BUFFER_LIST(pInfo);
+        guint length = gst_buffer_list_length(pList);
+        if(length > 0)
+            pThis->onPayloaded(gst_buffer_list_get(pList, length - 1));
+    } else {
+        pThis->onPayloaded(GST_PAD_PROBE_INFO_BUFFER(pInfo));
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+void Server::onPayloaded(
+        GstBuffer * pBuffer)
+{
+    // Frame is out with the last packet of its access unit
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if(!gst_rtp_buffer_map(pBuffer, GST_MAP_READ, &rtp))
         return;
+    bool marker = gst_rtp_buffer_get_marker(&rtp);
+    gst_rtp_buffer_unmap(&rtp);
+    if(!marker)
+        return;
+
+    std::lock_guard<std::mutex> traceGuard(mTraceMutex);
+    for(TracedPush & push: mTracedPushes) {
+        if(push.frame && push.timestamp == GST_BUFFER_PTS(pBuffer)) {
+            FrameTrace::setFrame(push.frame, push.capture);
+            FrameTrace::record("payload", push.time, FrameTrace::now());
+            push.frame = 0;
+            break;
+        }
     }
-    hBuffer.reset();
+}
+
+GstCaps * Server::encodedCaps()
+{
+    Fps fps = Params()->fps;
+    return gst_caps_new_simple(
+                "video/x-h264",
+                "stream-format", G_TYPE_STRING, "byte-stream",
+                "alignment", G_TYPE_STRING,
+                (Params()->sliceDelivery ? "nal" : "au"),
+                "framerate", GST_TYPE_FRACTION, fps.num, fps.den,
+                NULL);
+}
+
+GstClockTime Server::frameDuration()
+{
+    Fps fps = Params()->fps;
+    return gst_util_uint64_scale_int(fps.den, GST_SECOND, fps.num);
+}
 
-    Msg(FILELINE, 3) << "Data request for new frame finished";
+void Server::onBufferRelease0(
+        gpointer pBuffer)
+{
+    // Drops the reference handed over to GStreamer buffer,
+    // so the frame buffer returns back into its pool
+    PooledBufferRef::attach(static_cast<PooledBuffer *>(pBuffer));
+}
+
+    //-- struct Server::SubStream --//
+
+void Server::SubStream::onEncodedData(
+        uint8_t * pData, size_t size)
+{
+    if(!pAppSrc) {
+        Msg(FILELINE, 2) << "Dropping encoded data flushed with no stream";
+        return;
+    }
+
+    // Encoder reuses its output memory, so the data is copied
+    GstBuffer_Handle hBuffer = gst_buffer_new_allocate(NULL, size, NULL);
+    if(!hBuffer) {
+        Msg(FILELINE) << "Could not allocate GStreamer encoded data buffer";
+        return;
+    }
+    gst_buffer_fill(hBuffer, 0, pData, size);
+    if(!pEncoder->keyframe())
+        GST_BUFFER_FLAG_SET((GstBuffer *)hBuffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    GST_BUFFER_PTS((GstBuffer *)hBuffer) = timestamp;
+    GST_BUFFER_DURATION((GstBuffer *)hBuffer) = frameDuration();
+
+    GstFlowReturn ret = gst_app_src_push_buffer(pAppSrc, hBuffer);
+    hBuffer.reset(); // taken by appsrc anyway
+    if(ret != GST_FLOW_OK)
+        Msg(FILELINE) << "Could not push GStreamer buffer, error " << ret;
 }
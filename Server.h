@@ -5,9 +5,21 @@
 #include "Timing.h"
 #include "Scales.h"
 #include "Stateful.h"
+#include "Damage.h"
+#include "Encoder.h"
+#include "CaptureThread.h"
+#include "Record.h"
+#include "GopCache.h"
+#include "WorkerPool.h"
+#include "Trace.h"
+#include "GStreamer.h"
 #include <gst/rtsp-server/rtsp-server.h>
 #include <gst/app/gstappsrc.h>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
     //-- class Server --//
 
@@ -16,23 +28,117 @@ class Server final: public ProcessStateful
 public:
     void run();
 
+    static void initGStreamer();
+    // Encoding part of pipeline description, from raw frames to H.264
+    static std::string encodeDescr(
+            const FrameSize & frameSize, const char * preset);
+
 private:
+    // Simulcast stream on its own mount point, encoded from the image
+    // converted by the main encoder
+    struct SubStream
+    {
+        Server * pServer;
+        const SimulcastStream * pParams;
+        std::unique_ptr<H264Encoder> pEncoder;
+        GstAppSrc * pAppSrc;    // of media, while it has clients
+        GstClockTime timestamp;
+
+        void onEncodedData(uint8_t * pData, size_t size);
+    };
+
+    // Appsrc push of a frame, till its last RTP packet leaves payloader
+    struct TracedPush
+    {
+        GstClockTime timestamp;
+        uint64_t frame;     // 0 when free
+        uint64_t capture;
+        int64_t time;
+    };
+    enum: size_t {
+        tracedPushCount = 16
+    };
+
+    static GstCaps * encodedCaps();
+
     static void onMediaConfigure0(
             GstRTSPMediaFactory * pFactory, GstRTSPMedia * pMedia, Server * pThis);
     void onMediaConfigure(
             GstRTSPMediaFactory * pFactory, GstRTSPMedia * pMedia);
 
+    static void onMediaUnprepared0(
+            GstRTSPMedia * pMedia, Server * pThis);
+    void onMediaUnprepared(
+            GstRTSPMedia * pMedia);
+
+    static void onSubMediaConfigure0(
+            GstRTSPMediaFactory * pFactory, GstRTSPMedia * pMedia, SubStream * pStream);
+    static void onSubMediaUnprepared0(
+            GstRTSPMedia * pMedia, SubStream * pStream);
+    static void onSubNeedData0(
+            GstAppSrc * pAppSrc, guint, SubStream * pStream);
+
+    static void onClientConnected0(
+            GstRTSPServer * pServer, GstRTSPClient * pClient, Server * pThis);
+    static void onPlayRequest0(
+            GstRTSPClient * pClient, GstRTSPContext * pContext, Server * pThis);
+    void onPlayRequest(
+            GstRTSPClient * pClient);
+
     static void onNeedData0(
             GstAppSrc * pAppSrc, guint, Server * pThis);
     void onNeedData(
             GstAppSrc * pAppSrc);
 
-    std::unique_ptr<Capturer> mpCapturer;
+    static void onBufferRelease0(
+            gpointer pBuffer);
+
+    static GstPadProbeReturn onPayloaded0(
+            GstPad * pPad, GstPadProbeInfo * pInfo, Server * pThis);
+    void onPayloaded(
+            GstBuffer * pBuffer);
+    void tracePush(
+            GstClockTime timestamp);
+
+    Frame captureFrame();
+    void encodeFrame(
+            GstAppSrc * pAppSrc, const Frame & frame);
+    static bool streaming(
+            GstAppSrc * pAppSrc);
+    void encodeSimulcast(const Frame & frame);
+    void forceKeyframe();
+    void checkRateControl();
+    void applyGstRateControl(const RateControl & rateControl);
+
+    void onEncodedData(
+            uint8_t * pData, size_t size);
+    bool pushBuffer(
+            GstAppSrc * pAppSrc, GstBuffer_Handle & hBuffer, bool advance = true);
+    static GstClockTime frameDuration();
+
+    std::unique_ptr<PooledFrameSource> mpCapturer;
+    std::unique_ptr<FrameRecorder> mpRecorder;
     std::unique_ptr<Scales> mpScales;
     std::unique_ptr<ScalesLogger> mpScalesLogger;
     std::unique_ptr<ScalesFilter> mpScalesFilter;
+    std::unique_ptr<DamageTracker> mpDamageTracker;
+    std::unique_ptr<CaptureThread> mpCaptureThread;
+    std::unique_ptr<H264Encoder> mpEncoder;
+    GstElement_Handle mhGstEncoder;        // x264enc, for gst encoder type
+    RateControl mRateControl;              // changes requested so far
+    Timeout mControlTimeout = 1000;
+    std::atomic<bool> mKeyframeRequested{false}; // by RTSP thread on PLAY
+    std::unique_ptr<GopCache> mpGopCache;  // fans out to media of each client
+    std::mutex mCacheMutex;                // serializes need-data of media
+    std::vector<std::unique_ptr<SubStream>> mSubStreams;
+    std::unique_ptr<WorkerPool> mpStreamWorkers; // encode streams in parallel
+    GstAppSrc * mpMainAppSrc = nullptr;    // with simulcast, while it has clients
+    GstAppSrc * mpEncoderAppSrc = nullptr; // valid while encoding
     GstClockTime mTimestamp;
     int mFrameSerial;
+    uint64_t mCaptureSerial = 0;           // of the frame being served
+    std::mutex mTraceMutex;                // guards traced pushes
+    TracedPush mTracedPushes[tracedPushCount] = {};
 };
 
 #endif // SERVER_H
@@ -0,0 +1,278 @@
+#include "Synthetic.h"
+#include "Msg.h"
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+const Pixel desktopColor{112, 72, 24, 0};
+const Pixel windowColor{240, 240, 240, 0};
+const Pixel titleColor{160, 96, 32, 0};
+const Pixel textColor{16, 16, 16, 0};
+const Pixel fieldColor{255, 255, 255, 0};
+const Pixel borderColor{128, 128, 128, 0};
+
+// Letters the built-in glyph atlas has, for pseudo words
+const char wordLetters[] = "abcdegklorstwz";
+
+void fillRect(Frame & frame, FramePos pos, FrameSize size, const Pixel & color)
+{
+    int right = std::min<int>(pos.x + size.width, frame.size.width);
+    int bottom = std::min<int>(pos.y + size.height, frame.size.height);
+    for(int y = std::max(pos.y, 0); y < bottom; ++y) {
+        Pixel * p = frame.pLine(y);
+        for(int x = std::max(pos.x, 0); x < right; ++x)
+            p[x] = color;
+    }
+}
+
+void frameRect(Frame & frame, FramePos pos, FrameSize size, const Pixel & color)
+{
+    fillRect(frame, pos, {size.width, 1}, color);
+    fillRect(frame, {pos.x, pos.y + int(size.height) - 1}, {size.width, 1}, color);
+    fillRect(frame, pos, {1, size.height}, color);
+    fillRect(frame, {pos.x + int(size.width) - 1, pos.y}, {1, size.height}, color);
+}
+
+// Copies source rectangle at source position to target position, clipped
+void copyRect(Frame & target, FramePos targetPos,
+              const Frame & source, FramePos sourcePos, FrameSize size)
+{
+    int width = std::min<int>(size.width, std::min<int>(
+                    target.size.width - targetPos.x,
+                    source.size.width - sourcePos.x));
+    int height = std::min<int>(size.height, std::min<int>(
+                    target.size.height - targetPos.y,
+                    source.size.height - sourcePos.y));
+    if(width <= 0)
+        return;
+    for(int y = 0; y < height; ++y) {
+        memcpy(target.pLine(targetPos.y + y) + targetPos.x,
+               source.pLine(sourcePos.y + y) + sourcePos.x,
+               width * sizeof(Pixel));
+    }
+}
+
+} // namespace
+
+    //-- class SyntheticCapturer --//
+
+SyntheticCapturer::SyntheticCapturer(SyntheticWorkload workload,
+                                     const FrameSize & frameSize,
+                                     unsigned changedPercent):
+    mWorkload(workload), mFrameSize(frameSize),
+    mChangedPercent(std::min(changedPercent, 100u)), mGlyphs(1),
+    mDesktopPixels(frameSize.area()), mDesktop(frameSize, mDesktopPixels),
+    mCanvasPixels(frameSize.area()), mCanvas(frameSize, mCanvasPixels),
+    mAreaPos{0, 0}, mAreaSize{0, 0}, mFrameIndex(0), mRandom(2463534242u)
+{
+    Msg(FILELINE, 2) << "Preparing synthetic desktop of "
+                     << frameSize.width << "x" << frameSize.height;
+    paintDesktop();
+    memcpy(mCanvas.pPixels, mDesktop.pPixels, mDesktop.dataSize());
+
+    if(mWorkload == SyntheticWorkload::text) {
+        mAreaPos = {int(frameSize.width / 8), int(frameSize.height / 8)};
+        mAreaSize = {frameSize.width * 3 / 4, frameSize.height * 3 / 4};
+        paintTextPage();
+    } else if(mWorkload == SyntheticWorkload::window) {
+        mAreaSize = {frameSize.width / 3, frameSize.height / 3};
+        paintWindow();
+    } else if(mWorkload == SyntheticWorkload::video) {
+        mAreaPos = {int(frameSize.width / 2), int(frameSize.height / 4)};
+        mAreaSize = {frameSize.width / 4, frameSize.height / 4};
+    } else if(mWorkload == SyntheticWorkload::form) {
+        paintForm();
+    }
+}
+
+Frame SyntheticCapturer::getFrame()
+{
+    MSG_TRACE(3) << "Generating synthetic frame " << mFrameIndex;
+
+    switch(mWorkload) {
+        case SyntheticWorkload::still:
+            break;
+        case SyntheticWorkload::text:
+            updateText();
+            break;
+        case SyntheticWorkload::window:
+            updateWindow();
+            break;
+        case SyntheticWorkload::video:
+            updateVideo();
+            break;
+        case SyntheticWorkload::form:
+            updateForm();
+            break;
+    }
+    ++mFrameIndex;
+
+    Frame frame = acquireFrame(mFrameSize);
+    memcpy(frame.pPixels, mCanvas.pPixels, frame.dataSize());
+    addChanges(frame);
+    return frame;
+}
+
+void SyntheticCapturer::paintDesktop()
+{
+    // Vertical gradient
+    for(size_t y = 0; y < mFrameSize.height; ++y) {
+        unsigned shade = 48 * y / mFrameSize.height;
+        Pixel color{uint8_t(desktopColor.B + shade), uint8_t(desktopColor.G + shade / 2),
+                    uint8_t(desktopColor.R), 0};
+        fillRect(mDesktop, {0, int(y)}, {mFrameSize.width, 1}, color);
+    }
+
+    // Column of icons with captions
+    for(int i = 0; i < 6; ++i) {
+        FramePos pos{16, 16 + i * 80};
+        fillRect(mDesktop, pos, {48, 48}, {uint8_t(64 + i * 32), 160, uint8_t(224 - i * 24), 0});
+        frameRect(mDesktop, pos, {48, 48}, {255, 255, 255, 0});
+        mGlyphs.drawText(mDesktop, {pos.x, pos.y + 52}, "doc" + std::to_string(i),
+                         {255, 255, 255, 0});
+    }
+
+    // Taskbar with clock
+    int taskbarTop = int(mFrameSize.height) - 32;
+    fillRect(mDesktop, {0, taskbarTop}, {mFrameSize.width, 32}, {48, 40, 32, 0});
+    fillRect(mDesktop, {4, taskbarTop + 4}, {64, 24}, {80, 128, 32, 0});
+    mGlyphs.drawText(mDesktop, {int(mFrameSize.width) - 48, taskbarTop + 12}, "12:00",
+                     {255, 255, 255, 0});
+}
+
+void SyntheticCapturer::paintTextPage()
+{
+    // Page of pseudo text twice as high as the view, scrolled cyclically
+    mSpritePixels = Buffer<Pixel>(mAreaSize.width * mAreaSize.height * 2);
+    mSprite = Frame({mAreaSize.width, mAreaSize.height * 2}, mSpritePixels);
+    fillRect(mSprite, {0, 0}, mSprite.size, windowColor);
+
+    uint32_t seed = 12345;
+    auto next = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 16;
+    };
+    const int lineHeight = int(mGlyphs.textHeight()) + 3;
+    const size_t maxChars = (mAreaSize.width - 16) / 6;
+    for(int y = 4; y + lineHeight <= int(mSprite.size.height); y += lineHeight) {
+        std::string line;
+        size_t length = next() % maxChars;
+        while(line.size() < length) {
+            size_t wordLength = 1 + next() % 8;
+            for(size_t i = 0; i < wordLength; ++i)
+                line += wordLetters[next() % (sizeof(wordLetters) - 1)];
+            line += ' ';
+        }
+        line.resize(std::min(line.size(), maxChars));
+        mGlyphs.drawText(mSprite, {8, y}, line, textColor);
+    }
+}
+
+void SyntheticCapturer::paintWindow()
+{
+    mSpritePixels = Buffer<Pixel>(mAreaSize.area());
+    mSprite = Frame(mAreaSize, mSpritePixels);
+    fillRect(mSprite, {0, 0}, mAreaSize, windowColor);
+    fillRect(mSprite, {0, 0}, {mAreaSize.width, 20}, titleColor);
+    mGlyphs.drawText(mSprite, {6, 6}, "Document 1", {255, 255, 255, 0});
+    frameRect(mSprite, {0, 0}, mAreaSize, borderColor);
+    for(int y = 28; y + 12 < int(mAreaSize.height); y += 12)
+        mGlyphs.drawText(mSprite, {8, y}, "lorem data 0123456789 or: stable weight", textColor);
+}
+
+void SyntheticCapturer::paintForm()
+{
+    FramePos formPos{int(mFrameSize.width / 4), int(mFrameSize.height / 6)};
+    FrameSize formSize{mFrameSize.width / 2, mFrameSize.height * 2 / 3};
+    fillRect(mCanvas, formPos, formSize, windowColor);
+    fillRect(mCanvas, formPos, {formSize.width, 20}, titleColor);
+    frameRect(mCanvas, formPos, formSize, borderColor);
+    mGlyphs.drawText(mCanvas, {formPos.x + 6, formPos.y + 6}, "Order form",
+                     {255, 255, 255, 0});
+
+    const char * labels[] = {"Order:", "Date:", "Total:", "Weight:", "Comment:"};
+    for(int i = 0; i < 5; ++i) {
+        int y = formPos.y + 40 + i * 32;
+        mGlyphs.drawText(mCanvas, {formPos.x + 12, y + 6}, labels[i], textColor);
+        FramePos fieldPos{formPos.x + 96, y};
+        FrameSize fieldSize{formSize.width - 120, 20};
+        fillRect(mCanvas, fieldPos, fieldSize, fieldColor);
+        frameRect(mCanvas, fieldPos, fieldSize, borderColor);
+    }
+    mGlyphs.drawText(mCanvas, {formPos.x + 100, formPos.y + 46}, "12345", textColor);
+
+    // Text cursor goes right after the text of the first field
+    mAreaPos = {formPos.x + 100 + int(mGlyphs.textWidth("12345")) + 2, formPos.y + 43};
+    mAreaSize = {2, 14};
+    memcpy(mDesktop.pPixels, mCanvas.pPixels, mCanvas.dataSize());
+}
+
+void SyntheticCapturer::updateText()
+{
+    // Scrolls by 4 pixels per frame
+    size_t offset = (mFrameIndex * 4) % mSprite.size.height;
+    size_t firstPart = std::min(mAreaSize.height, mSprite.size.height - offset);
+    copyRect(mCanvas, mAreaPos, mSprite, {0, int(offset)},
+             {mAreaSize.width, firstPart});
+    if(firstPart < mAreaSize.height) {
+        copyRect(mCanvas, {mAreaPos.x, mAreaPos.y + int(firstPart)}, mSprite, {0, 0},
+                 {mAreaSize.width, mAreaSize.height - firstPart});
+    }
+}
+
+void SyntheticCapturer::updateWindow()
+{
+    // Restores the desktop under the window and moves it along a Lissajous curve
+    copyRect(mCanvas, mAreaPos, mDesktop, mAreaPos, mAreaSize);
+    double t = mFrameIndex * 0.05;
+    mAreaPos = {
+        int((mFrameSize.width - mAreaSize.width) * (0.5 + 0.5 * std::sin(t))),
+        int((mFrameSize.height - mAreaSize.height) * (0.5 + 0.5 * std::sin(t * 0.7)))};
+    copyRect(mCanvas, mAreaPos, mSprite, {0, 0}, mAreaSize);
+}
+
+void SyntheticCapturer::updateVideo()
+{
+    unsigned t = mFrameIndex;
+    for(size_t y = 0; y < mAreaSize.height; ++y) {
+        Pixel * p = mCanvas.pLine(mAreaPos.y + y) + mAreaPos.x;
+        for(size_t x = 0; x < mAreaSize.width; ++x, ++p) {
+            unsigned noise = random() & 15;
+            p->B = uint8_t(((x + t * 3) ^ (y * 2)) + noise);
+            p->G = uint8_t(((y + t * 5) ^ x) + noise);
+            p->R = uint8_t(((x + y) / 2 + t * 7) + noise);
+        }
+    }
+}
+
+void SyntheticCapturer::updateForm()
+{
+    // Cursor blinks every 8 frames
+    bool visible = (mFrameIndex / 8) % 2 == 0;
+    if(visible)
+        fillRect(mCanvas, mAreaPos, mAreaSize, textColor);
+    else
+        copyRect(mCanvas, mAreaPos, mDesktop, mAreaPos, mAreaSize);
+}
+
+void SyntheticCapturer::addChanges(Frame & frame)
+{
+    size_t area = mFrameSize.area();
+    size_t count = area * mChangedPercent / 100;
+    Pixel * pPixels = frame.pPixels;
+    for(size_t i = 0; i < count; ++i) {
+        uint32_t value = random();
+        pPixels[random() % area] = {uint8_t(value), uint8_t(value >> 8),
+                                    uint8_t(value >> 16), 0};
+    }
+}
+
+uint32_t SyntheticCapturer::random()
+{
+    // xorshift32
+    mRandom ^= mRandom << 13;
+    mRandom ^= mRandom >> 17;
+    mRandom ^= mRandom << 5;
+    return mRandom;
+}
@@ -0,0 +1,70 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include "Frame.h"
+#include "Glyphs.h"
+#include "Buffer.h"
+
+    //-- enum struct SyntheticWorkload --//
+
+enum struct SyntheticWorkload {
+    still,      // desktop with nothing going on
+    text,       // scrolling text in a big editor window
+    window,     // window moving over desktop
+    video,      // video-like region with every pixel changing
+    form        // mostly static form with blinking text cursor
+};
+
+    //-- class SyntheticCapturer --//
+
+// Generates desktop-like frames of any size with no display at all.
+// Content of the n-th frame depends only on workload, frame size, changed
+// pixels percent and n, so runs are reproducible. Changed pixels percent
+// adds that share of randomly placed noise pixels to every frame handed
+// out, not to the desktop itself, so noise doesn't build up over the run.
+// Needs no display nor any platform API, so it runs on a build box too
+
+class SyntheticCapturer final: public PooledFrameSource
+{
+public:
+    SyntheticCapturer(SyntheticWorkload workload, const FrameSize & frameSize,
+                      unsigned changedPercent = 0);
+
+    // deleted
+    SyntheticCapturer(const SyntheticCapturer &) = delete;
+    SyntheticCapturer & operator = (const SyntheticCapturer &) = delete;
+
+    virtual Frame getFrame() override;
+    virtual FrameSize frameSize() const override {
+        return mFrameSize;
+    }
+
+private:
+    void paintDesktop();
+    void paintTextPage();
+    void paintWindow();
+    void paintForm();
+    void updateText();
+    void updateWindow();
+    void updateVideo();
+    void updateForm();
+    void addChanges(Frame & frame);
+    uint32_t random();
+
+    SyntheticWorkload mWorkload;
+    FrameSize mFrameSize;
+    unsigned mChangedPercent;
+    GlyphAtlas mGlyphs;
+    Buffer<Pixel> mDesktopPixels;   // static background
+    Frame mDesktop;
+    Buffer<Pixel> mCanvasPixels;    // current content
+    Frame mCanvas;
+    Buffer<Pixel> mSpritePixels;    // text page or window
+    Frame mSprite;
+    FramePos mAreaPos;              // text view, window, video or cursor
+    FrameSize mAreaSize;
+    size_t mFrameIndex;
+    uint32_t mRandom;
+};
+
+#endif // SYNTHETIC_H
@@ -1,4 +1,5 @@
 #include "SysHandler.h"
+#include "Msg.h"
 #include <iostream>
 #include <csignal>
 #include <cstdlib>
@@ -36,6 +37,8 @@ void SysHandler::init()
 
 void SysHandler::signalHandler(int signal)
 {
+    // Queued log lines go first
+    Msg::flush();
     switch(signal) {
         case SIGSEGV:
             std::cerr << "Segmentation fault" << std::endl;
@@ -56,6 +59,7 @@ void SysHandler::signalHandler(int signal)
 
 void SysHandler::terminateHandler()
 {
+    Msg::flush();
     try {
         throw;
     }
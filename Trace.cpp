@@ -0,0 +1,308 @@
+#include "Trace.h"
+#include "Msg.h"
+#include "Common.h"
+#include "Win.h"
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/* Qt 5.6.3's GCC 4.9.2 doesn't need it:
+#ifdef __MINGW32__
+#include <mingw.mutex.h>
+#endif
+/**/
+
+namespace {
+
+const size_t ringSpans = 4096;  // per thread, power of 2
+const size_t maxRings = 64;     // live threads beyond it aren't traced
+
+} // namespace
+
+    //-- class FrameTrace --//
+
+// Written by the owner thread only. Spans are read by dump with no locking
+// either, the ones possibly overwritten meanwhile are thrown away. Ring of
+// exited thread is kept for dump till it's taken over by a new thread
+struct FrameTrace::Ring
+{
+    struct Span
+    {
+        const char * pStage;
+        uint64_t frame;
+        uint64_t capture;
+        int64_t start;
+        int64_t end;
+    };
+
+    Ring():
+        count(0), frame(0), capture(0), pName(nullptr) {}
+
+    Span spans[ringSpans];
+    std::atomic<uint64_t> count;        // recorded so far
+    uint64_t frame;                     // tags of further spans
+    uint64_t capture;
+    std::atomic<const char *> pName;    // of the owner thread
+    HANDLE_Handle hThread;              // owner, to see if it exited
+};
+
+struct FrameTrace::Registry
+{
+    std::mutex mutex;   // guards ring list, not the rings
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+std::atomic<bool> FrameTrace::mEnabled(false);
+
+void FrameTrace::setFrame(uint64_t frame, uint64_t capture)
+{
+    if(!enabled())
+        return;
+    Ring * pRing = ring();
+    if(pRing) {
+        pRing->frame = frame;
+        pRing->capture = capture;
+    }
+}
+
+void FrameTrace::setCapture(uint64_t capture)
+{
+    setFrame(0, capture);
+}
+
+void FrameTrace::setThreadName(const char * pName)
+{
+    if(!enabled())
+        return;
+    Ring * pRing = ring();
+    if(pRing)
+        pRing->pName = pName;
+}
+
+int64_t FrameTrace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void FrameTrace::record(const char * pStage, int64_t start, int64_t end)
+{
+    Ring * pRing = ring();
+    if(!pRing)
+        return;
+    uint64_t count = pRing->count.load(std::memory_order_relaxed);
+    Ring::Span & span = pRing->spans[count & (ringSpans - 1)];
+    span.pStage = pStage;
+    span.frame = pRing->frame;
+    span.capture = pRing->capture;
+    span.start = start;
+    span.end = end;
+    pRing->count.store(count + 1, std::memory_order_release);
+}
+
+void FrameTrace::request(const std::string & fileName)
+{
+    // Running process may have another current folder
+    char fullName[MAX_PATH];
+    if(!_fullpath(fullName, fileName.data(), sizeof(fullName))) {
+        Msg(FILELINE) << "Invalid frame trace file name: \"" << fileName << "\"";
+        return;
+    }
+
+    Msg(FILELINE, 2) << "Writing frame trace control file";
+    std::FILE * pFile = std::fopen(controlFileName().data(), "w");
+    if(!pFile) {
+        Msg(FILELINE) << "Could not write frame trace control file";
+        return;
+    }
+    std::fputs(fullName, pFile);
+    std::fclose(pFile);
+
+    Msg(FILELINE) << "Frame trace dump requested into \"" << fullName << "\"";
+}
+
+void FrameTrace::checkRequest()
+{
+    std::FILE * pFile = std::fopen(controlFileName().data(), "r");
+    if(!pFile)
+        return;
+
+    Msg(FILELINE, 2) << "Reading frame trace control file";
+    std::string fileName;
+    char buf[4096];
+    if(std::fgets(buf, sizeof(buf), pFile))
+        fileName = buf;
+    std::fclose(pFile);
+    std::remove(controlFileName().data());
+    while(!fileName.empty() && (fileName.back() == '\n' || fileName.back() == '\r'))
+        fileName.pop_back();
+
+    if(!enabled()) {
+        Msg(FILELINE) << "Frame trace dump requested, but tracing isn't enabled";
+        return;
+    }
+    if(!fileName.empty())
+        dump(fileName);
+}
+
+bool FrameTrace::dump(const std::string & fileName)
+{
+    struct Snapshot
+    {
+        const char * pName;
+        std::vector<Ring::Span> spans;
+    };
+
+    Msg(FILELINE, 2) << "Taking frame trace snapshot";
+    std::vector<Snapshot> snapshots;
+    {
+        std::lock_guard<std::mutex> registryGuard(registry().mutex);
+        for(auto & pRing: registry().rings) {
+            snapshots.push_back(Snapshot{pRing->pName, {}});
+            std::vector<Ring::Span> & spans = snapshots.back().spans;
+            uint64_t last = pRing->count.load(std::memory_order_acquire);
+            uint64_t first = (last > ringSpans ? last - ringSpans : 0);
+            for(uint64_t i = first; i < last; ++i)
+                spans.push_back(pRing->spans[i & (ringSpans - 1)]);
+            // Owner went on meanwhile, and may be writing over the next slot
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t count = pRing->count.load(std::memory_order_relaxed);
+            uint64_t valid = (count + 1 > ringSpans ? count + 1 - ringSpans : 0);
+            if(valid > first)
+                spans.erase(spans.begin(), spans.begin() +
+                            std::min<uint64_t>(valid - first, spans.size()));
+        }
+    }
+
+    // Capture thread doesn't know which need-data its frame goes to
+    std::map<uint64_t, uint64_t> captureFrames;
+    int64_t origin = std::numeric_limits<int64_t>::max();
+    for(const Snapshot & snapshot: snapshots) {
+        for(const Ring::Span & span: snapshot.spans) {
+            if(span.frame && span.capture) {
+                auto it = captureFrames.find(span.capture);
+                if(it == captureFrames.end() || it->second > span.frame)
+                    captureFrames[span.capture] = span.frame;
+            }
+            origin = std::min(origin, span.start);
+        }
+    }
+
+    Msg(FILELINE) << "Dumping frame trace into \"" << fileName << "\"";
+    std::FILE * pFile = std::fopen(fileName.data(), "w");
+    if(!pFile) {
+        Msg(FILELINE) << "Could not open frame trace file";
+        return false;
+    }
+
+    std::fputs("{\"traceEvents\":[", pFile);
+    const char * pSeparator = "\n";
+    size_t spanCount = 0;
+    for(size_t tid = 0; tid < snapshots.size(); ++tid) {
+        const Snapshot & snapshot = snapshots[tid];
+        if(snapshot.pName) {
+            std::fprintf(pFile, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                                "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                         pSeparator, unsigned(tid), snapshot.pName);
+            pSeparator = ",\n";
+        }
+        for(const Ring::Span & span: snapshot.spans) {
+            uint64_t frame = span.frame;
+            if(!frame && span.capture) {
+                auto it = captureFrames.find(span.capture);
+                if(it != captureFrames.end())
+                    frame = it->second;
+            }
+            std::fprintf(pFile, "%s{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\","
+                                "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                                "\"args\":{\"frame\":%" PRIu64 ",\"capture\":%" PRIu64 "}}",
+                         pSeparator, span.pStage, unsigned(tid),
+                         (span.start - origin) / 1000.0,
+                         (span.end - span.start) / 1000.0,
+                         frame, span.capture);
+            pSeparator = ",\n";
+            ++spanCount;
+        }
+    }
+    std::fputs("\n],\"displayTimeUnit\":\"ms\"}\n", pFile);
+
+    bool ok = !std::ferror(pFile);
+    if(std::fclose(pFile) || !ok) {
+        Msg(FILELINE) << "Could not write frame trace file";
+        return false;
+    }
+    Msg(FILELINE) << "Frame trace of " << spanCount << " spans of "
+                  << snapshots.size() << " threads dumped";
+    return true;
+}
+
+FrameTrace::Ring * FrameTrace::ring()
+{
+    // Plain pointers, as thread_local destructors aren't reliable on MinGW.
+    // Rings outlive their threads, so the dump still has their spans, and
+    // are taken over by new threads once there are too many
+    static thread_local Ring * tpRing = nullptr;
+    static thread_local bool tRegistered = false;
+    if(tRegistered)
+        return tpRing;
+    tRegistered = true;
+
+    HANDLE_Handle hThread;
+    if(!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
+                        GetCurrentProcess(), &hThread,
+                        SYNCHRONIZE, FALSE, 0)) {
+        Msg(FILELINE) << "Could not get thread handle for frame trace, "
+                         "not tracing this thread";
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> registryGuard(registry().mutex);
+    if(registry().rings.size() < maxRings) {
+        registry().rings.push_back(std::make_unique<Ring>());
+        tpRing = registry().rings.back().get();
+    } else {
+        // Takes over the ring of exited thread with the oldest spans
+        int64_t oldest = std::numeric_limits<int64_t>::max();
+        for(auto & pRing: registry().rings) {
+            if(WaitForSingleObject(pRing->hThread, 0) != WAIT_OBJECT_0)
+                continue;
+            uint64_t count = pRing->count.load(std::memory_order_relaxed);
+            int64_t last = (count ? pRing->spans[(count - 1) & (ringSpans - 1)].end
+                                  : std::numeric_limits<int64_t>::min());
+            if(!tpRing || last < oldest) {
+                tpRing = pRing.get();
+                oldest = last;
+            }
+        }
+        if(!tpRing) {
+            Msg(FILELINE) << "Too many threads for frame trace, not tracing this one";
+            return nullptr;
+        }
+        // Dump holds registry lock, so it doesn't see the reset halfway
+        Msg(FILELINE, 2) << "Reusing frame trace ring of exited thread";
+        tpRing->count.store(0, std::memory_order_relaxed);
+        tpRing->frame = 0;
+        tpRing->capture = 0;
+        tpRing->pName = nullptr;
+    }
+    tpRing->hThread = std::move(hThread);
+    return tpRing;
+}
+
+FrameTrace::Registry & FrameTrace::registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+std::string FrameTrace::controlFileName()
+{
+    return CharText(getTempPath() + "wdvc.trc").str();
+}
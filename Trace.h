@@ -0,0 +1,87 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+    //-- class FrameTrace --//
+
+// Per-frame spans of pipeline stages, to see where the time goes from screen
+// capture to RTP packets. Each thread records into its own ring, with no
+// locking, ring being registered on the first span of the thread, and taken
+// over by a later thread once the owner exited and the rings ran out. Spans are
+// tagged with frame serial of need-data set for the thread, and capture
+// serial as well, so spans of capture thread get their frame serials too once
+// the captured frame is handed out. Dump is Chrome trace-event JSON, to be
+// opened by chrome://tracing or Perfetto. Recording is off unless enabled,
+// then a span costs a flag check only
+
+class FrameTrace final
+{
+public:
+    static void enable(bool enabled = true) {
+        mEnabled.store(enabled, std::memory_order_relaxed);
+    }
+    static bool enabled() {
+        return mEnabled.load(std::memory_order_relaxed);
+    }
+
+    // Tags further spans of the calling thread, 0 for unknown
+    static void setFrame(uint64_t frame, uint64_t capture);
+    static void setCapture(uint64_t capture);
+    static void setThreadName(const char * pName);
+
+    static int64_t now(); // in nanoseconds, monotonic
+    // Stage name must be a literal, or otherwise outlive the trace
+    static void record(const char * pStage, int64_t start, int64_t end);
+
+    // Request is a control file in temp folder holding the dump file name,
+    // taken by the running process on its next check
+    static void request(const std::string & fileName);
+    static void checkRequest();
+    static bool dump(const std::string & fileName);
+
+private:
+    struct Ring;
+    struct Registry;
+
+    static Ring * ring();
+    static Registry & registry();
+    static std::string controlFileName();
+
+    static std::atomic<bool> mEnabled;
+};
+
+    //-- class TraceSpan --//
+
+// Records a span from construction till end() or destruction
+
+class TraceSpan final
+{
+public:
+    explicit TraceSpan(const char * pStage):
+        mpStage(FrameTrace::enabled() ? pStage : nullptr),
+        mStart(mpStage ? FrameTrace::now() : 0) {}
+
+    ~TraceSpan() {
+        end();
+    }
+
+    // deleted
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan & operator = (const TraceSpan &) = delete;
+
+    void end() {
+        if(mpStage) {
+            FrameTrace::record(mpStage, mStart, FrameTrace::now());
+            mpStage = nullptr;
+        }
+    }
+
+private:
+    const char * mpStage;
+    int64_t mStart;
+};
+
+#endif // TRACE_H
@@ -0,0 +1,75 @@
+#include "WorkerPool.h"
+#include "Msg.h"
+
+    //-- class WorkerPool --//
+
+WorkerPool::WorkerPool(size_t threadCount):
+    mpTask(nullptr), mTaskCount(0), mNextTask(0), mPendingTasks(0),
+    mStop(false)
+{
+    Msg(FILELINE, 2) << "Starting " << threadCount << " worker threads";
+    for(size_t i = 0; i < threadCount; ++i)
+        mThreads.emplace_back(&WorkerPool::workerMain, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mStartCond.notify_all();
+    for(std::thread & thread: mThreads)
+        thread.join();
+}
+
+void WorkerPool::run(size_t taskCount, const Task & task)
+{
+    if(!taskCount)
+        return;
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mpTask = &task;
+    mTaskCount = taskCount;
+    mNextTask = 0;
+    mPendingTasks = taskCount;
+    if(taskCount > 1)
+        mStartCond.notify_all();
+
+    while(mNextTask < mTaskCount) {
+        size_t taskIdx = mNextTask++;
+        lock.unlock();
+        task(taskIdx);
+        lock.lock();
+        finishTask();
+    }
+
+    mDoneCond.wait(lock, [this]() { return !mPendingTasks; });
+    mpTask = nullptr;
+}
+
+void WorkerPool::workerMain()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    for(;;) {
+        mStartCond.wait(lock, [this]() {
+            return mStop || (mpTask && mNextTask < mTaskCount);
+        });
+        if(mStop)
+            return;
+
+        // Task stays valid, as run() waits for all the pending tasks
+        size_t taskIdx = mNextTask++;
+        const Task & task = *mpTask;
+        lock.unlock();
+        task(taskIdx);
+        lock.lock();
+        finishTask();
+    }
+}
+
+void WorkerPool::finishTask()
+{
+    if(!--mPendingTasks)
+        mDoneCond.notify_all();
+}
@@ -0,0 +1,57 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Qt 5.6.3's GCC 4.9.2 doesn't need it:
+#ifdef __MINGW32__
+#include <mingw.thread.h>
+#include <mingw.mutex.h>
+#include <mingw.condition_variable.h>
+#endif
+/**/
+
+    //-- class WorkerPool --//
+
+// Persistent threads running indexed tasks of a job in parallel. Calling
+// thread takes part in the job too, and run() returns only after all the
+// tasks are done, so it's a join barrier as well
+
+class WorkerPool final
+{
+public:
+    using Task = std::function<void(size_t taskIdx)>;
+
+    explicit WorkerPool(size_t threadCount); // besides the calling thread
+    ~WorkerPool();
+
+    // deleted
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool & operator = (const WorkerPool &) = delete;
+
+    size_t threadCount() const {
+        return mThreads.size();
+    }
+
+    void run(size_t taskCount, const Task & task);
+
+private:
+    void workerMain();
+    void finishTask();
+
+    std::vector<std::thread> mThreads;
+    std::mutex mMutex;
+    std::condition_variable mStartCond;
+    std::condition_variable mDoneCond;
+    const Task * mpTask;
+    size_t mTaskCount;
+    size_t mNextTask;
+    size_t mPendingTasks;
+    bool mStop;
+};
+
+#endif // WORKERPOOL_H
@@ -3,6 +3,9 @@
 #include "Common.h"
 #include "Daemon.h"
 #include "Server.h"
+#include "Bench.h"
+#include "Record.h"
+#include "Trace.h"
 #include "Msg.h"
 #include <iostream>
 
@@ -54,6 +57,32 @@ int main(int argc, char *argv[])
             server.run();
             break;
         }
+        case Option::bench:
+        {
+            Bench bench;
+            bench.run();
+            break;
+        }
+        case Option::record:
+        {
+            FrameRecorder::request(Params()->recordFile);
+            break;
+        }
+        case Option::endrecord:
+        {
+            FrameRecorder::cancel();
+            break;
+        }
+        case Option::tune:
+        {
+            RateControl::request(Params()->tuneRate);
+            break;
+        }
+        case Option::trace:
+        {
+            FrameTrace::request(Params()->traceFile);
+            break;
+        }
         case Option::help:
         {
             Params()->showUsage();
@@ -9,6 +9,9 @@ CONFIG -= qt
 
 CONFIG += c++14
 
+# Trace level 3 messages cost nothing in release build
+CONFIG(release, debug|release): DEFINES += MSG_MAX_LEVEL=2
+
 QMAKE_CXXFLAGS_WARN_ON -= -Wall
 QMAKE_CXXFLAGS += -Wall
 QMAKE_CXXFLAGS += -Wno-comment -Wno-unused-parameter
@@ -36,7 +39,8 @@ LIBS += \
 
 CONFIG += link_pkgconfig
 PKGCONFIG += libswscale libavutil x264 \
-    gstreamer-1.0 gstreamer-rtsp-server-1.0 gstreamer-app-1.0
+    gstreamer-1.0 gstreamer-rtsp-server-1.0 gstreamer-app-1.0 \
+    gstreamer-video-1.0 gstreamer-rtp-1.0
 
 SOURCES += \
     main.cpp \
@@ -48,8 +52,22 @@ SOURCES += \
     Server.cpp \
     Frame.cpp \
     Scales.cpp \
+    SerialPort.cpp \
     Msg.cpp \
-    Encoder.cpp
+    Encoder.cpp \
+    BufferPool.cpp \
+    Damage.cpp \
+    Convert.cpp \
+    Blend.cpp \
+    Glyphs.cpp \
+    CaptureThread.cpp \
+    Synthetic.cpp \
+    Bench.cpp \
+    Record.cpp \
+    Replay.cpp \
+    WorkerPool.cpp \
+    GopCache.cpp \
+    Trace.cpp
 
 HEADERS += \
     Capturer.h \
@@ -63,6 +81,7 @@ HEADERS += \
     Params.h \
     Server.h \
     Scales.h \
+    SerialPort.h \
     Msg.h \
     Stateful.h \
     Blend.h \
@@ -79,16 +98,17 @@ HEADERS += \
     Sink.h \
     x264.h \
     ffmpeg.h \
-    Ptr.h
-
-DISTFILES += \
-    Blend.asm
-
-ASM_SOURCES = $$find(DISTFILES, .*\.asm)
-
-fasm.name = fasm
-fasm.input = ASM_SOURCES
-fasm.output = ${QMAKE_VAR_OBJECTS_DIR}${QMAKE_FILE_BASE}.o
-fasm.commands = fasm ${QMAKE_FILE_NAME} ${QMAKE_FILE_OUT}
-
-QMAKE_EXTRA_COMPILERS += fasm
+    Ptr.h \
+    BufferPool.h \
+    Damage.h \
+    Cpu.h \
+    Convert.h \
+    Glyphs.h \
+    CaptureThread.h \
+    Synthetic.h \
+    Bench.h \
+    Record.h \
+    Replay.h \
+    WorkerPool.h \
+    GopCache.h \
+    Trace.h